@@ -0,0 +1,447 @@
+// Renders frames offscreen through render_game and prints timings as JSON, for measuring
+// renderer changes without a display or GPU. Works with Mesa's llvmpipe software renderer.
+//
+// Usage: render_bench [--frames N] [--warmup N] [--size WIDTHxHEIGHT] [--stress SIDE]
+//                     [--editor] [--gpu-driven] [--gpu-stats] [--depth-prepass] [--no-occlusion]
+//                     [--output FILE] [--trace FILE] [--ppm FILE] [--expect CHECKSUM]
+//
+// --stress adds a SIDE x SIDE grid of objects to the scene. --gpu-driven draws the scene with
+// GPU culling and multi-draw indirect, if the context supports it. Its instance and triangle
+// counts are null unless --gpu-stats reads them back, which waits for the GPU and so slows
+// the frames down. --depth-prepass draws the main pass's depth before shading it.
+// --no-occlusion turns off software occlusion culling.
+// The checksum is a hash of the last frame's pixels; with --expect the run fails if it
+// differs, to catch rendering regressions.
+
+#include "rendering.h"
+#include "entity.h"
+#include "game.h"
+#include "profiler.h"
+#include "asset_cache.h" // for hash_data
+
+#include "GL/glew.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using hbmath::Vec2;
+using hbmath::Vec3;
+
+struct BenchOptions
+{
+    u32 frames = 300;
+    u32 warmup = 30;
+    int width = 1280;
+    int height = 720;
+    u32 stress_side = 0;
+    bool editor = false;
+    bool gpu_driven = false;
+    bool gpu_stats = false;
+    bool depth_prepass = false;
+    bool occlusion_culling = true;
+    const char* output_path = nullptr;
+    const char* trace_path = nullptr;
+    const char* ppm_path = nullptr;
+    const char* expected_checksum = nullptr;
+};
+
+static bool parse_options(int argc, char** argv, BenchOptions* options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (!strcmp(arg, "--editor"))
+        {
+            options->editor = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "--gpu-driven"))
+        {
+            options->gpu_driven = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "--gpu-stats"))
+        {
+            options->gpu_stats = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "--depth-prepass"))
+        {
+            options->depth_prepass = true;
+            continue;
+        }
+
+        if (!strcmp(arg, "--no-occlusion"))
+        {
+            options->occlusion_culling = false;
+            continue;
+        }
+
+        if (!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return false;
+        }
+        ++i;
+
+        if (!strcmp(arg, "--frames"))
+        {
+            options->frames = strtoul(value, nullptr, 10);
+        }
+        else if (!strcmp(arg, "--warmup"))
+        {
+            options->warmup = strtoul(value, nullptr, 10);
+        }
+        else if (!strcmp(arg, "--size"))
+        {
+            if (sscanf(value, "%dx%d", &options->width, &options->height) != 2)
+            {
+                fprintf(stderr, "Expected WIDTHxHEIGHT, got %s\n", value);
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--stress"))
+        {
+            options->stress_side = strtoul(value, nullptr, 10);
+        }
+        else if (!strcmp(arg, "--output"))
+        {
+            options->output_path = value;
+        }
+        else if (!strcmp(arg, "--trace"))
+        {
+            options->trace_path = value;
+        }
+        else if (!strcmp(arg, "--ppm"))
+        {
+            options->ppm_path = value;
+        }
+        else if (!strcmp(arg, "--expect"))
+        {
+            options->expected_checksum = value;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        }
+    }
+
+    if (!options->frames || options->width <= 0 || options->height <= 0)
+    {
+        fprintf(stderr, "Frames and size must be positive\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Creates a context without any surface, rendering only to framebuffer objects
+static bool create_headless_context()
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+    auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display)
+    {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+
+    if (display == EGL_NO_DISPLAY)
+    {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+        fprintf(stderr, "Error initializing EGL\n");
+        return false;
+    }
+
+    // Configs default to window surfaces, which the surfaceless platform doesn't have
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint config_count;
+    if (!eglChooseConfig(display, config_attributes, &config, 1, &config_count) || !config_count)
+    {
+        fprintf(stderr, "No EGL config supports OpenGL\n");
+        return false;
+    }
+
+    eglBindAPI(EGL_OPENGL_API);
+
+    EGLint context_attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_NONE
+    };
+
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+        fprintf(stderr, "Error creating an OpenGL 3.3 context\n");
+        return false;
+    }
+
+    glewExperimental = GL_TRUE;
+    GLenum glew_error = glewInit();
+
+    // Without an X display GLEW can't load the GLX extensions, which aren't used
+    if (glew_error != GLEW_OK && glew_error != GLEW_ERROR_NO_GLX_DISPLAY)
+    {
+        fprintf(stderr, "Error initializing GLEW: %s\n", glewGetErrorString(glew_error));
+        return false;
+    }
+
+    return true;
+}
+
+// Fills a square around the origin with objects, two units apart
+static void add_stress_scene(u32 side)
+{
+    render::RenderObjectIndex objects[] = {
+        render::cube,
+        render::load_obj("building.obj"),
+        render::load_obj("bettermug.obj"),
+    };
+    u32 object_count = sizeof(objects) / sizeof(objects[0]);
+
+    for (u32 y = 0; y < side; ++y)
+    {
+        for (u32 x = 0; x < side; ++x)
+        {
+            Vec2 pos(2.0f * x - (side - 1.0f), 2.0f * y - (side - 1.0f));
+            EntityRef ref = create_entity(Transform2d(pos, Vec2(0.5f, 0.5f), 0.37f * (x + y)));
+            lookup_entity(ref)->render_object = objects[(x + y * side) % object_count];
+        }
+    }
+}
+
+// The camera circles the scene once over the run, looking at the origin
+static void set_bench_camera(u32 frame, u32 frame_count, float radius)
+{
+    float angle = 2.0f * float(M_PI) * frame / frame_count;
+    float height = 0.8f * radius;
+
+    Vec3 pos(radius * cosf(angle), radius * sinf(angle), height);
+    set_camera_view(pos, angle + 0.5f * float(M_PI), atan2f(radius, height));
+}
+
+static void write_ppm(const char* path, const u8* pixels, int width, int height)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening %s\n", path);
+        return;
+    }
+
+    // Rows are stored bottom first
+    fprintf(file, "P6 %d %d 255\n", width, height);
+    for (int y = height - 1; y >= 0; --y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            fwrite(&pixels[4 * (y * width + x)], 1, 3, file);
+        }
+    }
+
+    fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parse_options(argc, argv, &options) || !create_headless_context())
+    {
+        return 1;
+    }
+
+    PROFILE_THREAD("Main");
+
+    render::init_offscreen_rendering(options.width, options.height);
+    init_entities();
+    init_game();
+
+    editor_enabled = options.editor;
+    render::gpu_driven_rendering.enabled = options.gpu_driven;
+    render::gpu_driven_rendering.read_back_stats = options.gpu_stats;
+    render::depth_prepass.enabled = options.depth_prepass;
+    occlusion_culling_enabled = options.occlusion_culling;
+
+    float camera_radius = 15.0f;
+    if (options.stress_side)
+    {
+        add_stress_scene(options.stress_side);
+        camera_radius = fmaxf(camera_radius, 1.2f * options.stress_side);
+    }
+
+    render::finish_texture_loads();
+
+    // Totals over the measured frames
+    render::FrameStats totals;
+    CullStats occlusion_totals;
+    double frame_milliseconds = 0.0;
+    double max_frame_milliseconds = 0.0;
+    double gpu_start_totals[render::GPU_TIMER_COUNT] = {};
+    u32 gpu_start_frames = 0;
+
+    u32 total_frames = options.warmup + options.frames;
+    for (u32 frame = 0; frame < total_frames; ++frame)
+    {
+        bool measured = frame >= options.warmup;
+        if (frame == options.warmup)
+        {
+            const render::GpuTimings& timings = render::get_gpu_timings();
+            memcpy(gpu_start_totals, timings.total, sizeof(gpu_start_totals));
+            gpu_start_frames = timings.frames_measured;
+
+            if (options.trace_path)
+            {
+                start_profile_capture(options.frames, options.trace_path);
+            }
+        }
+
+        auto start_time = std::chrono::steady_clock::now();
+
+        set_bench_camera(frame, total_frames, camera_radius);
+        render_game();
+        render::present_screen(nullptr);
+        end_profile_frame();
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+
+        if (measured)
+        {
+            const render::FrameStats& stats = render::get_frame_stats();
+            totals.draw_calls += stats.draw_calls;
+            totals.instances += stats.instances;
+            totals.triangles += stats.triangles;
+            totals.instances_counted &= stats.instances_counted;
+            totals.state_changes += stats.state_changes;
+            totals.overdraw += stats.overdraw;
+            totals.gl_state_calls += stats.gl_state_calls;
+            totals.gl_state_calls_skipped += stats.gl_state_calls_skipped;
+            for (u32 timer = 0; timer < render::GPU_TIMER_COUNT; ++timer)
+            {
+                totals.cpu_milliseconds[timer] += stats.cpu_milliseconds[timer];
+            }
+
+            occlusion_totals.tested += occlusion_stats.tested;
+            occlusion_totals.culled += occlusion_stats.culled;
+            occlusion_totals.milliseconds += occlusion_stats.milliseconds;
+
+            frame_milliseconds += elapsed.count();
+            max_frame_milliseconds = fmax(max_frame_milliseconds, elapsed.count());
+        }
+    }
+
+    glFinish();
+
+    size_t pixel_bytes = size_t(options.width) * options.height * 4;
+    u8* pixels = (u8*) malloc(pixel_bytes);
+    render::read_screen_pixels(pixels);
+
+    char checksum[17];
+    snprintf(checksum, sizeof(checksum), "%016llx", (unsigned long long) hash_data(pixels, pixel_bytes));
+
+    if (options.ppm_path)
+    {
+        write_ppm(options.ppm_path, pixels, options.width, options.height);
+    }
+    free(pixels);
+
+    FILE* output = stdout;
+    if (options.output_path)
+    {
+        output = fopen(options.output_path, "w");
+        if (!output)
+        {
+            fprintf(stderr, "Error opening %s\n", options.output_path);
+            return 1;
+        }
+    }
+
+    // Frame values are averages over the measured frames. GPU times are averaged over the
+    // frames whose timer queries finished during the run.
+    double frames = options.frames;
+    const render::GpuTimings& timings = render::get_gpu_timings();
+    u32 gpu_frames = timings.frames_measured - gpu_start_frames;
+
+    fprintf(output, "{\n");
+    fprintf(output, "  \"renderer\": \"%s\",\n", (const char*) glGetString(GL_RENDERER));
+    fprintf(output, "  \"gpu_driven\": %s,\n", render::gpu_driven_rendering_active() ? "true" : "false");
+    fprintf(output, "  \"width\": %d,\n  \"height\": %d,\n", options.width, options.height);
+    fprintf(output, "  \"frames\": %u,\n  \"entities\": %zu,\n", options.frames, entities.size);
+    fprintf(output, "  \"frame_ms\": %.4f,\n  \"max_frame_ms\": %.4f,\n", frame_milliseconds / frames, max_frame_milliseconds);
+    fprintf(output, "  \"draw_calls\": %.1f,\n", totals.draw_calls / frames);
+    if (totals.instances_counted)
+    {
+        fprintf(output, "  \"instances\": %.1f,\n", totals.instances / frames);
+        fprintf(output, "  \"triangles\": %.1f,\n", totals.triangles / frames);
+    }
+    else
+    {
+        fprintf(output, "  \"instances\": null,\n  \"triangles\": null,\n");
+    }
+    fprintf(output, "  \"state_changes\": %.1f,\n", totals.state_changes / frames);
+    fprintf(output, "  \"overdraw\": %.3f,\n", totals.overdraw / frames);
+    fprintf(output, "  \"gl_state_calls\": %.1f,\n", totals.gl_state_calls / frames);
+    fprintf(output, "  \"gl_state_calls_skipped\": %.1f,\n", totals.gl_state_calls_skipped / frames);
+    fprintf(output, "  \"occlusion_tested\": %.1f,\n", occlusion_totals.tested / frames);
+    fprintf(output, "  \"occlusion_culled\": %.1f,\n", occlusion_totals.culled / frames);
+    fprintf(output, "  \"occlusion_ms\": %.4f,\n", occlusion_totals.milliseconds / frames);
+
+    fprintf(output, "  \"cpu_ms\": {");
+    for (u32 timer = 0; timer < render::GPU_TIMER_COUNT; ++timer)
+    {
+        fprintf(output, "%s\"%s\": %.4f", timer ? ", " : "", render::get_gpu_timer_name(render::GpuTimer(timer)),
+                totals.cpu_milliseconds[timer] / frames);
+    }
+    fprintf(output, "},\n");
+
+    fprintf(output, "  \"gpu_frames\": %u,\n", gpu_frames);
+    fprintf(output, "  \"gpu_ms\": {");
+    for (u32 timer = 0; timer < render::GPU_TIMER_COUNT; ++timer)
+    {
+        double total = timings.total[timer] - gpu_start_totals[timer];
+        fprintf(output, "%s\"%s\": %.4f", timer ? ", " : "", render::get_gpu_timer_name(render::GpuTimer(timer)),
+                gpu_frames ? total / gpu_frames : 0.0);
+    }
+    fprintf(output, "},\n");
+
+    fprintf(output, "  \"checksum\": \"%s\"\n", checksum);
+    fprintf(output, "}\n");
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+
+    render::shutdown_rendering();
+
+    if (options.expected_checksum && strcmp(options.expected_checksum, checksum))
+    {
+        fprintf(stderr, "Checksum %s doesn't match the expected %s\n", checksum, options.expected_checksum);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#version 430 core
+
+// Culls the objects of the GPU scene and adds the visible ones to the draw commands of the
+// LOD picked for them. Each command's instances start at its base_instance, and the commands
+// of every submesh of an LOD count the same instances.
+
+layout (local_size_x = 64) in;
+
+struct Object
+{
+    vec3 position;
+    float rotation;
+    vec3 scale;
+    uint obj_index;
+    uint mask;
+};
+
+struct RenderObject
+{
+    vec3 center;
+    uint lod_count;
+    vec3 extent;
+    uint first_command;
+    vec4 lod_error;
+    float radius;
+    uint submesh_count;
+};
+
+struct DrawCommand
+{
+    uint count;
+    uint instance_count;
+    uint first_index;
+    int base_vertex;
+    uint base_instance;
+};
+
+layout (std430, binding = 0) readonly buffer Objects
+{
+    Object objects[];
+};
+
+layout (std430, binding = 1) readonly buffer RenderObjects
+{
+    RenderObject render_objects[];
+};
+
+layout (std430, binding = 2) buffer DrawCommands
+{
+    DrawCommand commands[];
+};
+
+// Position, scale and rotation of each instance, as read by the instanced vertex shaders
+layout (std430, binding = 3) writeonly buffer Instances
+{
+    float instances[];
+};
+
+uniform int object_count;
+uniform int scene_mask;
+
+// A point p is inside a plane if dot(plane.xyz, p) + plane.w >= 0
+uniform vec4 frustum_planes[6];
+
+// LOD selection, as done by select_lod on the CPU. An error projects to
+// error * lod_scale / distance pixels, or error * lod_scale for orthographic views.
+uniform vec3 camera_pos;
+uniform bool lod_enabled;
+uniform bool lod_orthographic;
+uniform float lod_scale;
+uniform float lod_near;
+uniform float max_pixel_error;
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= uint(object_count))
+    {
+        return;
+    }
+
+    Object object = objects[index];
+    RenderObject render_object = render_objects[object.obj_index];
+    if ((object.mask & uint(scene_mask)) == 0u || render_object.submesh_count == 0u)
+    {
+        return;
+    }
+
+    // World space bounds. Objects are only rotated about the z axis.
+    vec3 center = render_object.center * object.scale;
+    vec3 extent = render_object.extent * abs(object.scale);
+    float c = cos(object.rotation);
+    float s = sin(object.rotation);
+
+    vec3 world_center = object.position + vec3(c * center.x - s * center.y, s * center.x + c * center.y, center.z);
+    vec3 world_extent = vec3(abs(c) * extent.x + abs(s) * extent.y, abs(s) * extent.x + abs(c) * extent.y, extent.z);
+
+    for (int i = 0; i < 6; ++i)
+    {
+        vec4 plane = frustum_planes[i];
+        if (dot(plane.xyz, world_center) + plane.w + dot(abs(plane.xyz), world_extent) < 0.0f)
+        {
+            return;
+        }
+    }
+
+    uint lod = 0u;
+    if (lod_enabled)
+    {
+        float scale = max(abs(object.scale.x), max(abs(object.scale.y), abs(object.scale.z)));
+        float distance = length(object.position - camera_pos) - scale * render_object.radius;
+        distance = lod_orthographic ? 1.0f : max(distance, lod_near);
+
+        for (uint i = render_object.lod_count - 1u; i > 0u; --i)
+        {
+            if (scale * render_object.lod_error[i] * lod_scale / distance <= max_pixel_error)
+            {
+                lod = i;
+                break;
+            }
+        }
+    }
+
+    // Submesh i of the LOD is drawn by command first_command + i * lod_count + lod
+    uint command = render_object.first_command + lod;
+    uint instance = commands[command].base_instance + atomicAdd(commands[command].instance_count, 1u);
+    for (uint i = 1u; i < render_object.submesh_count; ++i)
+    {
+        atomicAdd(commands[command + i * render_object.lod_count].instance_count, 1u);
+    }
+
+    instances[instance * 7u + 0u] = object.position.x;
+    instances[instance * 7u + 1u] = object.position.y;
+    instances[instance * 7u + 2u] = object.position.z;
+    instances[instance * 7u + 3u] = object.scale.x;
+    instances[instance * 7u + 4u] = object.scale.y;
+    instances[instance * 7u + 5u] = object.scale.z;
+    instances[instance * 7u + 6u] = object.rotation;
+}
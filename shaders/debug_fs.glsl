@@ -1,8 +1,8 @@
 #version 330 core
 
-out vec4 Color;
+in vec3 color;
 
-uniform vec3 color;
+out vec4 Color;
 
 void main()
 {
@@ -1,16 +1,14 @@
 #version 330 core
 
 layout (location = 0) in vec2 vertex_position;
+layout (location = 1) in vec3 vertex_color;
 
-uniform vec2 position;
-uniform vec2 scale;
-uniform mat2 rotation;
+out vec3 color;
 
 uniform mat4 camera;
 
 void main()
 {
-    vec2 out_position = position + rotation * vec2(scale.x * vertex_position.x, scale.y * vertex_position.y);
-
-    gl_Position = camera * vec4(out_position, 0.0f, 1.0f);
+    color = vertex_color;
+    gl_Position = camera * vec4(vertex_position, 0.0f, 1.0f);
 }
@@ -0,0 +1,30 @@
+#version 330 core
+
+layout (location = 0) in vec3 offset;
+
+// Per-instance attributes
+layout (location = 3) in vec3 position;
+layout (location = 4) in vec3 scale;
+layout (location = 5) in float rotation_angle;
+
+uniform mat4 light;
+
+// Also used for the depth pre-pass, see simple_instanced_vs.glsl
+invariant gl_Position;
+
+// Decode the mesh's vertex positions, see the simple shaders
+uniform vec3 position_offset;
+uniform vec3 position_scale;
+
+void main()
+{
+    // Rotation about the z axis
+    float c = cos(rotation_angle);
+    float s = sin(rotation_angle);
+    mat3 rotation = mat3(c,    s,    0.0f,
+                         -s,   c,    0.0f,
+                         0.0f, 0.0f, 1.0f);
+
+    vec3 out_pos = position + rotation * (scale * (position_offset + position_scale * offset));
+    gl_Position = light * vec4(out_pos, 1.0f);
+}
@@ -8,8 +8,12 @@ uniform vec3 scale;
 
 uniform mat4 light;
 
+// Decode the mesh's vertex positions, see the simple shaders
+uniform vec3 position_offset;
+uniform vec3 position_scale;
+
 void main()
 {
-    vec3 out_pos = position + rotation * (scale * offset);
+    vec3 out_pos = position + rotation * (scale * (position_offset + position_scale * offset));
     gl_Position = light * vec4(out_pos, 1.0f);
 }
@@ -6,12 +6,16 @@ in VS_OUT
 {
     vec3 world_normal;
     vec3 world_pos;
-    vec4 light_coord;
     vec2 uv;
 } fs_in;
 
-uniform sampler2DShadow light_depth;
-uniform sampler2D color_texture;
+// Shadow map cascades, see LightSource. The array sizes are MAX_SHADOW_CASCADES.
+uniform sampler2DArrayShadow light_depth;
+uniform mat4 light_cascades[4];
+uniform float cascade_splits[4];
+uniform int cascade_count;
+uniform sampler2DArray color_texture;
+uniform int texture_layer;
 
 uniform vec3 light_pos;
 uniform bool is_directional;
@@ -23,6 +27,7 @@ uniform vec3 specular_color;
 uniform float shininess;
 
 uniform vec3 camera_pos;
+uniform vec3 camera_dir;
 
 uniform bool lit;
 uniform bool textured;
@@ -75,26 +80,35 @@ void main()
         vec3 diffuse_texture = vec3(1.0f, 1.0f, 1.0f);
         if (textured)
         {
-            diffuse_texture = texture(color_texture, fs_in.uv).rgb;
+            diffuse_texture = texture(color_texture, vec3(fs_in.uv, texture_layer)).rgb;
         }
 
         vec3 final_color = light_per_area * (diffuse_texture * diffuse_color * max(diffuse, 0.0f) + specular_color * max(specular, 0.0f));
 
-        vec3 light_coord = (fs_in.light_coord.xyz / fs_in.light_coord.w) * 0.5f + 0.5f;
-        light_coord.z -= 0.0005f;
-
-        if (light_coord.x >= 0.0f && light_coord.x <= 1.0f && light_coord.y >= 0.0f && light_coord.y <= 1.0f)
+        // Use the first cascade that reaches the point. Points beyond the last one are unshadowed.
+        float view_depth = dot(fs_in.world_pos - camera_pos, camera_dir);
+        int cascade = 0;
+        while (cascade < cascade_count && view_depth > cascade_splits[cascade])
         {
-            light_color = texture(light_depth, light_coord) * final_color;
+            ++cascade;
         }
-        else
+
+        light_color = final_color;
+        if (cascade < cascade_count)
         {
-            light_color = final_color;
+            vec4 light_clip = light_cascades[cascade] * vec4(fs_in.world_pos, 1.0f);
+            vec3 light_coord = (light_clip.xyz / light_clip.w) * 0.5f + 0.5f;
+            light_coord.z -= 0.0005f;
+
+            if (light_coord.x >= 0.0f && light_coord.x <= 1.0f && light_coord.y >= 0.0f && light_coord.y <= 1.0f)
+            {
+                light_color *= texture(light_depth, vec4(light_coord.xy, cascade, light_coord.z));
+            }
         }
     }
     else if (textured)
     {
-        light_color = texture(color_texture, fs_in.uv).rgb;
+        light_color = texture(color_texture, vec3(fs_in.uv, texture_layer)).rgb;
     }
 
     frag_color = vec4(light_color, 1.0f);
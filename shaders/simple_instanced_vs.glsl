@@ -0,0 +1,59 @@
+#version 330 core
+
+layout (location = 0) in vec3 offset;
+layout (location = 1) in vec3 normal;
+layout (location = 2) in vec2 uv;
+
+// Per-instance attributes
+layout (location = 3) in vec3 position;
+layout (location = 4) in vec3 scale;
+layout (location = 5) in float rotation_angle;
+
+out VS_OUT
+{
+    vec3 world_normal;
+    vec3 world_pos;
+    vec2 uv;
+} vs_out;
+
+uniform mat4 camera;
+
+// The depth pre-pass draws with shadow_instanced_vs.glsl, which must produce exactly the same
+// positions for the main pass's GL_EQUAL depth test
+invariant gl_Position;
+
+// Decode the mesh's vertex format. Packed meshes store positions and uvs as fractions
+// of a range and normals octahedral encoded, float meshes use an offset of 0 and a scale of 1.
+uniform vec3 position_offset;
+uniform vec3 position_scale;
+uniform vec2 uv_offset;
+uniform vec2 uv_scale;
+uniform bool oct_normals;
+
+vec3 decode_octahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f)
+    {
+        vec2 signs = vec2(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+        n.xy = (1.0f - abs(e.yx)) * signs;
+    }
+    return normalize(n);
+}
+
+void main()
+{
+    // Rotation about the z axis
+    float c = cos(rotation_angle);
+    float s = sin(rotation_angle);
+    mat3 rotation = mat3(c,    s,    0.0f,
+                         -s,   c,    0.0f,
+                         0.0f, 0.0f, 1.0f);
+
+    vs_out.world_pos = position + rotation * (scale * (position_offset + position_scale * offset));
+    vec3 object_normal = oct_normals ? decode_octahedral(normal.xy) : normal;
+    vs_out.world_normal = normalize(rotation * (object_normal / scale));
+    vs_out.uv = uv_offset + uv_scale * uv;
+
+    gl_Position = camera * vec4(vs_out.world_pos, 1.0f);
+}
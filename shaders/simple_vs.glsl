@@ -8,7 +8,6 @@ out VS_OUT
 {
     vec3 world_normal;
     vec3 world_pos;
-    vec4 light_coord;
     vec2 uv;
 } vs_out;
 
@@ -17,14 +16,32 @@ uniform mat3 rotation;
 uniform vec3 scale;
 
 uniform mat4 camera;
-uniform mat4 light;
+
+// Decode the mesh's vertex format. Packed meshes store positions and uvs as fractions
+// of a range and normals octahedral encoded, float meshes use an offset of 0 and a scale of 1.
+uniform vec3 position_offset;
+uniform vec3 position_scale;
+uniform vec2 uv_offset;
+uniform vec2 uv_scale;
+uniform bool oct_normals;
+
+vec3 decode_octahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f)
+    {
+        vec2 signs = vec2(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+        n.xy = (1.0f - abs(e.yx)) * signs;
+    }
+    return normalize(n);
+}
 
 void main()
 {
-    vs_out.world_pos = position + rotation * (scale * offset);
-    vs_out.world_normal = normalize(rotation * (normal / scale));
-    vs_out.light_coord = light * vec4(vs_out.world_pos, 1.0f);
-    vs_out.uv = uv;
+    vs_out.world_pos = position + rotation * (scale * (position_offset + position_scale * offset));
+    vec3 object_normal = oct_normals ? decode_octahedral(normal.xy) : normal;
+    vs_out.world_normal = normalize(rotation * (object_normal / scale));
+    vs_out.uv = uv_offset + uv_scale * uv;
 
     gl_Position = camera * vec4(vs_out.world_pos, 1.0f);
 }
@@ -0,0 +1,136 @@
+#include "asset_cache.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+u64 hash_data(const void* data, size_t size, u64 hash)
+{
+    const u8* bytes = (const u8*) data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static u64 hash_file(const char* path)
+{
+    u64 hash = hash_data(nullptr, 0);
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return hash;
+    }
+
+    u8 buffer[65536];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)))
+    {
+        hash = hash_data(buffer, read, hash);
+    }
+
+    fclose(file);
+    return hash;
+}
+
+bool stamp_source(const char* path, SourceStamp* stamp)
+{
+    struct stat source_stat;
+    if (stat(path, &source_stat) != 0)
+    {
+        return false;
+    }
+
+    stamp->size = source_stat.st_size;
+    stamp->mtime = source_stat.st_mtime;
+    stamp->hash = hash_file(path);
+    return true;
+}
+
+bool source_unchanged(const char* path, const SourceStamp& stamp)
+{
+    struct stat source_stat;
+    if (stat(path, &source_stat) != 0 || stamp.size != (u64) source_stat.st_size)
+    {
+        return false;
+    }
+
+    return stamp.mtime == (s64) source_stat.st_mtime || stamp.hash == hash_file(path);
+}
+
+bool map_file(const char* path, MappedFile* file)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    file->data = (const u8*) mapping;
+    file->size = file_stat.st_size;
+    return true;
+}
+
+void unmap_file(MappedFile* file)
+{
+    if (file->data)
+    {
+        munmap((void*) file->data, file->size);
+        file->data = nullptr;
+        file->size = 0;
+    }
+}
+
+static void get_temp_path(const char* cache_path, char* temp_path, size_t size)
+{
+    snprintf(temp_path, size, "%s.tmp", cache_path);
+}
+
+FILE* begin_cache_write(const char* cache_path)
+{
+    char temp_path[512];
+    get_temp_path(cache_path, temp_path, sizeof(temp_path));
+
+    FILE* file = fopen(temp_path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Could not write cache %s\n", cache_path);
+    }
+    return file;
+}
+
+void end_cache_write(FILE* file, const char* cache_path)
+{
+    char temp_path[512];
+    get_temp_path(cache_path, temp_path, sizeof(temp_path));
+
+    bool failed = ferror(file);
+    fclose(file);
+
+    if (failed || rename(temp_path, cache_path) != 0)
+    {
+        fprintf(stderr, "Could not write cache %s\n", cache_path);
+        remove(temp_path);
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "util.h"
+
+#include <cstdio>
+
+// Helpers for files that hold cooked versions of asset files, written next to the source
+
+// 64 bit FNV-1a. Pass a previous result as hash to hash data in several parts.
+u64 hash_data(const void* data, size_t size, u64 hash = 14695981039346656037ull);
+
+// Identifies the source file a cache was cooked from. The size and modification time are
+// checked first, and the contents are only hashed if the modification time changed, e.g.
+// because the file was checked out again.
+struct SourceStamp
+{
+    u64 size;
+    s64 mtime;
+    u64 hash;
+};
+
+// Returns false if the source file doesn't exist
+bool stamp_source(const char* path, SourceStamp* stamp);
+
+// Returns whether the source file is the one the stamp was made from
+bool source_unchanged(const char* path, const SourceStamp& stamp);
+
+struct MappedFile
+{
+    const u8* data = nullptr;
+    size_t size = 0;
+};
+
+// Maps a whole file read only
+bool map_file(const char* path, MappedFile* file);
+void unmap_file(MappedFile* file);
+
+// Cache files are written to a temporary file which replaces the cache when it is
+// complete, so that an interrupted write never leaves a cache behind that looks valid
+FILE* begin_cache_write(const char* cache_path);
+void end_cache_write(FILE* file, const char* cache_path);
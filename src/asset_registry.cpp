@@ -0,0 +1,159 @@
+#include "asset_registry.h"
+
+#include "asset_cache.h"
+
+#include <cstring>
+
+// Both tables use open addressing with linear probing, and are kept at most half full
+#define TABLE_SIZE (2 * MAX_ASSETS)
+#define PATH_STORAGE_SIZE (256 * 1024)
+
+struct AssetEntry
+{
+    // Interned, so entries can be compared by pointer. Null if the slot is empty.
+    const char* path;
+    AssetType type;
+    u32 handle;
+    u32 ref_count;
+};
+
+static const char* interned_paths[TABLE_SIZE];
+static u32 interned_count = 0;
+
+static MAKE_ARRAY(path_storage, char, PATH_STORAGE_SIZE);
+
+static AssetEntry assets[TABLE_SIZE];
+static u32 asset_count = 0;
+
+static u32 hash_path(const char* path)
+{
+    return (u32) hash_data(path, strlen(path));
+}
+
+static u32 asset_slot(AssetType type, const char* interned)
+{
+    // The interned pointer is unique to the path, so it is hashed instead of the string
+    u64 key = (u64) (uintptr_t) interned ^ type;
+    return (u32) hash_data(&key, sizeof(key)) & (TABLE_SIZE - 1);
+}
+
+// Returns the interned copy of path, or null if it hasn't been interned
+static const char* find_interned(const char* path, u32* slot)
+{
+    *slot = hash_path(path) & (TABLE_SIZE - 1);
+    while (interned_paths[*slot])
+    {
+        if (strcmp(interned_paths[*slot], path) == 0)
+        {
+            return interned_paths[*slot];
+        }
+        *slot = (*slot + 1) & (TABLE_SIZE - 1);
+    }
+    return nullptr;
+}
+
+const char* intern_path(const char* path)
+{
+    u32 slot;
+    const char* interned = find_interned(path, &slot);
+    if (interned)
+    {
+        return interned;
+    }
+
+    assert(interned_count < MAX_ASSETS);
+
+    size_t length = strlen(path) + 1;
+    assert(path_storage.size + length <= path_storage.max_size);
+
+    char* copy = path_storage.data + path_storage.size;
+    memcpy(copy, path, length);
+    path_storage.size += length;
+
+    interned_paths[slot] = copy;
+    ++interned_count;
+
+    return copy;
+}
+
+// Returns the slot holding the asset, or the empty slot where it would be inserted
+static u32 find_asset(AssetType type, const char* interned)
+{
+    u32 slot = asset_slot(type, interned);
+    while (assets[slot].path && !(assets[slot].path == interned && assets[slot].type == type))
+    {
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+    }
+    return slot;
+}
+
+bool acquire_asset(AssetType type, const char* path, u32* handle)
+{
+    u32 intern_slot;
+    const char* interned = find_interned(path, &intern_slot);
+    if (!interned)
+    {
+        return false;
+    }
+
+    AssetEntry* entry = assets + find_asset(type, interned);
+    if (!entry->path)
+    {
+        return false;
+    }
+
+    ++entry->ref_count;
+    *handle = entry->handle;
+    return true;
+}
+
+const char* register_asset(AssetType type, const char* path, u32 handle)
+{
+    const char* interned = intern_path(path);
+
+    AssetEntry* entry = assets + find_asset(type, interned);
+    assert(!entry->path);
+    assert(asset_count < MAX_ASSETS);
+
+    entry->path = interned;
+    entry->type = type;
+    entry->handle = handle;
+    entry->ref_count = 1;
+    ++asset_count;
+
+    return interned;
+}
+
+bool release_asset(AssetType type, const char* path)
+{
+    const char* interned = intern_path(path);
+
+    u32 slot = find_asset(type, interned);
+    assert(assets[slot].path);
+
+    if (--assets[slot].ref_count)
+    {
+        return false;
+    }
+
+    // Backward shift deletion: move later entries of the probe sequence into the hole,
+    // so that lookups never need tombstones
+    u32 hole = slot;
+    for (u32 next = (hole + 1) & (TABLE_SIZE - 1); assets[next].path; next = (next + 1) & (TABLE_SIZE - 1))
+    {
+        u32 home = asset_slot(assets[next].type, assets[next].path);
+
+        // The entry can move to the hole if its home slot isn't cyclically in (hole, next]
+        bool home_after_hole = ((next - home) & (TABLE_SIZE - 1)) < ((next - hole) & (TABLE_SIZE - 1));
+        if (!home_after_hole)
+        {
+            assets[hole] = assets[next];
+            hole = next;
+        }
+    }
+
+    assets[hole] = AssetEntry();
+    --asset_count;
+
+    return true;
+}
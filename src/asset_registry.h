@@ -0,0 +1,27 @@
+#pragma once
+
+#include "util.h"
+
+// Maps asset paths to the handles they were loaded at, so that every asset is loaded once
+
+#define MAX_ASSETS 2048
+
+enum AssetType
+{
+    ASSET_TEXTURE,
+    ASSET_RENDER_OBJECT,
+};
+
+// Returns a copy of path that is never freed. Interning the same path again returns the
+// same pointer.
+const char* intern_path(const char* path);
+
+// If the asset is loaded, increments its reference count, writes its handle and returns true
+bool acquire_asset(AssetType type, const char* path, u32* handle);
+
+// Registers a newly loaded asset with a reference count of 1. Returns the interned path.
+const char* register_asset(AssetType type, const char* path, u32 handle);
+
+// Decrements the asset's reference count. Returns true when it reaches zero, in which case
+// the asset is removed from the registry and should be freed by the caller.
+bool release_asset(AssetType type, const char* path);
@@ -0,0 +1,534 @@
+#include "culling.h"
+#include "profiler.h"
+
+#include <chrono>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using hbmath::Vec3;
+using hbmath::Vec4;
+using hbmath::Mat4;
+
+Frustum frustum_from_matrix(const Mat4& matrix)
+{
+    // Each plane is the w row plus or minus one of the other rows (Gribb & Hartmann)
+    Vec4 x = matrix.row(0);
+    Vec4 y = matrix.row(1);
+    Vec4 z = matrix.row(2);
+    Vec4 w = matrix.row(3);
+
+    Frustum frustum;
+    frustum.planes[0] = w + x; // left
+    frustum.planes[1] = w - x; // right
+    frustum.planes[2] = w + y; // bottom
+    frustum.planes[3] = w - y; // top
+    frustum.planes[4] = w + z; // near
+    frustum.planes[5] = w - z; // far
+
+    return frustum;
+}
+
+void CullBoxes::push(Aabb local_bounds, Transform3d transform)
+{
+    assert(count < MAX_CULL_BOXES);
+
+    Vec3 local_center = 0.5f * (local_bounds.min + local_bounds.max);
+    Vec3 local_extent = 0.5f * (local_bounds.max - local_bounds.min);
+
+    local_center = Vec3(local_center.x * transform.scale.x,
+                        local_center.y * transform.scale.y,
+                        local_center.z * transform.scale.z);
+    local_extent = Vec3(local_extent.x * fabsf(transform.scale.x),
+                        local_extent.y * fabsf(transform.scale.y),
+                        local_extent.z * fabsf(transform.scale.z));
+
+    // Transforms are only rotated about the z axis, so the rotated box only grows in x and y
+    float c = cosf(transform.rotation);
+    float s = sinf(transform.rotation);
+
+    center_x[count] = transform.pos.x + c * local_center.x - s * local_center.y;
+    center_y[count] = transform.pos.y + s * local_center.x + c * local_center.y;
+    center_z[count] = transform.pos.z + local_center.z;
+    extent_x[count] = fabsf(c) * local_extent.x + fabsf(s) * local_extent.y;
+    extent_y[count] = fabsf(s) * local_extent.x + fabsf(c) * local_extent.y;
+    extent_z[count] = local_extent.z;
+
+    ++count;
+}
+
+void CullBoxes::clear()
+{
+    count = 0;
+}
+
+u32 cull_boxes(const Frustum& frustum, const CullBoxes& boxes, u8* visible, CullStats* stats)
+{
+    PROFILE_FUNCTION();
+    auto start_time = std::chrono::steady_clock::now();
+
+    u32 visible_count = 0;
+
+    // A box is outside a plane if its centre is further outside than the box's
+    // projected radius onto the plane normal. It is culled if it is outside any plane.
+#ifdef __SSE2__
+    __m128 plane_a[6], plane_b[6], plane_c[6], plane_d[6];
+    __m128 abs_a[6], abs_b[6], abs_c[6];
+    for (uint p = 0; p < 6; ++p)
+    {
+        plane_a[p] = _mm_set1_ps(frustum.planes[p][0]);
+        plane_b[p] = _mm_set1_ps(frustum.planes[p][1]);
+        plane_c[p] = _mm_set1_ps(frustum.planes[p][2]);
+        plane_d[p] = _mm_set1_ps(frustum.planes[p][3]);
+        abs_a[p] = _mm_set1_ps(fabsf(frustum.planes[p][0]));
+        abs_b[p] = _mm_set1_ps(fabsf(frustum.planes[p][1]));
+        abs_c[p] = _mm_set1_ps(fabsf(frustum.planes[p][2]));
+    }
+
+    const __m128 zero = _mm_setzero_ps();
+
+    for (u32 i = 0; i < boxes.count; i += 4)
+    {
+        __m128 cx = _mm_load_ps(boxes.center_x + i);
+        __m128 cy = _mm_load_ps(boxes.center_y + i);
+        __m128 cz = _mm_load_ps(boxes.center_z + i);
+        __m128 ex = _mm_load_ps(boxes.extent_x + i);
+        __m128 ey = _mm_load_ps(boxes.extent_y + i);
+        __m128 ez = _mm_load_ps(boxes.extent_z + i);
+
+        __m128 outside = zero;
+        for (uint p = 0; p < 6; ++p)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane_a[p], cx), _mm_mul_ps(plane_b[p], cy)),
+                                         _mm_add_ps(_mm_mul_ps(plane_c[p], cz), plane_d[p]));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abs_a[p], ex), _mm_mul_ps(abs_b[p], ey)),
+                                       _mm_mul_ps(abs_c[p], ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+        }
+
+        int outside_mask = _mm_movemask_ps(outside);
+        for (uint j = 0; j < 4; ++j)
+        {
+            visible[i + j] = !(outside_mask & (1 << j));
+        }
+    }
+
+    // The last group of four can run past the end of the boxes
+    for (u32 i = boxes.count; i < ((boxes.count + 3) & ~3u); ++i)
+    {
+        visible[i] = 0;
+    }
+
+    for (u32 i = 0; i < boxes.count; ++i)
+    {
+        visible_count += visible[i];
+    }
+#else
+    for (u32 i = 0; i < boxes.count; ++i)
+    {
+        bool outside = false;
+        for (uint p = 0; p < 6; ++p)
+        {
+            const Vec4& plane = frustum.planes[p];
+            float distance = plane[0] * boxes.center_x[i] + plane[1] * boxes.center_y[i] + plane[2] * boxes.center_z[i] + plane[3];
+            float radius = fabsf(plane[0]) * boxes.extent_x[i] + fabsf(plane[1]) * boxes.extent_y[i] + fabsf(plane[2]) * boxes.extent_z[i];
+            outside |= distance + radius < 0.0f;
+        }
+
+        visible[i] = !outside;
+        visible_count += visible[i];
+    }
+#endif
+
+    if (stats)
+    {
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+        stats->tested += boxes.count;
+        stats->culled += boxes.count - visible_count;
+        stats->milliseconds += elapsed.count();
+    }
+
+    return visible_count;
+}
+
+// Boxes are only culled if they are at least this far behind the occluders in normalized
+// device z, so that rounding doesn't cull an occluder's own box
+#define OCCLUSION_DEPTH_BIAS 1e-5f
+
+void clear_occlusion_buffer(OcclusionBuffer* buffer, const Mat4& matrix)
+{
+    buffer->matrix = matrix;
+    for (u32 i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; ++i)
+    {
+        buffer->depth[i] = 1.0f;
+    }
+}
+
+// A position in occlusion buffer pixels, with its normalized device z
+struct ScreenVertex
+{
+    float x;
+    float y;
+    float z;
+};
+
+static ScreenVertex to_screen(const Vec4& clip)
+{
+    float inverse_w = 1.0f / clip.data[3];
+
+    ScreenVertex vertex;
+    vertex.x = (0.5f * clip.data[0] * inverse_w + 0.5f) * OCCLUSION_WIDTH;
+    vertex.y = (0.5f * clip.data[1] * inverse_w + 0.5f) * OCCLUSION_HEIGHT;
+    vertex.z = clip.data[2] * inverse_w;
+    return vertex;
+}
+
+// Clips a clip space triangle to the near plane, z >= -w. Writes the clipped polygon to out
+// and returns its vertex count, which is 0, 3 or 4.
+static u32 clip_to_near_plane(const Vec4* triangle, Vec4* out)
+{
+    u32 count = 0;
+    for (uint i = 0; i < 3; ++i)
+    {
+        const Vec4& a = triangle[i];
+        const Vec4& b = triangle[(i + 1) % 3];
+        float distance_a = a.data[2] + a.data[3];
+        float distance_b = b.data[2] + b.data[3];
+
+        if (distance_a >= 0.0f)
+        {
+            out[count++] = a;
+        }
+
+        if ((distance_a >= 0.0f) != (distance_b >= 0.0f))
+        {
+            out[count++] = a + (distance_a / (distance_a - distance_b)) * (b - a);
+        }
+    }
+
+    return count;
+}
+
+// Returns whether a clip space triangle is entirely outside the left, right, bottom or top
+// side of the frustum
+static bool outside_frustum_side(const Vec4* triangle)
+{
+    for (uint axis = 0; axis < 2; ++axis)
+    {
+        bool all_above = true;
+        bool all_below = true;
+        for (uint i = 0; i < 3; ++i)
+        {
+            all_above &= triangle[i].data[axis] > triangle[i].data[3];
+            all_below &= triangle[i].data[axis] < -triangle[i].data[3];
+        }
+
+        if (all_above || all_below)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// For every pixel the triangle covers entirely, keeps the nearest of the stored depth and
+// the triangle's farthest depth over the pixel. Pixels the triangle only partly covers are
+// left alone, as a box could be seen through the rest of them.
+static void rasterize_triangle(OcclusionBuffer* buffer, ScreenVertex v0, ScreenVertex v1, ScreenVertex v2)
+{
+    float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+    if (!(fabsf(area) > 0.0f))
+    {
+        return;
+    }
+
+    // Counter clockwise, so that the edge functions are positive inside
+    if (area < 0.0f)
+    {
+        ScreenVertex temp = v1;
+        v1 = v2;
+        v2 = temp;
+        area = -area;
+    }
+
+    // Pixels that can be inside the triangle
+    float first_x = fmaxf(ceilf(fminf(v0.x, fminf(v1.x, v2.x))), 0.0f);
+    float last_x = fminf(floorf(fmaxf(v0.x, fmaxf(v1.x, v2.x))) - 1.0f, OCCLUSION_WIDTH - 1.0f);
+    float first_y = fmaxf(ceilf(fminf(v0.y, fminf(v1.y, v2.y))), 0.0f);
+    float last_y = fminf(floorf(fmaxf(v0.y, fmaxf(v1.y, v2.y))) - 1.0f, OCCLUSION_HEIGHT - 1.0f);
+    if (first_x > last_x || first_y > last_y)
+    {
+        return;
+    }
+
+    // Edge i is opposite vertex i, and its function a * x + b * y + c divided by the area
+    // is vertex i's barycentric coordinate. Depth is interpolated the same way.
+    const ScreenVertex* vertices[3] = {&v0, &v1, &v2};
+    float edge_a[3], edge_b[3], edge_c[3];
+    float depth_a = 0.0f, depth_b = 0.0f, depth_c = 0.0f;
+    for (uint i = 0; i < 3; ++i)
+    {
+        const ScreenVertex& p = *vertices[(i + 1) % 3];
+        const ScreenVertex& q = *vertices[(i + 2) % 3];
+        edge_a[i] = p.y - q.y;
+        edge_b[i] = q.x - p.x;
+        edge_c[i] = p.x * q.y - p.y * q.x;
+
+        float z = vertices[i]->z / area;
+        depth_a += z * edge_a[i];
+        depth_b += z * edge_b[i];
+        depth_c += z * edge_c[i];
+    }
+
+    // Linear functions are smallest and largest at a corner of the pixel, half a pixel from
+    // the centre on each axis. Moving the edges in by that much makes the test at the centre
+    // pass only if the whole pixel is inside, and the depth at the farthest corner is found
+    // from the centre the same way.
+    for (uint i = 0; i < 3; ++i)
+    {
+        edge_c[i] -= 0.5f * (fabsf(edge_a[i]) + fabsf(edge_b[i]));
+    }
+    float corner_offset = 0.5f * (fabsf(depth_a) + fabsf(depth_b));
+
+    int min_x = int(first_x);
+    int max_x = int(last_x);
+    int min_y = int(first_y);
+    int max_y = int(last_y);
+
+#ifdef __SSE2__
+    // Four pixels of a row at a time, starting from a multiple of four so that the rows
+    // can be loaded aligned. The pixels outside the triangle are masked out.
+    min_x &= ~3;
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 pixel_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 a0 = _mm_set1_ps(edge_a[0]), a1 = _mm_set1_ps(edge_a[1]), a2 = _mm_set1_ps(edge_a[2]);
+    __m128 za = _mm_set1_ps(depth_a);
+
+    for (int y = min_y; y <= max_y; ++y)
+    {
+        float pixel_y = y + 0.5f;
+        __m128 row0 = _mm_set1_ps(edge_b[0] * pixel_y + edge_c[0]);
+        __m128 row1 = _mm_set1_ps(edge_b[1] * pixel_y + edge_c[1]);
+        __m128 row2 = _mm_set1_ps(edge_b[2] * pixel_y + edge_c[2]);
+        __m128 row_depth = _mm_set1_ps(depth_b * pixel_y + depth_c + corner_offset);
+
+        float* row = buffer->depth + y * OCCLUSION_WIDTH;
+        for (int x = min_x; x <= max_x; x += 4)
+        {
+            __m128 pixel_x = _mm_add_ps(_mm_set1_ps(float(x)), pixel_offsets);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, pixel_x), row0);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, pixel_x), row1);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, pixel_x), row2);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+                                       _mm_cmpge_ps(e2, zero));
+
+            __m128 depth = _mm_add_ps(_mm_mul_ps(za, pixel_x), row_depth);
+            __m128 stored = _mm_load_ps(row + x);
+            __m128 nearest = _mm_min_ps(stored, depth);
+            _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, stored)));
+        }
+    }
+#else
+    for (int y = min_y; y <= max_y; ++y)
+    {
+        float pixel_y = y + 0.5f;
+        float* row = buffer->depth + y * OCCLUSION_WIDTH;
+        for (int x = min_x; x <= max_x; ++x)
+        {
+            float pixel_x = x + 0.5f;
+            bool inside = true;
+            for (uint i = 0; i < 3; ++i)
+            {
+                inside &= edge_a[i] * pixel_x + edge_b[i] * pixel_y + edge_c[i] >= 0.0f;
+            }
+
+            float depth = depth_a * pixel_x + depth_b * pixel_y + depth_c + corner_offset;
+            if (inside && depth < row[x])
+            {
+                row[x] = depth;
+            }
+        }
+    }
+#endif
+}
+
+void rasterize_occluder(OcclusionBuffer* buffer, const Vec3* vertices, u32 vertex_count,
+                        Transform3d transform, CullStats* stats)
+{
+    PROFILE_FUNCTION();
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Transforms are only rotated about the z axis
+    float c = cosf(transform.rotation);
+    float s = sinf(transform.rotation);
+    Mat4 model = Mat4::FromRows(Vec4(c * transform.scale.x, -s * transform.scale.y, 0.0f, transform.pos.x),
+                                Vec4(s * transform.scale.x, c * transform.scale.y, 0.0f, transform.pos.y),
+                                Vec4(0.0f, 0.0f, transform.scale.z, transform.pos.z),
+                                Vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    Mat4 matrix = buffer->matrix * model;
+
+#ifdef __SSE2__
+    __m128 columns[4];
+    for (uint k = 0; k < 4; ++k)
+    {
+        columns[k] = _mm_setr_ps(matrix.data[k], matrix.data[4 + k], matrix.data[8 + k], matrix.data[12 + k]);
+    }
+#endif
+
+    for (u32 i = 0; i + 2 < vertex_count; i += 3)
+    {
+        Vec4 triangle[3];
+        for (uint j = 0; j < 3; ++j)
+        {
+#ifdef __SSE2__
+            const Vec3& vertex = vertices[i + j];
+            __m128 clip = _mm_add_ps(_mm_add_ps(_mm_mul_ps(columns[0], _mm_set1_ps(vertex.x)), _mm_mul_ps(columns[1], _mm_set1_ps(vertex.y))),
+                                     _mm_add_ps(_mm_mul_ps(columns[2], _mm_set1_ps(vertex.z)), columns[3]));
+            _mm_storeu_ps(triangle[j].data, clip);
+#else
+            triangle[j] = matrix * Vec4(vertices[i + j]);
+#endif
+        }
+
+        if (outside_frustum_side(triangle))
+        {
+            continue;
+        }
+
+        Vec4 polygon[4];
+        u32 polygon_count = clip_to_near_plane(triangle, polygon);
+
+        ScreenVertex screen[4];
+        for (u32 j = 0; j < polygon_count; ++j)
+        {
+            screen[j] = to_screen(polygon[j]);
+        }
+
+        for (u32 j = 2; j < polygon_count; ++j)
+        {
+            rasterize_triangle(buffer, screen[0], screen[j - 1], screen[j]);
+        }
+    }
+
+    if (stats)
+    {
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+        stats->occluder_triangles += vertex_count / 3;
+        stats->milliseconds += elapsed.count();
+    }
+}
+
+// Returns whether every pixel the box's screen rectangle touches has an occluder in front of it
+static bool box_occluded(const OcclusionBuffer& buffer, Vec3 center, Vec3 extent)
+{
+    float min_x = INFINITY, max_x = -INFINITY;
+    float min_y = INFINITY, max_y = -INFINITY;
+    float min_z = INFINITY;
+
+    for (uint corner = 0; corner < 8; ++corner)
+    {
+        Vec3 position(center.x + (corner & 1 ? extent.x : -extent.x),
+                      center.y + (corner & 2 ? extent.y : -extent.y),
+                      center.z + (corner & 4 ? extent.z : -extent.z));
+        Vec4 clip = buffer.matrix * Vec4(position);
+
+        // Boxes reaching in front of the near plane are never hidden
+        if (clip.data[2] < -clip.data[3])
+        {
+            return false;
+        }
+
+        ScreenVertex vertex = to_screen(clip);
+        min_x = fminf(min_x, vertex.x);
+        max_x = fmaxf(max_x, vertex.x);
+        min_y = fminf(min_y, vertex.y);
+        max_y = fmaxf(max_y, vertex.y);
+        min_z = fminf(min_z, vertex.z);
+    }
+
+    // Boxes off the screen are left to frustum culling
+    float first_x = fmaxf(floorf(min_x), 0.0f);
+    float last_x = fminf(floorf(max_x), OCCLUSION_WIDTH - 1.0f);
+    float first_y = fmaxf(floorf(min_y), 0.0f);
+    float last_y = fminf(floorf(max_y), OCCLUSION_HEIGHT - 1.0f);
+    if (first_x > last_x || first_y > last_y)
+    {
+        return false;
+    }
+
+    int start_x = int(first_x);
+    int end_x = int(last_x);
+    float box_depth = min_z - OCCLUSION_DEPTH_BIAS;
+
+#ifdef __SSE2__
+    // Widening the rectangle to multiples of four pixels only makes the test more conservative
+    start_x &= ~3;
+    __m128 box_depth4 = _mm_set1_ps(box_depth);
+#endif
+
+    for (int y = int(first_y); y <= int(last_y); ++y)
+    {
+        const float* row = buffer.depth + y * OCCLUSION_WIDTH;
+#ifdef __SSE2__
+        for (int x = start_x; x <= end_x; x += 4)
+        {
+            if (_mm_movemask_ps(_mm_cmpge_ps(_mm_load_ps(row + x), box_depth4)))
+            {
+                return false;
+            }
+        }
+#else
+        for (int x = start_x; x <= end_x; ++x)
+        {
+            if (row[x] >= box_depth)
+            {
+                return false;
+            }
+        }
+#endif
+    }
+
+    return true;
+}
+
+u32 cull_occluded_boxes(const OcclusionBuffer& buffer, const CullBoxes& boxes, u8* visible, CullStats* stats)
+{
+    PROFILE_FUNCTION();
+    auto start_time = std::chrono::steady_clock::now();
+
+    u32 tested = 0;
+    u32 visible_count = 0;
+    for (u32 i = 0; i < boxes.count; ++i)
+    {
+        if (!visible[i])
+        {
+            continue;
+        }
+
+        ++tested;
+        Vec3 center(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i]);
+        Vec3 extent(boxes.extent_x[i], boxes.extent_y[i], boxes.extent_z[i]);
+        if (box_occluded(buffer, center, extent))
+        {
+            visible[i] = 0;
+        }
+        else
+        {
+            ++visible_count;
+        }
+    }
+
+    if (stats)
+    {
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+        stats->tested += tested;
+        stats->culled += tested - visible_count;
+        stats->milliseconds += elapsed.count();
+    }
+
+    return visible_count;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "hbmath.h"
+#include "shapes.h"
+#include "util.h"
+
+#define MAX_CULL_BOXES 65536
+
+// Frustum planes are stored as (a, b, c, d), where a point p is on the inside of the
+// plane if a * p.x + b * p.y + c * p.z + d >= 0.
+struct Frustum
+{
+    hbmath::Vec4 planes[6];
+};
+
+// Extracts the frustum planes from a projection * view matrix, such as the one
+// returned by Camera::compute_matrix. Works for perspective and orthographic cameras.
+Frustum frustum_from_matrix(const hbmath::Mat4& matrix);
+
+// World space boxes stored as structure of arrays, so that they can be tested
+// against a frustum four at a time.
+struct CullBoxes
+{
+    alignas(16) float center_x[MAX_CULL_BOXES];
+    alignas(16) float center_y[MAX_CULL_BOXES];
+    alignas(16) float center_z[MAX_CULL_BOXES];
+    alignas(16) float extent_x[MAX_CULL_BOXES];
+    alignas(16) float extent_y[MAX_CULL_BOXES];
+    alignas(16) float extent_z[MAX_CULL_BOXES];
+
+    u32 count = 0;
+
+    // Adds the world space bounds of an object with the given local bounds and transform
+    void push(Aabb local_bounds, Transform3d transform);
+    void clear();
+};
+
+struct CullStats
+{
+    u32 tested = 0;
+    u32 culled = 0;
+    float milliseconds = 0.0f;
+
+    // Only counted by occlusion culling
+    u32 occluder_triangles = 0;
+};
+
+// Sets visible[i] to 1 if box i intersects the frustum and 0 otherwise. visible must
+// have room for boxes.count rounded up to a multiple of 4.
+// Returns the number of visible boxes.
+u32 cull_boxes(const Frustum& frustum, const CullBoxes& boxes, u8* visible, CullStats* stats);
+
+// Size of the software occlusion buffer. The width must be a multiple of 4.
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+
+// A coarse depth buffer that occluders are rasterized into on the CPU, so that boxes hidden
+// behind them can be culled without reading anything back from the GPU. Each pixel holds the
+// farthest normalized device z over the pixel of the nearest occluder triangle that covers
+// all of it, or 1 if none does.
+struct OcclusionBuffer
+{
+    alignas(16) float depth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+
+    // Projection * view matrix of the camera, such as the one returned by Camera::compute_matrix
+    hbmath::Mat4 matrix;
+};
+
+void clear_occlusion_buffer(OcclusionBuffer* buffer, const hbmath::Mat4& matrix);
+
+// Rasterizes triangles given as three object space positions each, placed by transform.
+// Triangles are drawn from both sides. The time taken is added to stats.
+void rasterize_occluder(OcclusionBuffer* buffer, const hbmath::Vec3* vertices, u32 vertex_count,
+                        Transform3d transform, CullStats* stats);
+
+// Clears visible[i] for the visible boxes that are entirely behind the occluders, which is
+// conservative up to the buffer's resolution. Returns the number of boxes still visible.
+u32 cull_occluded_boxes(const OcclusionBuffer& buffer, const CullBoxes& boxes, u8* visible, CullStats* stats);
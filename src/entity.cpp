@@ -99,7 +99,7 @@ Entity* lookup_entity(EntityRef ref)
     }
 }
 
-bool EntityRef::operator==(const EntityRef& rhs)
+bool EntityRef::operator==(const EntityRef& rhs) const
 {
     return index == rhs.index && version == rhs.version;
 }
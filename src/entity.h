@@ -11,7 +11,7 @@ struct EntityRef
     u32 index = 0;
     u32 version = 0;  // The default version is invalid
 
-    bool operator==(const EntityRef& rhs);
+    bool operator==(const EntityRef& rhs) const;
 };
 
 struct Entity
@@ -7,9 +7,13 @@
 #include "entity.h"
 #include "save_load.h"
 #include "navigation.h"
+#include "culling.h"
+#include "profiler.h"
+#include "asset_cache.h" // for hash_data
 
 #include "imgui.h"
 #include <cmath>
+#include <cstring> // for memset
 
 using namespace hbmath;
 using namespace render;
@@ -38,14 +42,50 @@ u32 skybox;
 
 Vec2 player_velocity;
 
+bool frustum_culling_enabled = true;
+
+// World space bounds of each entity, in the same order as entities
+CullBoxes entity_boxes;
+u8 entity_visible[MAX_CULL_BOXES];
+CullStats cull_stats;
+
+// Entities at least this large in world space are drawn into the occlusion buffer, which
+// hides the entities behind them in the main pass
+bool occlusion_culling_enabled = true;
+const float min_occluder_size = 2.0f;
+OcclusionBuffer occlusion_buffer;
+CullStats occlusion_stats;
+
+// Indices of the dynamic entities and their bounds, which are drawn into the shadow
+// maps every frame
+MAKE_ARRAY(dynamic_entities, u32, MAX_ENTITIES);
+CullBoxes dynamic_boxes;
+u8 dynamic_visible[MAX_CULL_BOXES];
+
+// Hash of the static entities' draw state. The cached static shadows are redrawn when it changes.
+u64 static_scene_hash = 0;
+
+// The entities as given to the renderer when GPU driven rendering is active
+MAKE_ARRAY(gpu_scene_objects, GpuSceneObject, MAX_ENTITIES);
+
+// The nav mesh is drawn from a retained debug line set, rebuilt when the nav mesh changes
+u32 nav_mesh_lines;
+u32 nav_mesh_lines_version = 0;
+
+// Which entities draw_scene draws. Also used as the masks of the GPU scene's objects.
+enum SceneFilter
+{
+    SCENE_STATIC = 1,
+    SCENE_DYNAMIC = 2,
+    SCENE_ALL = SCENE_STATIC | SCENE_DYNAMIC,
+};
+
 void init_game()
 {
     camera.set_fov(0.5f * M_PI);
 
-    light_source = make_light_source(1024);
+    light_source = make_light_source(1024, 4);
     light_source.camera.is_ortho = true;
-    light_source.camera.near_width = 20.0f;
-    light_source.camera.pos = Vec3(0.0f, 0.0f, 10.0f);
     light_source.camera.orientation = Quaternion::RotateZ(1.0f) * Quaternion::RotateX(-0.25f * M_PI);
 
     if (load_scene("test.scene"))
@@ -72,6 +112,7 @@ void init_game()
     player->render_object = render::load_obj("bettermug.obj");
 
     build_nav_mesh(-10.0f, 10.0f, -10.0f, 10.0f);
+    nav_mesh_lines = create_debug_line_set();
 }
 
 bool editor_enabled = true;
@@ -82,9 +123,13 @@ bool show_imgui_demo = false;
 bool show_light_window = false;
 bool show_camera_window = false;
 bool show_navigation_window = false;
+bool show_render_stats_window = false;
+bool show_gpu_timings_window = false;
+bool show_profiler_window = false;
 
 void update_game(float dt)
 {
+    PROFILE_FUNCTION();
     if (get_key_state(SDL_SCANCODE_GRAVE).down)
     {
         editor_enabled = !editor_enabled;
@@ -117,6 +162,9 @@ void update_game(float dt)
                 ImGui::MenuItem("Edit light", nullptr, &show_light_window);
                 ImGui::MenuItem("Edit camera", nullptr, &show_camera_window);
                 ImGui::MenuItem("Navigation", nullptr, &show_navigation_window);
+                ImGui::MenuItem("Render stats", nullptr, &show_render_stats_window);
+                ImGui::MenuItem("GPU timings", nullptr, &show_gpu_timings_window);
+                ImGui::MenuItem("Profiler", nullptr, &show_profiler_window);
                 ImGui::EndMenu();
             }
             ImGui::EndMainMenuBar();
@@ -208,6 +256,54 @@ void update_game(float dt)
             ImGui::End();
         }
 
+        if (show_render_stats_window)
+        {
+            if (ImGui::Begin("Render Stats", &show_render_stats_window))
+            {
+                get_frame_stats().draw_gui();
+
+                ImGui::Separator();
+                ImGui::Checkbox("Frustum culling", &frustum_culling_enabled);
+                ImGui::Text("Culled: %u / %u", cull_stats.culled, cull_stats.tested);
+                ImGui::Text("Culling time: %.3f ms", cull_stats.milliseconds);
+                ImGui::Checkbox("Occlusion culling", &occlusion_culling_enabled);
+                ImGui::Text("Occluded: %u / %u", occlusion_stats.culled, occlusion_stats.tested);
+                ImGui::Text("Occlusion time: %.3f ms, %u occluder triangles",
+                            occlusion_stats.milliseconds, occlusion_stats.occluder_triangles);
+                ImGui::Checkbox("GPU driven rendering", &gpu_driven_rendering.enabled);
+                if (gpu_driven_rendering.enabled && !gpu_driven_rendering_active())
+                {
+                    ImGui::Text("Needs OpenGL 4.3");
+                }
+
+                ImGui::Checkbox("Depth pre-pass", &depth_prepass.enabled);
+                ImGui::Checkbox("Automatic depth pre-pass", &depth_prepass.automatic);
+                if (depth_prepass.automatic)
+                {
+                    ImGui::SliderFloat("Overdraw threshold", &depth_prepass.auto_threshold, 1.0f, 8.0f);
+                }
+            }
+            ImGui::End();
+        }
+
+        if (show_gpu_timings_window)
+        {
+            if (ImGui::Begin("GPU Timings", &show_gpu_timings_window))
+            {
+                get_gpu_timings().draw_gui();
+            }
+            ImGui::End();
+        }
+
+        if (show_profiler_window)
+        {
+            if (ImGui::Begin("Profiler", &show_profiler_window))
+            {
+                draw_profiler_gui();
+            }
+            ImGui::End();
+        }
+
         if (show_navigation_window)
         {
             if (ImGui::Begin("Navigation", &show_navigation_window))
@@ -342,28 +438,217 @@ void update_game(float dt)
     }
 }
 
-static void draw_scene()
+static Transform3d compute_draw_transform(const Entity& entity)
+{
+    return Transform3d(Vec3(entity.transform.pos.x, entity.transform.pos.y, 0.5f), Vec3(entity.transform.scale.x, entity.transform.scale.y, 1.0f), entity.transform.rotation);
+}
+
+// Entities that move during play. Their shadows are drawn every frame, while the static
+// entities are drawn into cached shadow maps. Only the player moves at the moment.
+static bool is_dynamic(const Entity& entity)
 {
-    draw_skybox(skybox, camera_view.pos);
-    for (auto& entity : entities)
+    return entity.ref == game_state.player;
+}
+
+// Draws the large entities in the frustum into the occlusion buffer. entity_boxes must be
+// up to date, and entity_visible is overwritten.
+static void draw_occluders(const Mat4& camera_matrix, const Frustum& frustum)
+{
+    PROFILE_FUNCTION();
+    clear_occlusion_buffer(&occlusion_buffer, camera_matrix);
+
+    // Occluders outside the frustum would only be clipped away triangle by triangle
+    cull_boxes(frustum, entity_boxes, entity_visible, nullptr);
+
+    for (uint i = 0; i < entities.size; ++i)
+    {
+        if (!entity_visible[i])
+        {
+            continue;
+        }
+
+        const RenderObject& obj = render_objects[entities[i].render_object];
+        float size = 2.0f * fmaxf(entity_boxes.extent_x[i], fmaxf(entity_boxes.extent_y[i], entity_boxes.extent_z[i]));
+        if (!obj.occluder_vertex_count || size < min_occluder_size)
+        {
+            continue;
+        }
+
+        rasterize_occluder(&occlusion_buffer, occluder_vertices.data + obj.first_occluder_vertex,
+                           obj.occluder_vertex_count, compute_draw_transform(entities[i]), &occlusion_stats);
+    }
+}
+
+// occlusion is only given for the main pass, and hides entities behind the occluders
+static void draw_scene(const Frustum& frustum, SceneFilter filter, const OcclusionBuffer* occlusion = nullptr)
+{
+    PROFILE_FUNCTION();
+
+    // The skybox doesn't write depth, so it is only drawn in full passes
+    if (filter == SCENE_ALL)
+    {
+        GpuTimer outer_timer = start_gpu_timer(GPU_TIMER_SKYBOX);
+        draw_skybox(skybox, camera_view.pos);
+        start_gpu_timer(outer_timer);
+    }
+
+    if (gpu_driven_rendering_active())
+    {
+        draw_gpu_scene(frustum_culling_enabled ? &frustum : nullptr, filter);
+        return;
+    }
+
+    if (filter == SCENE_DYNAMIC)
+    {
+        if (frustum_culling_enabled)
+        {
+            cull_boxes(frustum, dynamic_boxes, dynamic_visible, &cull_stats);
+        }
+
+        for (uint i = 0; i < dynamic_entities.size; ++i)
+        {
+            if (frustum_culling_enabled && !dynamic_visible[i])
+            {
+                continue;
+            }
+
+            const Entity& entity = entities[dynamic_entities[i]];
+            draw_object_instanced(compute_draw_transform(entity), entity.render_object);
+        }
+        flush_instanced_draws();
+        return;
+    }
+
+    bool culled = frustum_culling_enabled || occlusion;
+    if (frustum_culling_enabled)
+    {
+        cull_boxes(frustum, entity_boxes, entity_visible, &cull_stats);
+    }
+    else if (occlusion)
+    {
+        memset(entity_visible, 1, entity_boxes.count);
+    }
+
+    if (occlusion)
+    {
+        cull_occluded_boxes(*occlusion, entity_boxes, entity_visible, &occlusion_stats);
+    }
+
+    for (uint i = 0; i < entities.size; ++i)
     {
-        Transform3d box_transform(Vec3(entity.transform.pos.x, entity.transform.pos.y, 0.5f), Vec3(entity.transform.scale.x, entity.transform.scale.y, 1.0f), entity.transform.rotation);
-        draw_object(box_transform, entity.render_object);
+        if (culled && !entity_visible[i])
+        {
+            continue;
+        }
+
+        if (filter == SCENE_STATIC && is_dynamic(entities[i]))
+        {
+            continue;
+        }
+
+        draw_object_instanced(compute_draw_transform(entities[i]), entities[i].render_object);
     }
+    flush_instanced_draws();
+}
+
+void set_camera_view(Vec3 pos, float yaw, float pitch)
+{
+    camera_view.pos = pos;
+    camera_view.yaw = yaw;
+    camera_view.pitch = pitch;
 }
 
 void render_game()
 {
-    prepare_lightmap_draw(light_source);
-    draw_scene();
+    PROFILE_FUNCTION();
+    cull_stats = CullStats();
+    occlusion_stats = CullStats();
+
+    // The GPU scene is culled by the renderer, which only needs to know what changed
+    bool gpu_driven = gpu_driven_rendering_active();
+    if (gpu_driven)
+    {
+        gpu_scene_objects.clear();
+        for (auto& entity : entities)
+        {
+            GpuSceneObject object;
+            object.transform = compute_draw_transform(entity);
+            object.obj_index = entity.render_object;
+            object.mask = is_dynamic(entity) ? SCENE_DYNAMIC : SCENE_STATIC;
+            gpu_scene_objects.push(object);
+        }
+        update_gpu_scene(gpu_scene_objects.data, gpu_scene_objects.size);
+    }
+
+    // The bounds are computed once and culled against both the light and the camera
+    if ((frustum_culling_enabled || occlusion_culling_enabled) && !gpu_driven)
+    {
+        entity_boxes.clear();
+        for (auto& entity : entities)
+        {
+            entity_boxes.push(render_objects[entity.render_object].bounds, compute_draw_transform(entity));
+        }
+    }
+
+    dynamic_entities.clear();
+    dynamic_boxes.clear();
+    u64 scene_hash = hash_data(&entities.size, sizeof(entities.size));
+    for (uint i = 0; i < entities.size; ++i)
+    {
+        const Entity& entity = entities[i];
+        if (is_dynamic(entity))
+        {
+            dynamic_entities.push(i);
+            dynamic_boxes.push(render_objects[entity.render_object].bounds, compute_draw_transform(entity));
+        }
+        else
+        {
+            scene_hash = hash_data(&entity.transform, sizeof(entity.transform), scene_hash);
+            scene_hash = hash_data(&entity.render_object, sizeof(entity.render_object), scene_hash);
+        }
+    }
+
+    if (scene_hash != static_scene_hash)
+    {
+        invalidate_static_shadows(&light_source);
+        static_scene_hash = scene_hash;
+    }
 
     camera.pos = camera_view.pos;
     camera.orientation = camera_view.compute_orientation();
+
+    start_gpu_timer(GPU_TIMER_SHADOWS);
+    fit_shadow_cascades(&light_source, camera, get_aspect_ratio());
+    for (u32 cascade = 0; cascade < light_source.active_cascades; ++cascade)
+    {
+        Frustum cascade_frustum = frustum_from_matrix(light_source.cascade_matrices[cascade]);
+
+        // With cached static shadows only the dynamic entities are drawn every frame
+        if (prepare_static_lightmap_draw(&light_source, cascade))
+        {
+            draw_scene(cascade_frustum, SCENE_STATIC);
+        }
+
+        prepare_lightmap_draw(light_source, cascade);
+        draw_scene(cascade_frustum, shadow_cascades.cache_static ? SCENE_DYNAMIC : SCENE_ALL);
+    }
+
+    start_gpu_timer(GPU_TIMER_MAIN);
+    Mat4 camera_matrix = camera.compute_matrix(get_aspect_ratio());
+    Frustum camera_frustum = frustum_from_matrix(camera_matrix);
+    const OcclusionBuffer* occlusion = nullptr;
+    if (occlusion_culling_enabled && !gpu_driven)
+    {
+        draw_occluders(camera_matrix, camera_frustum);
+        occlusion = &occlusion_buffer;
+    }
+
     prepare_final_draw(camera, light_source);
-    draw_scene();
+    draw_scene(camera_frustum, SCENE_ALL, occlusion);
 
     if (editor_enabled)
     {
+        start_gpu_timer(GPU_TIMER_DEBUG);
         prepare_debug_draw(camera);
         for (auto& entity : entities)
         {
@@ -384,12 +669,24 @@ void render_game()
             debug_draw_rectangle(entity.transform, r, g, b);
         }
 
-        for (auto p : nav_polys)
+        if (nav_mesh_lines_version != nav_mesh_version)
         {
-            if (p.occupied)
+            begin_debug_line_set(nav_mesh_lines);
+            for (auto p : nav_polys)
             {
-                debug_draw_poly(&nav_vertices[p.offset], p.count, 0.0f, 0.0f, 1.0f);
+                if (p.occupied)
+                {
+                    debug_draw_poly(&nav_vertices[p.offset], p.count, 0.0f, 0.0f, 1.0f);
+                }
             }
+            end_debug_line_set();
+
+            nav_mesh_lines_version = nav_mesh_version;
         }
+
+        draw_debug_line_set(nav_mesh_lines);
+        flush_debug_draws();
     }
+
+    stop_gpu_timer();
 }
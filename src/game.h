@@ -1,6 +1,8 @@
 #pragma once
 
+#include "culling.h"
 #include "entity.h"
+#include "hbmath.h"
 
 struct GameState
 {
@@ -9,6 +11,16 @@ struct GameState
 
 extern GameState game_state;
 
+// Whether the editor windows and debug overlay are shown
+extern bool editor_enabled;
+
+// Whether the main pass hides entities behind large ones, and what that culled last frame
+extern bool occlusion_culling_enabled;
+extern CullStats occlusion_stats;
+
 void init_game();
 void update_game(float dt);
 void render_game();
+
+// Moves the camera. Yaw turns around the z axis, and a pitch of 0 looks straight down.
+void set_camera_view(hbmath::Vec3 pos, float yaw, float pitch);
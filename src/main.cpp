@@ -4,16 +4,22 @@
 #include "game.h"
 #include "rendering.h"
 #include "entity.h"
+#include "profiler.h"
 
 #include "GL/glew.h"
 #include "imgui.h"
 #include "backends/imgui_impl_sdl.h"
 #include "backends/imgui_impl_opengl3.h"
+#include <chrono>
 #include <cstdio>
 
 #define INITIAL_SCREEN_WIDTH 800
 #define INITIAL_SCREEN_HEIGHT 600
 
+// Longest time step a frame advances the game by, so that a stall (e.g. loading or a
+// debugger break) doesn't move things through walls
+#define MAX_FRAME_TIME 0.1f
+
 using render::init_rendering;
 using render::present_screen;
 
@@ -71,11 +77,14 @@ int main()
         ImGui::GetStyle().FrameRounding = 4.0f;
     }
 
+    PROFILE_THREAD("Main");
+
     init_rendering(window);
     init_entities();
     init_game();
 
     bool running = true;
+    auto last_frame_time = std::chrono::steady_clock::now();
 
     while (running)
     {
@@ -103,18 +112,28 @@ int main()
             running = false;
         }
 
-        // TODO: frame timing
-        update_game(1.0f / 60.0f);
-
+        // The game advances by the time the last frame took
+        auto frame_time = std::chrono::steady_clock::now();
+        std::chrono::duration<float> dt = frame_time - last_frame_time;
+        last_frame_time = frame_time;
+        update_game(dt.count() < MAX_FRAME_TIME ? dt.count() : MAX_FRAME_TIME);
 
         render_game();
 
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        {
+            PROFILE_SCOPE("Draw GUI");
+            ImGui::Render();
+            render::start_gpu_timer(render::GPU_TIMER_GUI);
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+            render::stop_gpu_timer();
+        }
 
         present_screen(window);
+        end_profile_frame();
     }
 
+    render::shutdown_rendering();
+
     SDL_Quit();
     return 0;
 }
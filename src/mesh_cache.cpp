@@ -0,0 +1,257 @@
+#include "mesh_cache.h"
+
+#include <cstdio>
+#include <cstring>
+
+#define MESH_CACHE_MAGIC 0x4853454D // "MESH"
+
+struct MaterialLibraryStamp
+{
+    char path[MESH_CACHE_MAX_PATH];
+
+    // A library that didn't exist when the mesh was cooked must still not exist
+    u32 exists;
+    SourceStamp stamp;
+};
+
+struct MeshCacheHeader
+{
+    // The cache file is ordered:
+    // - header
+    // - mesh
+    // - render object
+    // - submeshes
+    // - materials
+    // - vertex data
+    // - index data
+
+    u32 magic;
+    u32 version;
+
+    // Covers the cooking settings and the sizes of the structs written raw to the file
+    u64 settings_hash;
+
+    SourceStamp source;
+
+    u32 material_library_count;
+    MaterialLibraryStamp material_libraries[MESH_CACHE_MAX_MATERIAL_LIBRARIES];
+
+    u32 submesh_count;
+    u32 material_count;
+    u32 vertex_bytes;
+    u32 index_bytes;
+};
+
+static void get_cache_path(const char* source_path, char* cache_path, size_t size)
+{
+    snprintf(cache_path, size, "%s.meshcache", source_path);
+}
+
+static bool material_library_unchanged(const MaterialLibraryStamp& library)
+{
+    if (library.exists)
+    {
+        return source_unchanged(library.path, library.stamp);
+    }
+
+    SourceStamp stamp;
+    return !stamp_source(library.path, &stamp);
+}
+
+// Finds the material libraries the OBJ's mtllib lines name, resolved relative to the OBJ the
+// same way fast_obj resolves them, and stamps them. Returns false if there are too many or
+// a path is too long.
+static bool stamp_material_libraries(const char* source_path, MeshCacheHeader* header)
+{
+    header->material_library_count = 0;
+
+    MappedFile source;
+    if (!map_file(source_path, &source))
+    {
+        return false;
+    }
+
+    const char* separator = strrchr(source_path, '/');
+    size_t base_length = separator ? separator - source_path + 1 : 0;
+
+    bool success = true;
+    const char* cursor = (const char*) source.data;
+    const char* end = cursor + source.size;
+    while (cursor < end)
+    {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+        {
+            ++cursor;
+        }
+
+        if (end - cursor > 6 && strncmp(cursor, "mtllib", 6) == 0
+            && (cursor[6] == ' ' || cursor[6] == '\t' || cursor[6] == '\r'))
+        {
+            cursor += 6;
+            while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+            {
+                ++cursor;
+            }
+
+            // Names end at a tab or the end of the line, so they can contain spaces
+            const char* name = cursor;
+            while (cursor < end && *cursor != '\t' && *cursor != '\r' && *cursor != '\n')
+            {
+                ++cursor;
+            }
+            size_t name_length = cursor - name;
+
+            if (header->material_library_count == MESH_CACHE_MAX_MATERIAL_LIBRARIES
+                || base_length + name_length >= MESH_CACHE_MAX_PATH)
+            {
+                success = false;
+                break;
+            }
+
+            MaterialLibraryStamp* library = &header->material_libraries[header->material_library_count++];
+            memset(library, 0, sizeof(MaterialLibraryStamp));
+            memcpy(library->path, source_path, base_length);
+            memcpy(library->path + base_length, name, name_length);
+            for (char* c = library->path; *c; ++c)
+            {
+                if (*c == '\\')
+                {
+                    *c = '/';
+                }
+            }
+
+            library->exists = stamp_source(library->path, &library->stamp);
+        }
+
+        while (cursor < end && *cursor != '\n')
+        {
+            ++cursor;
+        }
+        ++cursor;
+    }
+
+    unmap_file(&source);
+    return success;
+}
+
+// Adds the sizes of the structs that are written raw to the settings hash, so that
+// changing any of them invalidates old caches
+static u64 layout_hash(u64 settings_hash)
+{
+    u32 sizes[] = {
+        sizeof(render::Mesh),
+        sizeof(render::RenderObject),
+        sizeof(render::SubMesh),
+        sizeof(CookedMaterial),
+    };
+    return hash_data(sizes, sizeof(sizes), settings_hash);
+}
+
+bool open_mesh_cache(const char* source_path, u64 settings_hash, CookedMesh* cooked)
+{
+    char cache_path[MESH_CACHE_MAX_PATH + 16];
+    get_cache_path(source_path, cache_path, sizeof(cache_path));
+
+    MappedFile mapping;
+    if (!map_file(cache_path, &mapping))
+    {
+        return false;
+    }
+
+    const MeshCacheHeader* header = (const MeshCacheHeader*) mapping.data;
+
+    bool valid = mapping.size >= sizeof(MeshCacheHeader)
+                 && header->magic == MESH_CACHE_MAGIC
+                 && header->version == MESH_CACHE_VERSION
+                 && header->settings_hash == layout_hash(settings_hash)
+                 && header->material_library_count <= MESH_CACHE_MAX_MATERIAL_LIBRARIES;
+
+    if (valid)
+    {
+        size_t expected_size = sizeof(MeshCacheHeader) + sizeof(render::Mesh) + sizeof(render::RenderObject)
+                               + header->submesh_count * sizeof(render::SubMesh)
+                               + header->material_count * sizeof(CookedMaterial)
+                               + header->vertex_bytes + header->index_bytes;
+        valid = expected_size == mapping.size && source_unchanged(source_path, header->source);
+    }
+
+    for (u32 i = 0; valid && i < header->material_library_count; ++i)
+    {
+        valid = material_library_unchanged(header->material_libraries[i]);
+    }
+
+    if (!valid)
+    {
+        unmap_file(&mapping);
+        return false;
+    }
+
+    const u8* cursor = mapping.data + sizeof(MeshCacheHeader);
+
+    memcpy(&cooked->mesh, cursor, sizeof(render::Mesh));
+    cursor += sizeof(render::Mesh);
+
+    memcpy(&cooked->object, cursor, sizeof(render::RenderObject));
+    cooked->object.filename = "";
+    cursor += sizeof(render::RenderObject);
+
+    cooked->submeshes = (const render::SubMesh*) cursor;
+    cursor += header->submesh_count * sizeof(render::SubMesh);
+
+    cooked->materials = (const CookedMaterial*) cursor;
+    cooked->material_count = header->material_count;
+    cursor += header->material_count * sizeof(CookedMaterial);
+
+    cooked->vertices = cursor;
+    cooked->vertex_bytes = header->vertex_bytes;
+    cursor += header->vertex_bytes;
+
+    cooked->indices = cursor;
+    cooked->index_bytes = header->index_bytes;
+
+    cooked->mapping = mapping;
+
+    return true;
+}
+
+void close_mesh_cache(CookedMesh* cooked)
+{
+    unmap_file(&cooked->mapping);
+}
+
+void write_mesh_cache(const char* source_path, u64 settings_hash, const CookedMesh& cooked)
+{
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(MeshCacheHeader));
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.settings_hash = layout_hash(settings_hash);
+    header.submesh_count = cooked.object.submesh_count * cooked.object.lod_count;
+    header.material_count = cooked.material_count;
+    header.vertex_bytes = cooked.vertex_bytes;
+    header.index_bytes = cooked.index_bytes;
+
+    if (!stamp_source(source_path, &header.source) || !stamp_material_libraries(source_path, &header))
+    {
+        return;
+    }
+
+    char cache_path[MESH_CACHE_MAX_PATH + 16];
+    get_cache_path(source_path, cache_path, sizeof(cache_path));
+
+    FILE* cache_file = begin_cache_write(cache_path);
+    if (!cache_file)
+    {
+        return;
+    }
+
+    fwrite(&header, sizeof(MeshCacheHeader), 1, cache_file);
+    fwrite(&cooked.mesh, sizeof(render::Mesh), 1, cache_file);
+    fwrite(&cooked.object, sizeof(render::RenderObject), 1, cache_file);
+    fwrite(cooked.submeshes, sizeof(render::SubMesh), header.submesh_count, cache_file);
+    fwrite(cooked.materials, sizeof(CookedMaterial), cooked.material_count, cache_file);
+    fwrite(cooked.vertices, 1, cooked.vertex_bytes, cache_file);
+    fwrite(cooked.indices, 1, cooked.index_bytes, cache_file);
+
+    end_cache_write(cache_file, cache_path);
+}
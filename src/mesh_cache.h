@@ -0,0 +1,55 @@
+#pragma once
+
+#include "asset_cache.h"
+#include "rendering.h"
+#include "util.h"
+
+// Cooked meshes are stored next to their source file, as <source>.meshcache
+#define MESH_CACHE_VERSION 3
+
+#define MESH_CACHE_MAX_PATH 256
+
+// Materials are cooked from the material libraries the OBJ names, which the cache is
+// validated against as well. OBJs naming more libraries than this aren't cached.
+#define MESH_CACHE_MAX_MATERIAL_LIBRARIES 8
+
+struct CookedMaterial
+{
+    // texture_id is not meaningful in a cooked material, the texture is loaded from texture_path
+    render::Material material;
+
+    // Empty if the material is not textured
+    char texture_path[MESH_CACHE_MAX_PATH];
+};
+
+// A render object in the form it is uploaded to the GPU in. Submesh material ids index
+// materials, and the object's first_submesh is 0.
+struct CookedMesh
+{
+    // Only the vertex and index layout of the mesh is used, not the GL objects
+    render::Mesh mesh;
+    render::RenderObject object;
+
+    // object.submesh_count * object.lod_count submeshes
+    const render::SubMesh* submeshes;
+
+    const CookedMaterial* materials;
+    u32 material_count;
+
+    const void* vertices;
+    u32 vertex_bytes;
+
+    const void* indices;
+    u32 index_bytes;
+
+    // The file mapping the pointers above point into, if the mesh was read from a cache
+    MappedFile mapping;
+};
+
+// Maps the cache of source_path if it was cooked from the current source file and material
+// libraries with the same settings_hash. The pointers in cooked point into the mapping until close_mesh_cache.
+bool open_mesh_cache(const char* source_path, u64 settings_hash, CookedMesh* cooked);
+void close_mesh_cache(CookedMesh* cooked);
+
+// Writes cooked to the cache of source_path
+void write_mesh_cache(const char* source_path, u64 settings_hash, const CookedMesh& cooked);
@@ -0,0 +1,629 @@
+#include "mesh_optimize.h"
+
+#include "hbmath.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using hbmath::Vec3;
+
+static u32 hash_bytes(const u8* data, size_t size)
+{
+    // FNV-1a
+    u32 hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+u32 weld_vertices(void* vertices, u32 vertex_count, size_t vertex_size, u32* indices)
+{
+    u8* vertex_bytes = (u8*) vertices;
+
+    // Open addressing hash table from vertex bytes to unique vertex index, kept at most
+    // half full so that probe sequences stay short
+    u32 table_size = 1;
+    while (table_size < 2 * vertex_count)
+    {
+        table_size *= 2;
+    }
+
+    u32* table = (u32*) malloc(table_size * sizeof(u32));
+    memset(table, 0xFF, table_size * sizeof(u32));
+
+    u32 unique_count = 0;
+
+    for (u32 i = 0; i < vertex_count; ++i)
+    {
+        const u8* vertex = vertex_bytes + i * vertex_size;
+        u32 slot = hash_bytes(vertex, vertex_size) & (table_size - 1);
+
+        while (table[slot] != INVALID_INDEX
+               && memcmp(vertex_bytes + table[slot] * vertex_size, vertex, vertex_size) != 0)
+        {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == INVALID_INDEX)
+        {
+            // New vertex, move it down to the end of the unique vertices. Since
+            // unique_count <= i this never overwrites a vertex that hasn't been read yet.
+            if (unique_count != i)
+            {
+                memcpy(vertex_bytes + unique_count * vertex_size, vertex, vertex_size);
+            }
+            table[slot] = unique_count;
+            ++unique_count;
+        }
+
+        indices[i] = table[slot];
+    }
+
+    free(table);
+
+    return unique_count;
+}
+
+void optimize_vertex_cache(u32* indices, u32 index_count, u32 vertex_count)
+{
+    if (index_count == 0 || vertex_count == 0)
+    {
+        return;
+    }
+
+    const u32 cache_size = VERTEX_CACHE_SIZE;
+    u32 triangle_count = index_count / 3;
+
+    // Triangles that use each vertex: vertex v's triangles are
+    // adjacency[adjacency_offset[v]] to adjacency[adjacency_offset[v + 1] - 1]
+    u32* adjacency_offset = (u32*) calloc(vertex_count + 1, sizeof(u32));
+    u32* adjacency = (u32*) malloc(index_count * sizeof(u32));
+
+    // Number of triangles using each vertex that haven't been emitted yet
+    u32* live_triangles = (u32*) calloc(vertex_count, sizeof(u32));
+
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        ++live_triangles[indices[i]];
+    }
+
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        adjacency_offset[v + 1] = adjacency_offset[v] + live_triangles[v];
+    }
+
+    u32* adjacency_fill = (u32*) malloc(vertex_count * sizeof(u32));
+    memcpy(adjacency_fill, adjacency_offset, vertex_count * sizeof(u32));
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        adjacency[adjacency_fill[indices[i]]++] = i / 3;
+    }
+    free(adjacency_fill);
+
+    // Time each vertex last entered the cache. A vertex is in the cache if fewer than
+    // cache_size vertices have entered the cache since then.
+    u32* cache_time = (u32*) calloc(vertex_count, sizeof(u32));
+    u32 time = cache_size + 1;
+
+    bool* emitted = (bool*) calloc(triangle_count, sizeof(bool));
+
+    // Recently used vertices, used to find somewhere to continue when the fanning vertex
+    // has no triangles left that are near in the cache
+    u32* dead_end = (u32*) malloc(index_count * sizeof(u32));
+    u32 dead_end_size = 0;
+
+    u32* candidates = (u32*) malloc(index_count * sizeof(u32));
+
+    u32* output = (u32*) malloc(index_count * sizeof(u32));
+    u32 output_size = 0;
+
+    // Next vertex in input order to check when the dead end stack is empty
+    u32 input_cursor = 0;
+
+    u32 fanning_vertex = 0;
+    while (fanning_vertex != INVALID_INDEX)
+    {
+        u32 candidate_count = 0;
+
+        // Emit all remaining triangles around the fanning vertex
+        for (u32 a = adjacency_offset[fanning_vertex]; a < adjacency_offset[fanning_vertex + 1]; ++a)
+        {
+            u32 triangle = adjacency[a];
+            if (emitted[triangle])
+            {
+                continue;
+            }
+
+            for (u32 corner = 0; corner < 3; ++corner)
+            {
+                u32 v = indices[3 * triangle + corner];
+
+                output[output_size++] = v;
+                dead_end[dead_end_size++] = v;
+                candidates[candidate_count++] = v;
+                --live_triangles[v];
+
+                if (time - cache_time[v] > cache_size)
+                {
+                    cache_time[v] = time;
+                    ++time;
+                }
+            }
+
+            emitted[triangle] = true;
+        }
+
+        // Pick the candidate that will still be in the cache after its remaining
+        // triangles are emitted, preferring the one that entered the cache earliest
+        fanning_vertex = INVALID_INDEX;
+        u32 best_priority = 0;
+
+        for (u32 c = 0; c < candidate_count; ++c)
+        {
+            u32 v = candidates[c];
+            if (!live_triangles[v])
+            {
+                continue;
+            }
+
+            u32 priority = 1;
+            if (time - cache_time[v] + 2 * live_triangles[v] <= cache_size)
+            {
+                priority += time - cache_time[v];
+            }
+
+            if (priority > best_priority)
+            {
+                best_priority = priority;
+                fanning_vertex = v;
+            }
+        }
+
+        if (fanning_vertex != INVALID_INDEX)
+        {
+            continue;
+        }
+
+        // No good candidate, so continue from a recently used vertex
+        while (dead_end_size)
+        {
+            u32 v = dead_end[--dead_end_size];
+            if (live_triangles[v])
+            {
+                fanning_vertex = v;
+                break;
+            }
+        }
+
+        // Otherwise start from the next vertex in input order with triangles left
+        while (fanning_vertex == INVALID_INDEX && input_cursor < vertex_count)
+        {
+            if (live_triangles[input_cursor])
+            {
+                fanning_vertex = input_cursor;
+            }
+            ++input_cursor;
+        }
+    }
+
+    assert(output_size == triangle_count * 3);
+    memcpy(indices, output, output_size * sizeof(u32));
+
+    free(output);
+    free(candidates);
+    free(dead_end);
+    free(emitted);
+    free(cache_time);
+    free(live_triangles);
+    free(adjacency);
+    free(adjacency_offset);
+}
+
+void optimize_vertex_fetch(void* vertices, u32 vertex_count, size_t vertex_size, u32* indices, u32 index_count)
+{
+    u32* remap = (u32*) malloc(vertex_count * sizeof(u32));
+    memset(remap, 0xFF, vertex_count * sizeof(u32));
+
+    u8* reordered = (u8*) malloc(vertex_count * vertex_size);
+    u32 next_vertex = 0;
+
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        u32 v = indices[i];
+        if (remap[v] == INVALID_INDEX)
+        {
+            remap[v] = next_vertex;
+            memcpy(reordered + next_vertex * vertex_size, (u8*) vertices + v * vertex_size, vertex_size);
+            ++next_vertex;
+        }
+        indices[i] = remap[v];
+    }
+
+    // Vertices that no triangle uses are kept at the end
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        if (remap[v] == INVALID_INDEX)
+        {
+            memcpy(reordered + next_vertex * vertex_size, (u8*) vertices + v * vertex_size, vertex_size);
+            ++next_vertex;
+        }
+    }
+
+    memcpy(vertices, reordered, vertex_count * vertex_size);
+
+    free(reordered);
+    free(remap);
+}
+
+float compute_acmr(const u32* indices, u32 index_count, u32 vertex_count)
+{
+    if (index_count < 3)
+    {
+        return 0.0f;
+    }
+
+    const u32 cache_size = VERTEX_CACHE_SIZE;
+
+    // A vertex is in the FIFO cache if fewer than cache_size misses happened after it was added
+    u32* cache_time = (u32*) calloc(vertex_count, sizeof(u32));
+    u32 time = cache_size + 1;
+    u32 misses = 0;
+
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        u32 v = indices[i];
+        if (time - cache_time[v] > cache_size)
+        {
+            cache_time[v] = time;
+            ++time;
+            ++misses;
+        }
+    }
+
+    free(cache_time);
+
+    return float(misses) / float(index_count / 3);
+}
+
+// Sum of squared distances to a set of planes. For a point p, the value is
+// p^T A p + 2 b^T p + c, with A symmetric.
+struct Quadric
+{
+    double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+    double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+    double c = 0.0;
+
+    void add_plane(Vec3 normal, float d)
+    {
+        a00 += normal.x * normal.x; a01 += normal.x * normal.y; a02 += normal.x * normal.z;
+        a11 += normal.y * normal.y; a12 += normal.y * normal.z; a22 += normal.z * normal.z;
+        b0 += normal.x * d; b1 += normal.y * d; b2 += normal.z * d;
+        c += (double) d * d;
+    }
+
+    void add(const Quadric& other)
+    {
+        a00 += other.a00; a01 += other.a01; a02 += other.a02;
+        a11 += other.a11; a12 += other.a12; a22 += other.a22;
+        b0 += other.b0; b1 += other.b1; b2 += other.b2;
+        c += other.c;
+    }
+
+    double evaluate(Vec3 p) const
+    {
+        double result = a00 * p.x * p.x + a11 * p.y * p.y + a22 * p.z * p.z
+                        + 2.0 * (a01 * p.x * p.y + a02 * p.x * p.z + a12 * p.y * p.z)
+                        + 2.0 * (b0 * p.x + b1 * p.y + b2 * p.z)
+                        + c;
+        return result > 0.0 ? result : 0.0;
+    }
+};
+
+struct Collapse
+{
+    u32 from;
+    u32 to;
+    float cost;
+};
+
+static int compare_collapses(const void* a, const void* b)
+{
+    float cost_a = ((const Collapse*) a)->cost;
+    float cost_b = ((const Collapse*) b)->cost;
+    return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+static Vec3 get_position(const float* positions, size_t stride, u32 vertex)
+{
+    return Vec3((float*) ((const u8*) positions + vertex * stride));
+}
+
+// Finds the triangles using each vertex, see optimize_vertex_cache
+static void build_adjacency(const u32* indices, u32 index_count, u32 vertex_count,
+                            u32* adjacency_offset, u32* adjacency)
+{
+    memset(adjacency_offset, 0, (vertex_count + 1) * sizeof(u32));
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        ++adjacency_offset[indices[i] + 1];
+    }
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        adjacency_offset[v + 1] += adjacency_offset[v];
+    }
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        adjacency[adjacency_offset[indices[i]]++] = i / 3;
+    }
+
+    // Filling advanced each offset to the next vertex's offset, so shift them back
+    for (u32 v = vertex_count; v > 0; --v)
+    {
+        adjacency_offset[v] = adjacency_offset[v - 1];
+    }
+    adjacency_offset[0] = 0;
+}
+
+// Returns whether moving vertex from onto vertex to would flip any triangle that survives the collapse
+static bool collapse_flips(const float* positions, size_t stride, const u32* indices,
+                           const u32* adjacency_offset, const u32* adjacency, u32 from, u32 to)
+{
+    Vec3 to_position = get_position(positions, stride, to);
+
+    for (u32 a = adjacency_offset[from]; a < adjacency_offset[from + 1]; ++a)
+    {
+        const u32* triangle = indices + 3 * adjacency[a];
+        if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+        {
+            // Removed by the collapse
+            continue;
+        }
+
+        Vec3 corners[3];
+        for (u32 i = 0; i < 3; ++i)
+        {
+            corners[i] = get_position(positions, stride, triangle[i]);
+        }
+        Vec3 normal = cross(corners[1] - corners[0], corners[2] - corners[0]);
+
+        for (u32 i = 0; i < 3; ++i)
+        {
+            if (triangle[i] == from) corners[i] = to_position;
+        }
+        Vec3 new_normal = cross(corners[1] - corners[0], corners[2] - corners[0]);
+
+        if (dot(normal, new_normal) <= 0.0f)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+u32 simplify_mesh(const float* positions, size_t position_stride, u32 vertex_count,
+                  const u32* indices, u32 index_count, u32 target_index_count,
+                  float max_error, u32* out_indices, float* error)
+{
+    memcpy(out_indices, indices, index_count * sizeof(u32));
+    *error = 0.0f;
+
+    Quadric* quadrics = new Quadric[vertex_count];
+    bool* locked = (bool*) calloc(vertex_count, sizeof(bool));
+    bool* touched = (bool*) malloc(vertex_count * sizeof(bool));
+    u32* remap = (u32*) malloc(vertex_count * sizeof(u32));
+    u32* adjacency_offset = (u32*) malloc((vertex_count + 1) * sizeof(u32));
+    u32* adjacency = (u32*) malloc(index_count * sizeof(u32));
+    Collapse* collapses = (Collapse*) malloc(index_count * sizeof(Collapse));
+
+    for (u32 t = 0; t < index_count; t += 3)
+    {
+        Vec3 p0 = get_position(positions, position_stride, indices[t]);
+        Vec3 p1 = get_position(positions, position_stride, indices[t + 1]);
+        Vec3 p2 = get_position(positions, position_stride, indices[t + 2]);
+
+        Vec3 normal = cross(p1 - p0, p2 - p0);
+        if (normal.square_magnitude() == 0.0f)
+        {
+            continue;
+        }
+        normal = normal.normalize();
+
+        Quadric plane;
+        plane.add_plane(normal, -dot(normal, p0));
+        for (u32 i = 0; i < 3; ++i)
+        {
+            quadrics[indices[t + i]].add(plane);
+        }
+    }
+
+    // Lock vertices whose position is shared with another vertex, by hashing positions
+    u32 table_size = 1;
+    while (table_size < 2 * vertex_count)
+    {
+        table_size *= 2;
+    }
+    u32* table = (u32*) malloc(table_size * sizeof(u32));
+    memset(table, 0xFF, table_size * sizeof(u32));
+
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        const u8* position = (const u8*) positions + v * position_stride;
+        u32 slot = hash_bytes(position, 3 * sizeof(float)) & (table_size - 1);
+
+        while (table[slot] != INVALID_INDEX)
+        {
+            const u8* other = (const u8*) positions + table[slot] * position_stride;
+            if (memcmp(position, other, 3 * sizeof(float)) == 0)
+            {
+                locked[v] = true;
+                locked[table[slot]] = true;
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == INVALID_INDEX)
+        {
+            table[slot] = v;
+        }
+    }
+    free(table);
+
+    // Lock border vertices. An edge is on the border if no triangle uses it in the
+    // opposite direction.
+    build_adjacency(out_indices, index_count, vertex_count, adjacency_offset, adjacency);
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        u32 a = out_indices[i];
+        u32 b = out_indices[i % 3 == 2 ? i - 2 : i + 1];
+
+        bool has_opposite = false;
+        for (u32 adj = adjacency_offset[b]; adj < adjacency_offset[b + 1] && !has_opposite; ++adj)
+        {
+            const u32* triangle = out_indices + 3 * adjacency[adj];
+            for (u32 corner = 0; corner < 3; ++corner)
+            {
+                if (triangle[corner] == b && triangle[(corner + 1) % 3] == a)
+                {
+                    has_opposite = true;
+                }
+            }
+        }
+
+        if (!has_opposite)
+        {
+            locked[a] = true;
+            locked[b] = true;
+        }
+    }
+
+    // Quadrics hold squared distances
+    float max_cost = max_error * max_error;
+
+    while (index_count > target_index_count)
+    {
+        build_adjacency(out_indices, index_count, vertex_count, adjacency_offset, adjacency);
+
+        // Pick the cheaper direction of every edge that can collapse
+        u32 collapse_count = 0;
+        for (u32 i = 0; i < index_count; ++i)
+        {
+            u32 a = out_indices[i];
+            u32 b = out_indices[i % 3 == 2 ? i - 2 : i + 1];
+
+            // Each interior edge is seen from both of its triangles, so only take one
+            if (a > b || (locked[a] && locked[b]))
+            {
+                continue;
+            }
+
+            Quadric combined = quadrics[a];
+            combined.add(quadrics[b]);
+
+            Collapse collapse;
+            float cost_ab = locked[a] ? FLT_MAX : (float) combined.evaluate(get_position(positions, position_stride, b));
+            float cost_ba = locked[b] ? FLT_MAX : (float) combined.evaluate(get_position(positions, position_stride, a));
+
+            if (cost_ab <= cost_ba)
+            {
+                collapse.from = a;
+                collapse.to = b;
+                collapse.cost = cost_ab;
+            }
+            else
+            {
+                collapse.from = b;
+                collapse.to = a;
+                collapse.cost = cost_ba;
+            }
+
+            collapses[collapse_count++] = collapse;
+        }
+
+        qsort(collapses, collapse_count, sizeof(Collapse), compare_collapses);
+
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            remap[v] = v;
+            touched[v] = false;
+        }
+
+        // Every collapse removes about two triangles
+        u32 triangles_to_remove = (index_count - target_index_count) / 3;
+        u32 triangles_removed = 0;
+        u32 collapses_applied = 0;
+
+        for (u32 c = 0; c < collapse_count && triangles_removed < triangles_to_remove; ++c)
+        {
+            Collapse collapse = collapses[c];
+            if (collapse.cost > max_cost)
+            {
+                break;
+            }
+
+            if (touched[collapse.from] || touched[collapse.to]
+                || collapse_flips(positions, position_stride, out_indices,
+                                  adjacency_offset, adjacency, collapse.from, collapse.to))
+            {
+                continue;
+            }
+
+            remap[collapse.from] = collapse.to;
+            quadrics[collapse.to].add(quadrics[collapse.from]);
+
+            // The flip test above assumed the triangles around from don't change, so
+            // don't let any other collapse in this pass move their vertices
+            for (u32 a = adjacency_offset[collapse.from]; a < adjacency_offset[collapse.from + 1]; ++a)
+            {
+                const u32* triangle = out_indices + 3 * adjacency[a];
+                touched[triangle[0]] = true;
+                touched[triangle[1]] = true;
+                touched[triangle[2]] = true;
+            }
+
+            float collapse_error = sqrtf(collapse.cost);
+            if (collapse_error > *error) *error = collapse_error;
+
+            triangles_removed += 2;
+            ++collapses_applied;
+        }
+
+        if (!collapses_applied)
+        {
+            break;
+        }
+
+        // Apply the collapses and drop the triangles that became degenerate
+        u32 new_index_count = 0;
+        for (u32 t = 0; t < index_count; t += 3)
+        {
+            u32 v0 = remap[out_indices[t]];
+            u32 v1 = remap[out_indices[t + 1]];
+            u32 v2 = remap[out_indices[t + 2]];
+
+            if (v0 != v1 && v1 != v2 && v2 != v0)
+            {
+                out_indices[new_index_count++] = v0;
+                out_indices[new_index_count++] = v1;
+                out_indices[new_index_count++] = v2;
+            }
+        }
+        index_count = new_index_count;
+    }
+
+    free(collapses);
+    free(adjacency);
+    free(adjacency_offset);
+    free(remap);
+    free(touched);
+    free(locked);
+    delete[] quadrics;
+
+    return index_count;
+}
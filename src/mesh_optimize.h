@@ -0,0 +1,35 @@
+#pragma once
+
+#include "util.h"
+
+// Size of the FIFO post-transform vertex cache that meshes are optimized for
+#define VERTEX_CACHE_SIZE 16
+
+// Merges vertices whose bytes are identical. The unique vertices are moved to the start
+// of vertices, and indices[i] is set to the new index of input vertex i.
+// Returns the number of unique vertices.
+u32 weld_vertices(void* vertices, u32 vertex_count, size_t vertex_size, u32* indices);
+
+// Reorders the triangles in indices so that vertices are reused while they are still in
+// the post-transform cache (Tipsify, Sander et al. 2007).
+void optimize_vertex_cache(u32* indices, u32 index_count, u32 vertex_count);
+
+// Reorders the vertices in the order they are first referenced by indices, and remaps
+// indices to match, so that vertex fetches walk through memory linearly.
+void optimize_vertex_fetch(void* vertices, u32 vertex_count, size_t vertex_size, u32* indices, u32 index_count);
+
+// Returns the average cache miss ratio: the number of vertices transformed per triangle
+// with a FIFO cache of VERTEX_CACHE_SIZE vertices. 3.0 is the worst case, 0.5 is about the
+// best possible for large regular meshes.
+float compute_acmr(const u32* indices, u32 index_count, u32 vertex_count);
+
+// Simplifies a mesh by collapsing edges in order of quadric error (Garland and Heckbert 1997).
+// Vertices are not moved or created, so the output indices reference the same vertices.
+// Vertices on a mesh border or an attribute seam (a position shared with another vertex)
+// are never removed, which keeps the outline and texture mapping intact.
+// Collapses stop when the index count reaches target_index_count or the next collapse would
+// move the surface further than max_error. Writes the indices to out_indices, which must have
+// room for index_count indices, and the largest error to *error. Returns the new index count.
+u32 simplify_mesh(const float* positions, size_t position_stride, u32 vertex_count,
+                  const u32* indices, u32 index_count, u32 target_index_count,
+                  float max_error, u32* out_indices, float* error);
@@ -1,6 +1,7 @@
 #include "navigation.h"
 #include "entity.h"
 #include "shapes.h"
+#include "profiler.h"
 
 #include <cassert>
 
@@ -10,6 +11,7 @@ using hbmath::Mat2;
 MAKE_ARRAY(nav_polys, NavPoly, 1024);
 MAKE_ARRAY(nav_connections, u32, 1024);
 MAKE_ARRAY(nav_vertices, Vec2, 1024);
+u32 nav_mesh_version = 0;
 
 // Note to my future self: I am sorry. There are a lot of different cases here.
 // I recommend you draw each of them out to understand what is happening.
@@ -195,6 +197,8 @@ static void add_obstacle(Array<Vec2> wall)
 
 void build_nav_mesh(float left, float right, float bottom, float top)
 {
+    PROFILE_FUNCTION();
+    ++nav_mesh_version;
     nav_vertices.clear();
     nav_polys.clear();
 
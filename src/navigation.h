@@ -14,4 +14,7 @@ extern Array<NavPoly> nav_polys;
 extern Array<u32> nav_connections;
 extern Array<hbmath::Vec2> nav_vertices;
 
+// Incremented every time the nav mesh is built
+extern u32 nav_mesh_version;
+
 void build_nav_mesh(float left, float right, float bottom, float top);
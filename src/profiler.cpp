@@ -0,0 +1,369 @@
+#include "profiler.h"
+
+#include "imgui.h"
+
+#include <cstdio>
+#include <cstring> // for memmove
+
+#ifdef ENABLE_PROFILER
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#define MAX_PROFILED_THREADS 16
+
+// Must be a power of two
+#define PROFILE_RING_SIZE 8192
+
+// Most events drained in one frame
+#define MAX_FRAME_EVENTS 16384
+
+struct ProfileEvent
+{
+    const char* name;
+
+    // Nanoseconds since the program started
+    u64 start;
+    u64 end;
+
+    // Number of markers the event is nested in
+    u32 depth;
+};
+
+// The finished markers of one thread. Only the owning thread writes events and write_count,
+// and only the main thread reads them, so no locks are needed. If the main thread falls
+// more than PROFILE_RING_SIZE events behind, the oldest events are lost.
+struct ThreadProfile
+{
+    std::atomic<const char*> name;
+    std::atomic<bool> registered;
+
+    // Markers open on the owning thread
+    u32 depth;
+
+    std::atomic<u64> write_count;
+
+    // Only used by the main thread
+    u64 read_count;
+
+    ProfileEvent events[PROFILE_RING_SIZE];
+};
+
+static ThreadProfile thread_profiles[MAX_PROFILED_THREADS];
+static std::atomic<u32> profiled_thread_count(0);
+static thread_local ThreadProfile* thread_profile = nullptr;
+
+static const std::chrono::steady_clock::time_point profile_epoch = std::chrono::steady_clock::now();
+
+static u64 profile_time()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profile_epoch).count();
+}
+
+// Threads are registered by their first marker or name
+static ThreadProfile* get_thread_profile()
+{
+    if (!thread_profile)
+    {
+        u32 index = profiled_thread_count.fetch_add(1);
+        assert(index < MAX_PROFILED_THREADS);
+
+        thread_profile = &thread_profiles[index];
+        thread_profile->name.store("Thread", std::memory_order_relaxed);
+        thread_profile->registered.store(true, std::memory_order_release);
+    }
+
+    return thread_profile;
+}
+
+void set_profile_thread_name(const char* name)
+{
+    get_thread_profile()->name.store(name, std::memory_order_relaxed);
+}
+
+ProfileScope::ProfileScope(const char* name_)
+    : name(name_)
+{
+    ++get_thread_profile()->depth;
+    start = profile_time();
+}
+
+ProfileScope::~ProfileScope()
+{
+    u64 end = profile_time();
+
+    ThreadProfile* profile = thread_profile;
+    --profile->depth;
+
+    u64 index = profile->write_count.load(std::memory_order_relaxed);
+    profile->events[index & (PROFILE_RING_SIZE - 1)] = {name, start, end, profile->depth};
+    profile->write_count.store(index + 1, std::memory_order_release);
+}
+
+// Everything below is only used by the main thread
+
+struct FrameEvent
+{
+    ProfileEvent event;
+    u32 thread;
+};
+
+// Events drained this frame, and the ones shown by the flame view
+MAKE_ARRAY(drained_events, FrameEvent, MAX_FRAME_EVENTS);
+MAKE_ARRAY(shown_events, FrameEvent, MAX_FRAME_EVENTS);
+
+static u64 frame_start = 0;
+static u64 shown_frame_start = 0;
+static u64 shown_frame_end = 0;
+static bool flame_paused = false;
+
+// Events lost because a ring buffer overflowed or too many were drained in a frame
+static u64 dropped_events = 0;
+
+static FILE* capture_file = nullptr;
+static u32 capture_frames_left = 0;
+static bool capture_first_event;
+
+// Appends the events a thread has finished since it was last drained
+static void drain_thread_profile(u32 thread_index)
+{
+    ThreadProfile* profile = &thread_profiles[thread_index];
+    u64 written = profile->write_count.load(std::memory_order_acquire);
+
+    u64 first = profile->read_count;
+    if (written - first > PROFILE_RING_SIZE)
+    {
+        dropped_events += written - first - PROFILE_RING_SIZE;
+        first = written - PROFILE_RING_SIZE;
+    }
+
+    size_t copy_start = drained_events.size;
+    for (u64 i = first; i < written; ++i)
+    {
+        if (drained_events.size == drained_events.max_size)
+        {
+            dropped_events += written - i;
+            break;
+        }
+
+        drained_events.push({profile->events[i & (PROFILE_RING_SIZE - 1)], thread_index});
+    }
+
+    // The thread keeps writing while its events are copied, and may have overwritten some
+    // of them. Those copies are thrown away, including the slot of the event it may be
+    // writing but hasn't counted yet.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    u64 written_after = profile->write_count.load(std::memory_order_relaxed);
+    if (written_after + 1 - first > PROFILE_RING_SIZE)
+    {
+        size_t copied = drained_events.size - copy_start;
+        size_t overwritten = written_after + 1 - first - PROFILE_RING_SIZE;
+        if (overwritten > copied)
+        {
+            overwritten = copied;
+        }
+
+        memmove(&drained_events.data[copy_start], &drained_events.data[copy_start + overwritten],
+                (copied - overwritten) * sizeof(FrameEvent));
+        drained_events.size -= overwritten;
+        dropped_events += overwritten;
+    }
+
+    profile->read_count = written;
+}
+
+static void finish_profile_capture()
+{
+    // Name the threads. Metadata events can be anywhere in the trace.
+    u32 thread_count = profiled_thread_count.load(std::memory_order_acquire);
+    for (u32 i = 0; i < thread_count && i < MAX_PROFILED_THREADS; ++i)
+    {
+        if (thread_profiles[i].registered.load(std::memory_order_acquire))
+        {
+            fprintf(capture_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    capture_first_event ? "" : ",\n", i, thread_profiles[i].name.load(std::memory_order_relaxed));
+            capture_first_event = false;
+        }
+    }
+
+    fprintf(capture_file, "\n]}\n");
+    fclose(capture_file);
+    capture_file = nullptr;
+}
+
+static void write_capture_frame(u64 frame_end)
+{
+    // The end of the frame is marked across all threads
+    fprintf(capture_file, "%s{\"name\":\"Frame\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,\"ts\":%.3f}",
+            capture_first_event ? "" : ",\n", frame_end * 1e-3);
+    capture_first_event = false;
+
+    // Timestamps are in microseconds
+    for (const FrameEvent& frame_event : drained_events)
+    {
+        const ProfileEvent& event = frame_event.event;
+        fprintf(capture_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                event.name, frame_event.thread, event.start * 1e-3, (event.end - event.start) * 1e-3);
+    }
+
+    --capture_frames_left;
+    if (!capture_frames_left)
+    {
+        finish_profile_capture();
+    }
+}
+
+void end_profile_frame()
+{
+    u64 now = profile_time();
+
+    drained_events.clear();
+    u32 thread_count = profiled_thread_count.load(std::memory_order_acquire);
+    for (u32 i = 0; i < thread_count && i < MAX_PROFILED_THREADS; ++i)
+    {
+        if (thread_profiles[i].registered.load(std::memory_order_acquire))
+        {
+            drain_thread_profile(i);
+        }
+    }
+
+    if (capture_file)
+    {
+        write_capture_frame(now);
+    }
+
+    if (!flame_paused)
+    {
+        Array<FrameEvent> temp = shown_events;
+        shown_events = drained_events;
+        drained_events = temp;
+
+        shown_frame_start = frame_start;
+        shown_frame_end = now;
+    }
+
+    frame_start = now;
+}
+
+void start_profile_capture(u32 frame_count, const char* path)
+{
+    if (capture_file || !frame_count)
+    {
+        return;
+    }
+
+    capture_file = fopen(path, "w");
+    if (!capture_file)
+    {
+        fprintf(stderr, "Error opening profile capture %s\n", path);
+        return;
+    }
+
+    fprintf(capture_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    capture_first_event = true;
+    capture_frames_left = frame_count;
+}
+
+void draw_profiler_gui()
+{
+    ImGui::Text("Frame: %.3f ms", (shown_frame_end - shown_frame_start) * 1e-6f);
+    ImGui::Checkbox("Pause", &flame_paused);
+    if (dropped_events)
+    {
+        ImGui::Text("Dropped events: %llu", (unsigned long long) dropped_events);
+    }
+
+    static int capture_frame_count = 60;
+    ImGui::InputInt("Capture frames", &capture_frame_count);
+    if (capture_file)
+    {
+        ImGui::Text("Capturing, %u frames left", capture_frames_left);
+    }
+    else if (ImGui::Button("Capture to profile.json") && capture_frame_count > 0)
+    {
+        start_profile_capture(capture_frame_count, "profile.json");
+    }
+
+    ImGui::Separator();
+
+    // A flame graph per thread, with a row per nesting depth
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    float row_height = ImGui::GetTextLineHeightWithSpacing();
+    float width = ImGui::GetContentRegionAvail().x;
+    double frame_length = shown_frame_end > shown_frame_start ? double(shown_frame_end - shown_frame_start) : 1.0;
+
+    u32 thread_count = profiled_thread_count.load(std::memory_order_acquire);
+    for (u32 thread = 0; thread < thread_count && thread < MAX_PROFILED_THREADS; ++thread)
+    {
+        u32 row_count = 0;
+        for (const FrameEvent& frame_event : shown_events)
+        {
+            if (frame_event.thread == thread && frame_event.event.depth + 1 > row_count)
+            {
+                row_count = frame_event.event.depth + 1;
+            }
+        }
+
+        if (!row_count)
+        {
+            continue;
+        }
+
+        ImGui::Text("%s", thread_profiles[thread].name.load(std::memory_order_relaxed));
+        ImVec2 origin = ImGui::GetCursorScreenPos();
+
+        for (const FrameEvent& frame_event : shown_events)
+        {
+            const ProfileEvent& event = frame_event.event;
+            if (frame_event.thread != thread || event.end < shown_frame_start)
+            {
+                continue;
+            }
+
+            // Events that started in an earlier frame are clipped to this one
+            double start = event.start > shown_frame_start ? double(event.start - shown_frame_start) : 0.0;
+            double end = double(event.end - shown_frame_start);
+
+            float x0 = origin.x + float(start / frame_length) * width;
+            float x1 = origin.x + float(end / frame_length) * width;
+            if (x1 > origin.x + width) x1 = origin.x + width;
+            if (x1 < x0 + 1.0f) x1 = x0 + 1.0f;
+
+            ImVec2 min(x0, origin.y + event.depth * row_height);
+            ImVec2 max(x1, min.y + row_height - 1.0f);
+
+            // Color by name so that the same marker keeps its color between frames
+            float hue = u32(uintptr_t(event.name) * 2654435761u) / 4294967296.0f;
+            draw_list->AddRectFilled(min, max, ImColor::HSV(hue, 0.5f, 0.7f));
+
+            draw_list->PushClipRect(min, max, true);
+            draw_list->AddText(ImVec2(min.x + 2.0f, min.y), IM_COL32_WHITE, event.name);
+            draw_list->PopClipRect();
+
+            if (ImGui::IsMouseHoveringRect(min, max))
+            {
+                ImGui::SetTooltip("%s: %.3f ms", event.name, (event.end - event.start) * 1e-6f);
+            }
+        }
+
+        ImGui::Dummy(ImVec2(width, row_count * row_height));
+    }
+}
+
+#else
+
+void end_profile_frame()
+{
+}
+
+void start_profile_capture(u32, const char*)
+{
+}
+
+void draw_profiler_gui()
+{
+    ImGui::Text("Profiling is disabled in this build");
+}
+
+#endif
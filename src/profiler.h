@@ -0,0 +1,48 @@
+#pragma once
+
+#include "util.h"
+
+// Scoped CPU profiling markers. Each thread writes the markers it finishes to its own ring
+// buffer, which the main thread drains once a frame in end_profile_frame. The markers
+// compile to nothing unless ENABLE_PROFILER is defined (make PROFILER=0 leaves it out).
+
+#ifdef ENABLE_PROFILER
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+// name must stay valid for as long as the program runs, e.g. a string literal
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__func__)
+
+// Names the calling thread in the flame view and captures
+#define PROFILE_THREAD(name) set_profile_thread_name(name)
+
+struct ProfileScope
+{
+    const char* name;
+    u64 start;
+
+    ProfileScope(const char* name);
+    ~ProfileScope();
+};
+
+void set_profile_thread_name(const char* name);
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_FUNCTION()
+#define PROFILE_THREAD(name)
+
+#endif
+
+// Called by the main thread at the end of every frame
+void end_profile_frame();
+
+// Writes the next frame_count frames to path as Chrome trace_event JSON, which can be
+// opened in chrome://tracing or Perfetto
+void start_profile_capture(u32 frame_count, const char* path);
+
+// Draws the markers of the last frame as a flame graph per thread, and the capture controls
+void draw_profiler_gui();
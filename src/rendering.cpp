@@ -7,12 +7,39 @@
 #include "SDL2/SDL.h"
 #include "stb_image.h"
 #include "fast_obj.h"
+#include "mesh_optimize.h"
+#include "mesh_cache.h"
+#include "texture_cache.h"
+#include "shader_cache.h"
+#include "texture_loader.h"
+#include "asset_registry.h"
+#include "profiler.h"
 
 #include <cstdio> // for shader loading
 #include <cstring> // for memcpy
+#include <cstdlib> // for qsort
+#include <cmath>
+#include <cfloat> // for FLT_MAX
+#include <cstddef> // for offsetof
+#include <chrono>
+#include <thread>
 #include "imgui.h"
 
 #define MAX_TEXTURES 1024
+#define MAX_RENDER_OBJECTS 1024
+#define MAX_INSTANCES 65536
+#define MAX_DRAW_PACKETS 4096
+#define MAX_MATERIALS 1024
+#define MAX_TEXTURE_ARRAYS 64
+#define MAX_TEXTURE_ARRAY_LAYERS 256
+#define STREAM_BUFFER_SIZE (16 * 1024 * 1024)
+#define MAX_STREAM_FENCES 8
+#define OVERDRAW_QUERY_FRAMES 4
+#define MAX_GPU_SCENE_OBJECTS 65536
+#define MAX_INDIRECT_COMMANDS 4096
+
+// Must match local_size_x in shaders/cull_cs.glsl
+#define CULL_GROUP_SIZE 64
 
 using hbmath::Vec2;
 using hbmath::Vec3;
@@ -22,57 +49,514 @@ using hbmath::Mat4;
 
 struct Texture
 {
-    // Should be free'd
+    // Interned by the asset registry
     const char* path;
-    GLuint id;
+
+    // The layer of texture_arrays holding the texture. Layer 0 of PLACEHOLDER_TEXTURE_ARRAY
+    // until the texture has been loaded and uploaded.
+    u32 array;
+    u32 layer;
+
+    // Set once the last reference is released. The slot isn't reused, so that texture ids
+    // stay valid, and a load still in flight is dropped when it finishes.
+    bool released = false;
 };
 
 MAKE_ARRAY(textures, Texture, MAX_TEXTURES);
 
+// Textures are stored as layers of array textures. Textures with the same size share an
+// array when texture packing is enabled, so that materials using them can be drawn one
+// after another without binding a texture.
+struct TextureArray
+{
+    // 0 once every layer has been freed
+    GLuint id;
+    u32 width;
+    u32 height;
+    u32 level_count;
+
+    // Layers below layer_count have been handed out, and the array has storage for layer_capacity
+    u32 layer_count;
+    u32 layer_capacity;
+    u32 layers_used;
+    bool layer_used[MAX_TEXTURE_ARRAY_LAYERS];
+};
+
+MAKE_ARRAY(texture_arrays, TextureArray, MAX_TEXTURE_ARRAYS);
+
+// Holds a single grey texel in layer 0, drawn in place of textures that are still loading
+#define PLACEHOLDER_TEXTURE_ARRAY 0
+
+// Texture units 0 and 1 hold the shadow maps and the color texture
+#define CACHED_TEXTURE_UNITS 2
+
+// Never a valid value, so the next call after a reset always reaches the driver
+#define UNKNOWN_GL_STATE 0xFFFFFFFFu
+
+// The GL state last set through the wrappers below, which drop calls that wouldn't change it.
+// All of this state is only changed through them. The GUI renderer restores what it changes.
+struct GlStateCache
+{
+    GLuint program = UNKNOWN_GL_STATE;
+    GLuint vao = UNKNOWN_GL_STATE;
+    GLuint active_texture = UNKNOWN_GL_STATE;
+
+    // Array textures and samplers bound to each unit
+    GLuint textures[CACHED_TEXTURE_UNITS] = {UNKNOWN_GL_STATE, UNKNOWN_GL_STATE};
+    GLuint samplers[CACHED_TEXTURE_UNITS] = {UNKNOWN_GL_STATE, UNKNOWN_GL_STATE};
+
+    GLuint draw_framebuffer = UNKNOWN_GL_STATE;
+    GLuint read_framebuffer = UNKNOWN_GL_STATE;
+    GLint viewport[4] = {-1, -1, -1, -1};
+
+    GLuint depth_test = UNKNOWN_GL_STATE;
+    GLuint depth_func = UNKNOWN_GL_STATE;
+    GLuint depth_mask = UNKNOWN_GL_STATE;
+    GLuint color_mask = UNKNOWN_GL_STATE;
+    GLuint front_face = UNKNOWN_GL_STATE;
+};
+
+GlStateCache gl_state;
+
+// A loaded texture being uploaded a mip level at a time. The texture is swapped in once
+// every level is uploaded.
+struct TextureUpload
+{
+    u32 texture_id;
+    u32 array;
+    u32 layer;
+    CookedTexture cooked;
+    u32 next_level;
+};
+
+// Uploads in the order they finished loading, starting at texture_uploads[first_texture_upload]
+MAKE_ARRAY(texture_uploads, TextureUpload, MAX_TEXTURES);
+u32 first_texture_upload = 0;
+
+// Uploads go through this pixel buffer, which is orphaned for every level so that
+// the driver doesn't have to wait for the previous transfer. Texture arrays are also
+// copied through it when they grow.
+GLuint texture_upload_pbo;
+
+// Sampler objects are shared by every material with the same sampling settings
+struct Sampler
+{
+    bool mipmapped;
+    float max_anisotropy;
+    GLuint id;
+};
+
+MAKE_ARRAY(samplers, Sampler, 16);
+
+// 1 if anisotropic filtering isn't supported
+float max_supported_anisotropy = 1.0f;
+
+// Every uniform used by any of the shaders. The list is used to generate both the
+// ShaderUniforms struct and the table used to match reflected uniform names.
+#define SHADER_UNIFORMS(X) \
+    X(position) \
+    X(rotation) \
+    X(scale) \
+    X(camera) \
+    X(camera_pos) \
+    X(camera_dir) \
+    X(light) \
+    X(light_cascades) \
+    X(cascade_splits) \
+    X(cascade_count) \
+    X(light_pos) \
+    X(light_direction) \
+    X(intensity) \
+    X(is_directional) \
+    X(diffuse_color) \
+    X(specular_color) \
+    X(shininess) \
+    X(lit) \
+    X(textured) \
+    X(light_depth) \
+    X(color_texture) \
+    X(texture_layer) \
+    X(position_offset) \
+    X(position_scale) \
+    X(uv_offset) \
+    X(uv_scale) \
+    X(oct_normals) \
+    X(object_count) \
+    X(scene_mask) \
+    X(frustum_planes) \
+    X(lod_enabled) \
+    X(lod_orthographic) \
+    X(lod_scale) \
+    X(lod_near) \
+    X(max_pixel_error)
+
+struct Uniform
+{
+    // -1 if the program doesn't use this uniform, in which case uploads are dropped
+    GLint location = -1;
+    GLenum type = GL_NONE;
+
+    // The last value uploaded, so that uploading the same value again can be skipped.
+    // Large enough for the biggest uniform array.
+    bool cached = false;
+    u32 value[16 * MAX_SHADOW_CASCADES];
+};
+
+struct ShaderUniforms
+{
+#define DECLARE_UNIFORM(name) Uniform name;
+    SHADER_UNIFORMS(DECLARE_UNIFORM)
+#undef DECLARE_UNIFORM
+};
+
+struct ShaderProgram
+{
+    GLuint id = 0;
+    ShaderUniforms uniforms;
+};
+
+static const struct
+{
+    const char* name;
+    Uniform ShaderUniforms::* member;
+} uniform_table[] = {
+#define UNIFORM_TABLE_ENTRY(name) {#name, &ShaderUniforms::name},
+    SHADER_UNIFORMS(UNIFORM_TABLE_ENTRY)
+#undef UNIFORM_TABLE_ENTRY
+};
+
 // Shaders
-GLuint light_map_shader;
-GLuint simple_shader;
-GLuint debug_shader;
+ShaderProgram light_map_shader;
+ShaderProgram light_map_instanced_shader;
+ShaderProgram simple_shader;
+ShaderProgram simple_instanced_shader;
+ShaderProgram debug_shader;
+ShaderProgram cull_shader;
+
+// The shaders to be used in draw_* functions (except debug)
+ShaderProgram* selected_shader;
+ShaderProgram* selected_instanced_shader;
+
+// Stats for the frame being drawn and the last complete frame
+render::FrameStats frame_stats;
+render::FrameStats last_frame_stats;
+
+// Timer queries are recorded into a ring of frames, and a frame's results are read once the
+// GPU has finished all of its queries. A frame whose results still aren't ready when its
+// slot is reused is dropped rather than waited for.
+#define GPU_TIMER_FRAMES 4
+#define MAX_GPU_TIMER_QUERIES 32
+
+struct GpuTimerFrame
+{
+    GLuint queries[MAX_GPU_TIMER_QUERIES];
+    render::GpuTimer timers[MAX_GPU_TIMER_QUERIES];
+    u32 query_count;
+    bool pending;
+};
+
+GpuTimerFrame gpu_timer_frames[GPU_TIMER_FRAMES];
+
+// The frame being recorded
+u32 gpu_timer_frame = 0;
+render::GpuTimer running_gpu_timer = render::GPU_TIMER_COUNT;
+std::chrono::steady_clock::time_point running_gpu_timer_start;
 
-// The shader to be used in draw_* functions (except debug)
-GLuint selected_shader;
+static const char* gpu_timer_names[render::GPU_TIMER_COUNT] = {"Shadows", "Main", "Skybox", "Debug", "GUI"};
+
+// Weight of each new measurement in the smoothed timings
+const float gpu_timing_smoothing = 0.1f;
+render::GpuTimings gpu_timings;
 
 // Basic meshes
 render::RenderObjectIndex render::cube;
 u32 render::default_material;
 u32 render::cube_mesh;
-GLuint rect_vbo;
-GLuint rect_vao;
-GLuint line_vbo;
-GLuint line_vao;
+
+render::VertexPacking render::vertex_packing;
+render::TextureStreaming render::texture_streaming;
+render::TexturePacking render::texture_packing;
+render::LodSelection render::lod_selection;
+render::ShadowCascades render::shadow_cascades;
+render::GpuDrivenRendering render::gpu_driven_rendering;
+render::DepthPrepass render::depth_prepass;
+
+// Debug lines are accumulated over the frame and drawn by flush_debug_draws, with one draw
+// call for the lines that are depth tested and one for the lines that aren't
+struct DebugVertex
+{
+    Vec2 position;
+    Vec3 color;
+};
+
+#define MAX_DEBUG_VERTICES 65536
+
+// Indexed by whether the lines are depth tested
+DebugVertex debug_vertices_internal[2][MAX_DEBUG_VERTICES];
+Array<DebugVertex> debug_vertices[2] = {
+    Array<DebugVertex>(debug_vertices_internal[0], 0, MAX_DEBUG_VERTICES),
+    Array<DebugVertex>(debug_vertices_internal[1], 0, MAX_DEBUG_VERTICES),
+};
+
+// Streamed every frame from debug_vertices
+GLuint debug_vao;
+
+// Lines that rarely change are uploaded once to their own buffer
+struct DebugLineSet
+{
+    GLuint vbo;
+    GLuint vao;
+
+    // The lines that aren't depth tested come first
+    u32 vertex_count[2];
+};
+
+MAKE_ARRAY(debug_line_sets, DebugLineSet, 16);
+MAKE_ARRAY(queued_debug_line_sets, u32, 16);
+
+// While a line set is recorded, its lines are the ones pushed to debug_vertices after these sizes
+u32 recording_debug_line_set = INVALID_INDEX;
+size_t debug_line_set_start[2];
+
+// Per-instance data read by the instanced shaders
+struct InstanceData
+{
+    Vec3 position;
+    Vec3 scale;
+    float rotation;
+};
+
+struct InstanceSubmission
+{
+    render::RenderObjectIndex obj_index;
+    u32 lod;
+    InstanceData data;
+};
+
+// Instances submitted since the last flush. They are grouped by render object as they are
+// written to the stream buffer, starting at instance_data_offset.
+MAKE_ARRAY(submitted_instances, InstanceSubmission, MAX_INSTANCES);
+size_t instance_data_offset = 0;
+
+// Data that changes every frame is written to a ring buffer, which it is drawn from directly.
+// With ARB_buffer_storage the ring is mapped once, and fences at the end of every frame
+// keep writes from overwriting data the GPU hasn't read yet. Otherwise each allocation is
+// mapped unsynchronized and the buffer is orphaned when the ring wraps.
+GLuint stream_buffer;
+bool stream_persistent = false;
+u8* stream_mapping = nullptr;
+
+// Bytes allocated since the start, including padding, and bytes the GPU has finished reading.
+// An allocation's offset in the buffer is its position modulo STREAM_BUFFER_SIZE.
+u64 stream_head = 0;
+u64 stream_retired = 0;
+
+// Fences after the data written before them, oldest first
+struct StreamFence
+{
+    GLsync sync;
+    u64 head;
+};
+
+StreamFence stream_fences[MAX_STREAM_FENCES];
+u32 first_stream_fence = 0;
+u32 stream_fence_count = 0;
+
+struct StreamAllocation
+{
+    // Written by the caller before calling commit_stream
+    void* data;
+    u32 offset;
+};
+
+enum RenderPass
+{
+    RENDER_PASS_SHADOW,
+    RENDER_PASS_MAIN,
+};
+
+// The pass being drawn, and the view it is drawn from. The view is used to sort
+// draws front to back.
+RenderPass current_pass;
+Vec3 view_pos;
+Vec3 view_dir;
+float view_far;
+
+// The camera and image width used to pick levels of detail, and the pixel error
+// allowed in the current pass
+render::Camera lod_camera;
+int lod_image_width;
+float lod_max_pixel_error;
+
+// One draw of a mesh with a range of instances
+struct DrawPacket
+{
+    u64 sort_key;
+    u32 mesh_id;
+    u32 submesh_id;
+    u32 first_instance;
+    u32 instance_count;
+};
+
+MAKE_ARRAY(draw_queue, DrawPacket, MAX_DRAW_PACKETS);
+
+// GPU driven rendering needs compute shaders, storage buffers and multi-draw indirect
+bool gpu_driven_supported = false;
+GLint storage_buffer_alignment = 256;
+
+// Layouts of the buffers read and written by shaders/cull_cs.glsl
+struct CullObject
+{
+    Vec3 position;
+    float rotation;
+    Vec3 scale;
+    u32 obj_index;
+    u32 mask;
+    u32 padding[3];
+};
+
+static_assert(sizeof(CullObject) == 48, "CullObject must match the std430 layout");
+
+struct CullRenderObject
+{
+    // Object space bounds
+    Vec3 center;
+    u32 lod_count;
+    Vec3 extent;
+    u32 first_command;
+
+    float lod_error[MAX_LODS];
+
+    // Radius of a sphere around the object's origin that contains it, for picking LODs
+    float radius;
+    u32 submesh_count;
+    u32 padding[2];
+};
+
+static_assert(sizeof(CullRenderObject) == 64 && MAX_LODS == 4, "CullRenderObject must match the std430 layout");
+
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instance_count;
+    u32 first_index;
+    s32 base_vertex;
+    u32 base_instance;
+};
+
+// A run of commands drawn by one multi-draw, all with the same mesh and material
+struct IndirectGroup
+{
+    u64 sort_key;
+    u32 mesh_id;
+    u32 material_id;
+
+    // Masks of all the objects drawn by the commands, so that passes none of them are in
+    // can skip the group
+    u32 mask;
+    u32 first_command;
+    u32 command_count;
+};
+
+// The scene's objects, as last uploaded to cull_object_buffer
+MAKE_ARRAY(cull_objects, CullObject, MAX_GPU_SCENE_OBJECTS);
+GLuint cull_object_buffer;
+u32 cull_object_capacity = 0;
+
+// Built from the scene's render objects whenever they change. Every LOD of a submesh of a
+// render object in the scene has a command, whose instances are written by the culling
+// shader starting at its base_instance in cull_instance_buffer. The commands of a render
+// object are ordered by submesh and then LOD, so that each submesh is drawn by one group.
+bool gpu_scene_layout_dirty = true;
+CullRenderObject cull_render_objects[MAX_RENDER_OBJECTS];
+MAKE_ARRAY(gpu_scene_commands, DrawElementsIndirectCommand, MAX_INDIRECT_COMMANDS);
+MAKE_ARRAY(gpu_scene_groups, IndirectGroup, MAX_INDIRECT_COMMANDS);
+
+// The commands of the last pass as written by the culling shader, for the frame stats
+MAKE_ARRAY(gpu_scene_readback, DrawElementsIndirectCommand, MAX_INDIRECT_COMMANDS);
+GLuint cull_render_object_buffer;
+GLuint cull_instance_buffer;
+u32 cull_instance_capacity = 0;
 
 int screen_width;
 int screen_height;
 
-static GLint compile_shader(const char* filename, GLuint shader_type)
+// Samples per pixel of the screen framebuffer
+int screen_samples = 1;
+
+// The main camera's matrix, which the depth pre-pass is drawn with
+Mat4 main_camera_matrix;
+
+// Occlusion queries counting the samples that pass the depth test while the main pass is first
+// drawn. At most one is made per frame, and results are read a few frames later.
+GLuint overdraw_queries[OVERDRAW_QUERY_FRAMES];
+bool overdraw_query_pending[OVERDRAW_QUERY_FRAMES] = {};
+u32 overdraw_query_frame = 0;
+bool overdraw_query_running = false;
+bool overdraw_measured_this_frame = false;
+float measured_overdraw = 0.0f;
+
+// Set by automatic pre-pass selection
+bool depth_prepass_auto_enabled = false;
+
+// The framebuffer drawn to the screen: 0 for the window, or the offscreen target
+GLuint screen_fbo = 0;
+GLuint screen_color_rbo = 0;
+GLuint screen_depth_rbo = 0;
+
+// Whether linked programs can be saved with glGetProgramBinary and loaded on the next run
+bool program_binaries_supported = false;
+
+// Identifies the driver, which program binaries are only valid for
+u64 driver_hash = 0;
+
+// Most programs built by one load_programs call
+#define MAX_PROGRAM_LOADS 16
+
+// The shader files a program is built from
+struct ProgramSource
+{
+    ShaderProgram* program;
+    const char* paths[2];
+    GLenum types[2];
+    u32 shader_count;
+};
+
+static ProgramSource graphics_program(ShaderProgram* program, const char* vertex_path, const char* fragment_path)
+{
+    return {program, {vertex_path, fragment_path}, {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER}, 2};
+}
+
+// Compute shaders need OpenGL 4.3
+static ProgramSource compute_program(ShaderProgram* program, const char* path)
+{
+    return {program, {path, nullptr}, {GL_COMPUTE_SHADER, 0}, 1};
+}
+
+// Returns the null terminated contents of a shader file, which must be free'd, or nullptr
+static GLchar* read_shader_source(const char* filename)
 {
     FILE* shader_file = fopen(filename, "r");
     if (!shader_file)
     {
         fprintf(stderr, "Unable to open shader %s.\n", filename);
-        return 0;
+        return nullptr;
     }
     fseek(shader_file, 0, SEEK_END);
     size_t file_len = ftell(shader_file);
     GLchar* shader_text = (GLchar*) malloc(file_len + 1); // +1 for null terminator
     rewind(shader_file);
-    fread(shader_text, 1, file_len, shader_file);
+    file_len = fread(shader_text, 1, file_len, shader_file);
+    fclose(shader_file);
 
     // add null terminator
     shader_text[file_len] = 0;
 
-    GLuint shader = glCreateShader(shader_type);
-
-    glShaderSource(shader, 1, &shader_text, NULL);
-    glCompileShader(shader);
-
-    free(shader_text);
+    return shader_text;
+}
 
+static void check_shader(GLuint shader, const char* filename)
+{
     GLint log_size = 0;
     glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_size);
     if (log_size > 1)
@@ -89,634 +573,3469 @@ static GLint compile_shader(const char* filename, GLuint shader_type)
     {
         fprintf(stderr, "Shader compilation failed.\n");
     }
-
-    return shader;
 }
 
-static GLuint link_program(GLint vshader, GLint fshader)
+// Saves a linked program's binary to its cache
+static void cache_program_binary(GLuint program, const ProgramSource& source, u64 key)
 {
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vshader);
-    glAttachShader(program, fshader);
-    glLinkProgram(program);
-
-    GLint success = 0;
-    glGetProgramiv(program, GL_LINK_STATUS, &success);
-    if (success == GL_FALSE)
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
     {
-        fprintf(stderr, "Shader program linking failed.\n");
+        return;
     }
-    return program;
-}
 
-static GLuint load_shader(const char* vname, const char* fname)
-{
-    return link_program(compile_shader(vname, GL_VERTEX_SHADER),
-                        compile_shader(fname, GL_FRAGMENT_SHADER));
-}
+    void* data = malloc(length);
+    ProgramBinary binary = {};
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &binary.format, data);
 
-static void sample_screen_size(SDL_Window* window)
-{
-    SDL_GetWindowSize(window, &screen_width, &screen_height);
+    binary.data = data;
+    binary.size = written;
+    write_program_cache(source.paths, source.shader_count, key, binary);
+
+    free(data);
 }
 
-struct Vertex
+// Finds the locations of all active uniforms in the program, so they never have to
+// be looked up by name while drawing.
+static void reflect_uniforms(ShaderProgram* program)
 {
-    Vec3 position;
-    Vec3 normal;
-    Vec2 uv;
+    GLint uniform_count = 0;
+    glGetProgramiv(program->id, GL_ACTIVE_UNIFORMS, &uniform_count);
 
-    Vertex() = default;
-    Vertex(Vec3 position_, Vec3 normal_, Vec2 uv_)
-        : position(position_), normal(normal_), uv(uv_)
-    {}
-};
+    for (GLint i = 0; i < uniform_count; ++i)
+    {
+        char name[64];
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program->id, i, sizeof(name), nullptr, &size, &type, name);
+
+        // Arrays are reported by their first element, and are set as a whole
+        char* subscript = strstr(name, "[0]");
+        if (subscript)
+        {
+            *subscript = 0;
+        }
 
-static_assert(sizeof(Vertex) == 2 * sizeof(Vec3) + sizeof(Vec2), "Vertex type must be packed");
+        Uniform* uniform = nullptr;
+        for (uint j = 0; j < ARRAY_LENGTH(uniform_table); ++j)
+        {
+            if (strcmp(name, uniform_table[j].name) == 0)
+            {
+                uniform = &(program->uniforms.*uniform_table[j].member);
+                break;
+            }
+        }
 
-// Returns cube positions interleaved with normals and uv coords
-static const Array<Vertex> generate_cube_mesh()
-{
-    static Vertex cube_mesh[36];
+        if (!uniform)
+        {
+            fprintf(stderr, "Shader uniform %s is not in SHADER_UNIFORMS and will never be set.\n", name);
+            continue;
+        }
 
-    const Vertex front_face[6] = {
-        // Lower left
-        Vertex(Vec3(-0.5f,  0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.25f, 2.0f / 3.0f)),
-        Vertex(Vec3(-0.5f, -0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.25f, 1.0f / 3.0f)),
-        Vertex(Vec3( 0.5f, -0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.5f,  1.0f / 3.0f)),
+        uniform->location = glGetUniformLocation(program->id, name);
+        uniform->type = type;
+    }
+}
 
-        // Upper right
-        Vertex(Vec3( 0.5f, -0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.5f,  1.0f / 3.0f)),
-        Vertex(Vec3( 0.5f,  0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.5f,  2.0f / 3.0f)),
-        Vertex(Vec3(-0.5f,  0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.25f, 2.0f / 3.0f)),
-    };
+// Builds the programs, loading their binaries from the program cache where possible.
+// Every shader that has to be compiled is submitted before any compile or link status is
+// queried, so that drivers with KHR_parallel_shader_compile build them at the same time.
+static void load_programs(const ProgramSource* sources, u32 count)
+{
+    PROFILE_FUNCTION();
+    auto start_time = std::chrono::steady_clock::now();
 
-    const Mat3 x_rotate = Mat3::RotateX(0.5f * M_PI);
-    const Mat3 y_rotate = Mat3::RotateY(0.5f * M_PI);
+    assert(count <= MAX_PROGRAM_LOADS);
+    GLchar* texts[MAX_PROGRAM_LOADS][2] = {};
+    GLuint shaders[MAX_PROGRAM_LOADS][2] = {};
+    u64 keys[MAX_PROGRAM_LOADS];
+    bool cached[MAX_PROGRAM_LOADS] = {};
+    u32 cached_count = 0;
 
-    for (uint i = 0; i < ARRAY_LENGTH(front_face); ++i)
+    for (u32 i = 0; i < count; ++i)
     {
-        cube_mesh[i] = front_face[i];
-
-        cube_mesh[i +     ARRAY_LENGTH(front_face)] = Vertex(y_rotate * front_face[i].position,
-                                                             y_rotate * front_face[i].normal,
-                                                             Vec2(0.25f, 0.0f) + front_face[i].uv);
-
-        cube_mesh[i + 2 * ARRAY_LENGTH(front_face)] = Vertex(y_rotate * y_rotate * front_face[i].position,
-                                                             y_rotate * y_rotate * front_face[i].normal,
-                                                             Vec2(0.5f, 0.0f) + front_face[i].uv);
+        const ProgramSource& source = sources[i];
 
-        cube_mesh[i + 3 * ARRAY_LENGTH(front_face)] = Vertex(y_rotate.transpose() * front_face[i].position,
-                                                             y_rotate.transpose() * front_face[i].normal,
-                                                             Vec2(-0.25f, 0.0f) + front_face[i].uv);
+        bool sources_read = true;
+        keys[i] = driver_hash;
+        for (u32 j = 0; j < source.shader_count; ++j)
+        {
+            texts[i][j] = read_shader_source(source.paths[j]);
+            sources_read &= texts[i][j] != nullptr;
+            if (texts[i][j])
+            {
+                keys[i] = hash_data(&source.types[j], sizeof(GLenum), keys[i]);
+                keys[i] = hash_data(texts[i][j], strlen(texts[i][j]), keys[i]);
+            }
+        }
 
-        cube_mesh[i + 4 * ARRAY_LENGTH(front_face)] = Vertex(x_rotate * front_face[i].position,
-                                                             x_rotate * front_face[i].normal,
-                                                             Vec2(0.0f, -1.0f / 3.0f) + front_face[i].uv);
+        GLuint program = glCreateProgram();
+        source.program->id = program;
 
-        cube_mesh[i + 5 * ARRAY_LENGTH(front_face)] = Vertex(x_rotate.transpose() * front_face[i].position,
-                                                             x_rotate.transpose() * front_face[i].normal,
-                                                             Vec2(0.0f, 1.0f / 3.0f) + front_face[i].uv);
+        ProgramBinary binary;
+        if (program_binaries_supported && sources_read
+            && open_program_cache(source.paths, source.shader_count, keys[i], &binary))
+        {
+            glProgramBinary(program, binary.format, binary.data, binary.size);
+            close_program_cache(&binary);
+
+            // Drivers reject binaries made by other versions, which are then compiled
+            GLint success = 0;
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            cached[i] = success == GL_TRUE;
+            cached_count += cached[i];
+        }
     }
 
-    return Array<Vertex>(&cube_mesh);
-}
-
-static u32 create_mesh(Array<Vertex> vertices)
-{
-    render::Mesh mesh;
-
-    mesh.num_vertices = vertices.size;
+    for (u32 i = 0; i < count; ++i)
+    {
+        for (u32 j = 0; !cached[i] && j < sources[i].shader_count; ++j)
+        {
+            if (texts[i][j])
+            {
+                shaders[i][j] = glCreateShader(sources[i].types[j]);
+                glShaderSource(shaders[i][j], 1, &texts[i][j], NULL);
+                glCompileShader(shaders[i][j]);
+            }
+        }
+    }
 
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    for (u32 i = 0; i < count; ++i)
+    {
+        if (cached[i])
+        {
+            continue;
+        }
 
-    glBufferData(GL_ARRAY_BUFFER, vertices.size * sizeof(Vertex), vertices.data, GL_STATIC_DRAW);
+        GLuint program = sources[i].program->id;
+        for (u32 j = 0; j < sources[i].shader_count; ++j)
+        {
+            if (shaders[i][j])
+            {
+                glAttachShader(program, shaders[i][j]);
+            }
+        }
 
-    glGenVertexArrays(1, &mesh.vao);
-    glBindVertexArray(mesh.vao);
+        if (program_binaries_supported)
+        {
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        glLinkProgram(program);
+    }
 
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*)0);
+    for (u32 i = 0; i < count; ++i)
+    {
+        if (!cached[i])
+        {
+            GLuint program = sources[i].program->id;
+            for (u32 j = 0; j < sources[i].shader_count; ++j)
+            {
+                if (shaders[i][j])
+                {
+                    check_shader(shaders[i][j], sources[i].paths[j]);
+                    glDetachShader(program, shaders[i][j]);
+                    glDeleteShader(shaders[i][j]);
+                }
+            }
 
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*)sizeof(Vec3));
+            GLint success = 0;
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            if (success == GL_FALSE)
+            {
+                fprintf(stderr, "Shader program linking failed.\n");
+            }
+            else if (program_binaries_supported)
+            {
+                cache_program_binary(program, sources[i], keys[i]);
+            }
+        }
 
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*)(2 * sizeof(Vec3)));
+        for (u32 j = 0; j < sources[i].shader_count; ++j)
+        {
+            free(texts[i][j]);
+        }
 
-    u32 index = render::meshes.size;
+        reflect_uniforms(sources[i].program);
+    }
 
-    render::meshes.push(mesh);
-    return index;
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+    printf("Loaded %u shader programs, %u from cache, in %.2f ms\n", count, cached_count, elapsed.count());
 }
 
-static u32 load_material(fastObjMaterial* mat)
+// Returns true if value differs from the cached state, in which case it becomes the cached
+// state and the call has to be made
+static bool gl_state_changed(GLuint* cached, GLuint value)
 {
-    render::Material new_material;
-
-    new_material.diffuse_color = Vec3(mat->Kd);
-    new_material.specular_color = Vec3(mat->Ks);
-    new_material.shininess = mat->Ns;
-
-    if (mat->map_Kd.path)
+    if (*cached == value)
     {
-        new_material.texture_id = render::load_texture(mat->map_Kd.path);
-        new_material.textured = true;
+        ++frame_stats.gl_state_calls_skipped;
+        return false;
     }
 
-    u32 index = render::materials.size;
-    render::materials.push(new_material);
-    
-    return index;
+    *cached = value;
+    ++frame_stats.gl_state_calls;
+    return true;
 }
 
-// Public API
-
-namespace render {
-
-MAKE_ARRAY(render_objects, RenderObject, 1024);
-MAKE_ARRAY(meshes, Mesh, 1024);
-MAKE_ARRAY(materials, Material, 1024);
+static void reset_gl_state()
+{
+    gl_state = GlStateCache();
+}
 
-void Camera::set_fov(float fov)
+static void use_program(ShaderProgram* program)
 {
-    near_width = 2.0f * near * tanf(0.5f * fov);
+    if (gl_state_changed(&gl_state.program, program->id))
+    {
+        glUseProgram(program->id);
+    }
 }
 
-float Camera::get_fov() const
+static void bind_vertex_array(GLuint vao)
 {
-    return 2.0f * atanf(0.5f * near_width / near);
+    if (gl_state_changed(&gl_state.vao, vao))
+    {
+        glBindVertexArray(vao);
+    }
 }
 
-Mat4 Camera::compute_matrix(float aspect_ratio) const
+// Binds an array texture to a texture unit, which is left active so that the texture can be
+// changed. Every texture is an array texture.
+static void bind_texture(u32 unit, GLuint id)
 {
-    Mat3 rotation;
-    orientation.inverse().to_matrix(rotation.data);
+    assert(unit < CACHED_TEXTURE_UNITS);
+
+    if (gl_state_changed(&gl_state.active_texture, GL_TEXTURE0 + unit))
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    if (gl_state_changed(&gl_state.textures[unit], id))
+    {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+    }
+}
+
+static void bind_sampler(u32 unit, GLuint sampler)
+{
+    assert(unit < CACHED_TEXTURE_UNITS);
+
+    if (gl_state_changed(&gl_state.samplers[unit], sampler))
+    {
+        glBindSampler(unit, sampler);
+    }
+}
+
+// GL_FRAMEBUFFER binds both the draw and read framebuffers
+static void bind_framebuffer(GLenum target, GLuint fbo)
+{
+    bool draw = target != GL_READ_FRAMEBUFFER;
+    bool read = target != GL_DRAW_FRAMEBUFFER;
+    if ((!draw || gl_state.draw_framebuffer == fbo) && (!read || gl_state.read_framebuffer == fbo))
+    {
+        ++frame_stats.gl_state_calls_skipped;
+        return;
+    }
+
+    if (draw) gl_state.draw_framebuffer = fbo;
+    if (read) gl_state.read_framebuffer = fbo;
+    ++frame_stats.gl_state_calls;
+    glBindFramebuffer(target, fbo);
+}
+
+static void set_viewport(GLint x, GLint y, GLint width, GLint height)
+{
+    GLint viewport[4] = {x, y, width, height};
+    if (memcmp(gl_state.viewport, viewport, sizeof(viewport)) == 0)
+    {
+        ++frame_stats.gl_state_calls_skipped;
+        return;
+    }
+
+    memcpy(gl_state.viewport, viewport, sizeof(viewport));
+    ++frame_stats.gl_state_calls;
+    glViewport(x, y, width, height);
+}
+
+static void set_depth_test(bool enabled)
+{
+    if (gl_state_changed(&gl_state.depth_test, enabled))
+    {
+        if (enabled)
+        {
+            glEnable(GL_DEPTH_TEST);
+        }
+        else
+        {
+            glDisable(GL_DEPTH_TEST);
+        }
+    }
+}
+
+static void set_depth_func(GLenum func)
+{
+    if (gl_state_changed(&gl_state.depth_func, func))
+    {
+        glDepthFunc(func);
+    }
+}
+
+static void set_depth_mask(bool enabled)
+{
+    if (gl_state_changed(&gl_state.depth_mask, enabled))
+    {
+        glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+    }
+}
+
+static void set_color_mask(bool enabled)
+{
+    if (gl_state_changed(&gl_state.color_mask, enabled))
+    {
+        GLboolean mask = enabled ? GL_TRUE : GL_FALSE;
+        glColorMask(mask, mask, mask, mask);
+    }
+}
+
+static void set_front_face(GLenum mode)
+{
+    if (gl_state_changed(&gl_state.front_face, mode))
+    {
+        glFrontFace(mode);
+    }
+}
+
+// Deleting a bound object unbinds it, and its name can be reused by a new object
+static void delete_texture(GLuint* id)
+{
+    for (GLuint& texture : gl_state.textures)
+    {
+        if (texture == *id)
+        {
+            texture = 0;
+        }
+    }
+
+    glDeleteTextures(1, id);
+    *id = 0;
+}
+
+static void delete_vertex_array(GLuint* vao)
+{
+    if (gl_state.vao == *vao)
+    {
+        gl_state.vao = 0;
+    }
+
+    glDeleteVertexArrays(1, vao);
+    *vao = 0;
+}
+
+// Returns true if the value differs from what was last uploaded to this uniform,
+// in which case it is recorded as the new cached value.
+static bool uniform_changed(Uniform* uniform, const void* value, size_t size)
+{
+    assert(size <= sizeof(uniform->value));
+
+    if (uniform->location == -1)
+    {
+        return false;
+    }
+
+    if (uniform->cached && memcmp(uniform->value, value, size) == 0)
+    {
+        ++frame_stats.uniform_uploads_skipped;
+        return false;
+    }
+
+    memcpy(uniform->value, value, size);
+    uniform->cached = true;
+    ++frame_stats.uniform_uploads;
+    return true;
+}
+
+// The uniform must belong to the program that is currently in use
+static void set_uniform(Uniform* uniform, const Mat4& value)
+{
+    if (uniform_changed(uniform, value.data, sizeof(value.data)))
+    {
+        glUniformMatrix4fv(uniform->location, 1, GL_TRUE, value.data);
+    }
+}
+
+static void set_uniform(Uniform* uniform, const Mat4* values, u32 count)
+{
+    if (uniform_changed(uniform, values, count * sizeof(values->data)))
+    {
+        glUniformMatrix4fv(uniform->location, count, GL_TRUE, values->data);
+    }
+}
+
+static void set_uniform(Uniform* uniform, const Mat3& value)
+{
+    if (uniform_changed(uniform, value.data, sizeof(value.data)))
+    {
+        glUniformMatrix3fv(uniform->location, 1, GL_TRUE, value.data);
+    }
+}
+
+static void set_uniform(Uniform* uniform, Vec3 value)
+{
+    if (uniform_changed(uniform, value.array(), sizeof(value)))
+    {
+        glUniform3fv(uniform->location, 1, value.array());
+    }
+}
+
+static void set_uniform(Uniform* uniform, Vec2 value)
+{
+    if (uniform_changed(uniform, value.array(), sizeof(value)))
+    {
+        glUniform2fv(uniform->location, 1, value.array());
+    }
+}
+
+static void set_uniform(Uniform* uniform, float value)
+{
+    if (uniform_changed(uniform, &value, sizeof(value)))
+    {
+        glUniform1f(uniform->location, value);
+    }
+}
+
+static void set_uniform(Uniform* uniform, const float* values, u32 count)
+{
+    if (uniform_changed(uniform, values, count * sizeof(float)))
+    {
+        glUniform1fv(uniform->location, count, values);
+    }
+}
+
+static void set_uniform(Uniform* uniform, const hbmath::Vec4* values, u32 count)
+{
+    if (uniform_changed(uniform, values, count * sizeof(values->data)))
+    {
+        glUniform4fv(uniform->location, count, values->data);
+    }
+}
+
+// Also used for bools and samplers
+static void set_uniform(Uniform* uniform, int value)
+{
+    if (uniform_changed(uniform, &value, sizeof(value)))
+    {
+        glUniform1i(uniform->location, value);
+    }
+}
+
+static void init_stream_buffer()
+{
+    glGenBuffers(1, &stream_buffer);
+
+    // GL_COPY_WRITE_BUFFER is used so that mapping doesn't disturb other bindings
+    glBindBuffer(GL_COPY_WRITE_BUFFER, stream_buffer);
+
+    stream_persistent = GLEW_ARB_buffer_storage;
+    if (stream_persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, STREAM_BUFFER_SIZE, nullptr, flags);
+        stream_mapping = (u8*) glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, STREAM_BUFFER_SIZE, flags);
+    }
+    else
+    {
+        glBufferData(GL_COPY_WRITE_BUFFER, STREAM_BUFFER_SIZE, nullptr, GL_STREAM_DRAW);
+    }
+}
+
+// Blocks until the GPU has read the data before the oldest fence
+static void retire_stream_fence(bool wait)
+{
+    StreamFence* fence = &stream_fences[first_stream_fence];
+
+    GLuint64 timeout = wait ? 1000000000 : 0;
+    for (;;)
+    {
+        GLenum result = glClientWaitSync(fence->sync, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+        {
+            break;
+        }
+
+        if (result == GL_WAIT_FAILED)
+        {
+            fprintf(stderr, "Error waiting for stream buffer fence\n");
+            break;
+        }
+
+        if (!wait)
+        {
+            return;
+        }
+    }
+
+    glDeleteSync(fence->sync);
+    stream_retired = fence->head;
+    first_stream_fence = (first_stream_fence + 1) % MAX_STREAM_FENCES;
+    --stream_fence_count;
+}
+
+static void push_stream_fence()
+{
+    if (stream_fence_count == MAX_STREAM_FENCES)
+    {
+        retire_stream_fence(true);
+        ++frame_stats.stream_waits;
+    }
+
+    StreamFence* fence = &stream_fences[(first_stream_fence + stream_fence_count) % MAX_STREAM_FENCES];
+    fence->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    fence->head = stream_head;
+    ++stream_fence_count;
+}
+
+// Allocates size bytes of the stream buffer, aligned to a multiple of alignment bytes.
+// The data must be written and committed before anything that reads it is drawn.
+static StreamAllocation allocate_stream(u32 size, u32 alignment)
+{
+    assert(size && size <= STREAM_BUFFER_SIZE);
+
+    u32 offset = stream_head % STREAM_BUFFER_SIZE;
+    u32 aligned_offset = (offset + alignment - 1) / alignment * alignment;
+
+    bool wrapped = aligned_offset + size > STREAM_BUFFER_SIZE;
+    if (wrapped)
+    {
+        aligned_offset = 0;
+        stream_head += STREAM_BUFFER_SIZE - offset;
+    }
+    else
+    {
+        stream_head += aligned_offset - offset;
+    }
+
+    u64 start = stream_head;
+    stream_head += size;
+
+    StreamAllocation allocation;
+    allocation.offset = aligned_offset;
+    frame_stats.stream_bytes += size;
+
+    if (stream_persistent)
+    {
+        // Wait for the GPU to finish with the data being overwritten. If it was all written
+        // this frame there is no fence for it yet.
+        while (stream_head > stream_retired + STREAM_BUFFER_SIZE)
+        {
+            if (!stream_fence_count)
+            {
+                u64 head = stream_head;
+                stream_head = start;
+                push_stream_fence();
+                stream_head = head;
+            }
+
+            retire_stream_fence(true);
+            ++frame_stats.stream_waits;
+        }
+
+        allocation.data = stream_mapping + aligned_offset;
+    }
+    else
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stream_buffer);
+        if (wrapped)
+        {
+            // New storage, so that draws still reading the old data don't block
+            glBufferData(GL_COPY_WRITE_BUFFER, STREAM_BUFFER_SIZE, nullptr, GL_STREAM_DRAW);
+        }
+
+        // The ring never writes over data in use, so the mapping doesn't need to synchronize
+        allocation.data = glMapBufferRange(GL_COPY_WRITE_BUFFER, aligned_offset, size,
+                                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+
+    return allocation;
+}
+
+static void commit_stream(const StreamAllocation&)
+{
+    // Coherent persistent mappings are visible to the GPU without unmapping
+    if (!stream_persistent)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stream_buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+}
+
+// Fences the data written this frame, and frees the space of earlier frames the GPU is done with
+static void end_stream_frame()
+{
+    if (!stream_persistent)
+    {
+        return;
+    }
+
+    while (stream_fence_count)
+    {
+        u32 count = stream_fence_count;
+        retire_stream_fence(false);
+        if (stream_fence_count == count)
+        {
+            break;
+        }
+    }
+
+    push_stream_fence();
+}
+
+// Points the per-instance attributes of the bound vao at instances starting at offset in buffer
+static void set_instance_buffer(GLuint buffer, size_t offset)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const void*)(offset + offsetof(InstanceData, position)));
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const void*)(offset + offsetof(InstanceData, scale)));
+    glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (const void*)(offset + offsetof(InstanceData, rotation)));
+}
+
+static void set_instance_offset(size_t first_instance)
+{
+    set_instance_buffer(stream_buffer, instance_data_offset + first_instance * sizeof(InstanceData));
+}
+
+// Sort key layout, from the most to the least significant bits:
+// pass (4) | program (8) | texture array (6) | material (10) | mesh (16) | depth (20)
+// Sorting by program, texture array, material and mesh puts draws that share state next
+// to each other, and the depth puts draws that share all state front to back.
+static_assert(MAX_TEXTURE_ARRAYS <= 64 && MAX_MATERIALS <= 1024, "Sort key fields are too small");
+
+static u64 make_sort_key(RenderPass pass, GLuint program, u32 texture_array, u32 material_id, u32 mesh_id, float depth)
+{
+    const u32 depth_bits = 20;
+    const u32 max_depth = (1 << depth_bits) - 1;
+
+    float normalized_depth = depth / view_far;
+    if (normalized_depth < 0.0f) normalized_depth = 0.0f;
+    if (normalized_depth > 1.0f) normalized_depth = 1.0f;
+
+    return (u64(pass & 0xF) << 60)
+         | (u64(program & 0xFF) << 52)
+         | (u64(texture_array & 0x3F) << 46)
+         | (u64(material_id & 0x3FF) << 36)
+         | (u64(mesh_id & 0xFFFF) << depth_bits)
+         | u64(normalized_depth * max_depth);
+}
+
+static int compare_draw_packets(const void* lhs, const void* rhs)
+{
+    u64 lhs_key = ((const DrawPacket*)lhs)->sort_key;
+    u64 rhs_key = ((const DrawPacket*)rhs)->sort_key;
+    return (lhs_key > rhs_key) - (lhs_key < rhs_key);
+}
+
+static void sample_screen_size(SDL_Window* window)
+{
+    SDL_GetWindowSize(window, &screen_width, &screen_height);
+}
+
+struct Vertex
+{
+    Vec3 position;
+    Vec3 normal;
+    Vec2 uv;
+
+    Vertex() = default;
+    Vertex(Vec3 position_, Vec3 normal_, Vec2 uv_)
+        : position(position_), normal(normal_), uv(uv_)
+    {}
+};
+
+static_assert(sizeof(Vertex) == 2 * sizeof(Vec3) + sizeof(Vec2), "Vertex type must be packed");
+
+// Vertex format for meshes that can be quantized, half the size of Vertex.
+// Positions and uvs are normalized over the ranges stored in the Mesh.
+struct PackedVertex
+{
+    // The fourth component only pads the normal to a 4 byte boundary
+    u16 position[4];
+
+    // Octahedral encoded unit normal
+    s16 normal[2];
+
+    u16 uv[2];
+};
+
+static_assert(sizeof(PackedVertex) == 16, "PackedVertex type must be packed");
+
+// Returns cube positions interleaved with normals and uv coords
+static const Array<Vertex> generate_cube_mesh()
+{
+    static Vertex cube_mesh[36];
+
+    const Vertex front_face[6] = {
+        // Lower left
+        Vertex(Vec3(-0.5f,  0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.25f, 2.0f / 3.0f)),
+        Vertex(Vec3(-0.5f, -0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.25f, 1.0f / 3.0f)),
+        Vertex(Vec3( 0.5f, -0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.5f,  1.0f / 3.0f)),
+
+        // Upper right
+        Vertex(Vec3( 0.5f, -0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.5f,  1.0f / 3.0f)),
+        Vertex(Vec3( 0.5f,  0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.5f,  2.0f / 3.0f)),
+        Vertex(Vec3(-0.5f,  0.5f, 0.5f), Vec3(0.0f, 0.0f, 1.0f), Vec2(0.25f, 2.0f / 3.0f)),
+    };
+
+    const Mat3 x_rotate = Mat3::RotateX(0.5f * M_PI);
+    const Mat3 y_rotate = Mat3::RotateY(0.5f * M_PI);
+
+    for (uint i = 0; i < ARRAY_LENGTH(front_face); ++i)
+    {
+        cube_mesh[i] = front_face[i];
+
+        cube_mesh[i +     ARRAY_LENGTH(front_face)] = Vertex(y_rotate * front_face[i].position,
+                                                             y_rotate * front_face[i].normal,
+                                                             Vec2(0.25f, 0.0f) + front_face[i].uv);
+
+        cube_mesh[i + 2 * ARRAY_LENGTH(front_face)] = Vertex(y_rotate * y_rotate * front_face[i].position,
+                                                             y_rotate * y_rotate * front_face[i].normal,
+                                                             Vec2(0.5f, 0.0f) + front_face[i].uv);
+
+        cube_mesh[i + 3 * ARRAY_LENGTH(front_face)] = Vertex(y_rotate.transpose() * front_face[i].position,
+                                                             y_rotate.transpose() * front_face[i].normal,
+                                                             Vec2(-0.25f, 0.0f) + front_face[i].uv);
+
+        cube_mesh[i + 4 * ARRAY_LENGTH(front_face)] = Vertex(x_rotate * front_face[i].position,
+                                                             x_rotate * front_face[i].normal,
+                                                             Vec2(0.0f, -1.0f / 3.0f) + front_face[i].uv);
+
+        cube_mesh[i + 5 * ARRAY_LENGTH(front_face)] = Vertex(x_rotate.transpose() * front_face[i].position,
+                                                             x_rotate.transpose() * front_face[i].normal,
+                                                             Vec2(0.0f, 1.0f / 3.0f) + front_face[i].uv);
+    }
+
+    return Array<Vertex>(&cube_mesh);
+}
+
+static Aabb compute_bounds(Array<Vertex> vertices)
+{
+    Aabb bounds(vertices[0].position, vertices[0].position);
+    for (const Vertex& vertex : vertices)
+    {
+        bounds = bounds.merge(Aabb(vertex.position, vertex.position));
+    }
+    return bounds;
+}
+
+static float sign_not_zero(float x)
+{
+    return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Maps a unit vector onto the octahedron |x| + |y| + |z| = 1, with the lower half
+// folded over the upper half, so that it is described by x and y in [-1, 1]
+static Vec2 encode_octahedral(Vec3 n)
+{
+    float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (sum == 0.0f)
+    {
+        return Vec2(0.0f, 0.0f);
+    }
+
+    Vec2 result(n.x / sum, n.y / sum);
+    if (n.z < 0.0f)
+    {
+        result = Vec2((1.0f - fabsf(result.y)) * sign_not_zero(result.x),
+                      (1.0f - fabsf(result.x)) * sign_not_zero(result.y));
+    }
+    return result;
+}
+
+// Must match decode_octahedral in the vertex shaders
+static Vec3 decode_octahedral(Vec2 e)
+{
+    Vec3 n(e.x, e.y, 1.0f - fabsf(e.x) - fabsf(e.y));
+    if (n.z < 0.0f)
+    {
+        n.x = (1.0f - fabsf(e.y)) * sign_not_zero(e.x);
+        n.y = (1.0f - fabsf(e.x)) * sign_not_zero(e.y);
+    }
+    return n.normalize();
+}
+
+static u16 quantize_unorm16(float value, float offset, float scale)
+{
+    if (scale == 0.0f) return 0;
+    float normalized = fminf(fmaxf((value - offset) / scale, 0.0f), 1.0f);
+    return (u16) (normalized * 65535.0f + 0.5f);
+}
+
+static s16 quantize_snorm16(float value)
+{
+    float normalized = fminf(fmaxf(value, -1.0f), 1.0f);
+    return (s16) (normalized * 32767.0f + (normalized >= 0.0f ? 0.5f : -0.5f));
+}
+
+// Converts vertices to the packed format. Returns false, leaving the mesh unpacked, if
+// the packing error is above the tolerances in vertex_packing.
+static bool pack_vertices(Array<Vertex> vertices, PackedVertex* packed, render::Mesh* mesh)
+{
+    Vec3 position_min = vertices[0].position;
+    Vec3 position_max = vertices[0].position;
+    Vec2 uv_min = vertices[0].uv;
+    Vec2 uv_max = vertices[0].uv;
+
+    for (const Vertex& vertex : vertices)
+    {
+        for (u32 i = 0; i < 3; ++i)
+        {
+            position_min.array()[i] = fminf(position_min.array()[i], vertex.position.array()[i]);
+            position_max.array()[i] = fmaxf(position_max.array()[i], vertex.position.array()[i]);
+        }
+        uv_min = Vec2(fminf(uv_min.x, vertex.uv.x), fminf(uv_min.y, vertex.uv.y));
+        uv_max = Vec2(fmaxf(uv_max.x, vertex.uv.x), fmaxf(uv_max.y, vertex.uv.y));
+    }
+
+    mesh->position_offset = position_min;
+    mesh->position_scale = position_max - position_min;
+    mesh->uv_offset = uv_min;
+    mesh->uv_scale = uv_max - uv_min;
+
+    float position_error = 0.0f;
+    float normal_error = 0.0f;
+    float uv_error = 0.0f;
+
+    for (u32 v = 0; v < vertices.size; ++v)
+    {
+        const Vertex& vertex = vertices[v];
+        PackedVertex* out = packed + v;
+
+        Vec3 decoded_position;
+        for (u32 i = 0; i < 3; ++i)
+        {
+            float offset = mesh->position_offset.array()[i];
+            float scale = mesh->position_scale.array()[i];
+            out->position[i] = quantize_unorm16(vertex.position.array()[i], offset, scale);
+            decoded_position.array()[i] = offset + scale * (out->position[i] / 65535.0f);
+        }
+        out->position[3] = 0;
+        position_error = fmaxf(position_error, (decoded_position - vertex.position).magnitude());
+
+        Vec2 oct = encode_octahedral(vertex.normal);
+        out->normal[0] = quantize_snorm16(oct.x);
+        out->normal[1] = quantize_snorm16(oct.y);
+        if (vertex.normal.square_magnitude() > 0.0f)
+        {
+            Vec3 decoded_normal = decode_octahedral(Vec2(out->normal[0] / 32767.0f, out->normal[1] / 32767.0f));
+            normal_error = fmaxf(normal_error, (decoded_normal - vertex.normal.normalize()).magnitude());
+        }
+
+        out->uv[0] = quantize_unorm16(vertex.uv.x, mesh->uv_offset.x, mesh->uv_scale.x);
+        out->uv[1] = quantize_unorm16(vertex.uv.y, mesh->uv_offset.y, mesh->uv_scale.y);
+        Vec2 decoded_uv(mesh->uv_offset.x + mesh->uv_scale.x * (out->uv[0] / 65535.0f),
+                        mesh->uv_offset.y + mesh->uv_scale.y * (out->uv[1] / 65535.0f));
+        uv_error = fmaxf(uv_error, fmaxf(fabsf(decoded_uv.x - vertex.uv.x), fabsf(decoded_uv.y - vertex.uv.y)));
+    }
+
+    if (position_error > render::vertex_packing.position_tolerance
+        || normal_error > render::vertex_packing.normal_tolerance
+        || uv_error > render::vertex_packing.uv_tolerance)
+    {
+        printf("Not packing mesh, error is too large (position %g, normal %g, uv %g)\n",
+               position_error, normal_error, uv_error);
+        return false;
+    }
+
+    return true;
+}
+
+// Converts vertices and indices to the format they are uploaded in, and sets the vertex
+// and index layout of mesh. The returned vertex and index data must be free'd.
+static void build_mesh_data(Array<Vertex> vertices, Array<u32> indices, render::Mesh* mesh,
+                            void** vertex_data, u32* vertex_bytes, void** index_data, u32* index_bytes)
+{
+    mesh->num_vertices = vertices.size;
+    mesh->num_indices = indices.size;
+
+    mesh->packed = false;
+    mesh->position_offset = Vec3(0.0f, 0.0f, 0.0f);
+    mesh->position_scale = Vec3(1.0f, 1.0f, 1.0f);
+    mesh->uv_offset = Vec2(0.0f, 0.0f);
+    mesh->uv_scale = Vec2(1.0f, 1.0f);
+
+    if (render::vertex_packing.enabled)
+    {
+        PackedVertex* packed_vertices = (PackedVertex*) malloc(vertices.size * sizeof(PackedVertex));
+        mesh->packed = pack_vertices(vertices, packed_vertices, mesh);
+
+        if (mesh->packed)
+        {
+            *vertex_data = packed_vertices;
+            *vertex_bytes = vertices.size * sizeof(PackedVertex);
+        }
+        else
+        {
+            mesh->position_offset = Vec3(0.0f, 0.0f, 0.0f);
+            mesh->position_scale = Vec3(1.0f, 1.0f, 1.0f);
+            mesh->uv_offset = Vec2(0.0f, 0.0f);
+            mesh->uv_scale = Vec2(1.0f, 1.0f);
+            free(packed_vertices);
+        }
+    }
+
+    if (!mesh->packed)
+    {
+        *vertex_bytes = vertices.size * sizeof(Vertex);
+        *vertex_data = malloc(*vertex_bytes);
+        memcpy(*vertex_data, vertices.data, *vertex_bytes);
+    }
+
+    // Indices are relative to each submesh's base vertex, so they usually fit in 16 bits
+    // even when the whole mesh doesn't
+    u32 max_index = 0;
+    for (u32 index : indices)
+    {
+        if (index > max_index) max_index = index;
+    }
+
+    if (max_index <= 0xFFFF)
+    {
+        mesh->index_type = GL_UNSIGNED_SHORT;
+
+        u16* short_indices = (u16*) malloc(indices.size * sizeof(u16));
+        for (u32 i = 0; i < indices.size; ++i)
+        {
+            short_indices[i] = (u16) indices[i];
+        }
+        *index_data = short_indices;
+        *index_bytes = indices.size * sizeof(u16);
+    }
+    else
+    {
+        mesh->index_type = GL_UNSIGNED_INT;
+
+        *index_bytes = indices.size * sizeof(u32);
+        *index_data = malloc(*index_bytes);
+        memcpy(*index_data, indices.data, *index_bytes);
+    }
+}
+
+// Creates the buffers and vao of a mesh whose layout was set by build_mesh_data
+static u32 upload_mesh(render::Mesh mesh, const void* vertex_data, u32 vertex_bytes,
+                       const void* index_data, u32 index_bytes)
+{
+    glGenVertexArrays(1, &mesh.vao);
+    bind_vertex_array(mesh.vao);
+
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertex_bytes, vertex_data, GL_STATIC_DRAW);
+
+    // The element array binding is part of the vao state
+    glGenBuffers(1, &mesh.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, index_data, GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+
+    if (mesh.packed)
+    {
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex),
+                              (const void*)offsetof(PackedVertex, position));
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex),
+                              (const void*)offsetof(PackedVertex, normal));
+        glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex),
+                              (const void*)offsetof(PackedVertex, uv));
+    }
+    else
+    {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*)0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*)sizeof(Vec3));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*)(2 * sizeof(Vec3)));
+    }
+
+    // Per-instance attributes, only read by the instanced shaders
+    for (GLuint attribute = 3; attribute <= 5; ++attribute)
+    {
+        glEnableVertexAttribArray(attribute);
+        glVertexAttribDivisor(attribute, 1);
+    }
+    set_instance_offset(0);
+
+    u32 index = render::meshes.size;
+
+    render::meshes.push(mesh);
+    return index;
+}
+
+static u32 create_mesh(Array<Vertex> vertices, Array<u32> indices)
+{
+    render::Mesh mesh;
+    void* vertex_data;
+    void* index_data;
+    u32 vertex_bytes;
+    u32 index_bytes;
+
+    build_mesh_data(vertices, indices, &mesh, &vertex_data, &vertex_bytes, &index_data, &index_bytes);
+    u32 index = upload_mesh(mesh, vertex_data, vertex_bytes, index_data, index_bytes);
+
+    free(vertex_data);
+    free(index_data);
+
+    return index;
+}
+
+static CookedMaterial cook_material(fastObjMaterial* mat)
+{
+    // Cleared so that the unused part of the path is written to the cache as zeros
+    CookedMaterial cooked;
+    memset(cooked.texture_path, 0, sizeof(cooked.texture_path));
+
+    cooked.material.diffuse_color = Vec3(mat->Kd);
+    cooked.material.specular_color = Vec3(mat->Ks);
+    cooked.material.shininess = mat->Ns;
+    cooked.material.texture_id = 0;
+
+    if (mat->map_Kd.path)
+    {
+        if (strlen(mat->map_Kd.path) < MESH_CACHE_MAX_PATH)
+        {
+            strcpy(cooked.texture_path, mat->map_Kd.path);
+            cooked.material.textured = true;
+        }
+        else
+        {
+            fprintf(stderr, "Error loading material. Texture path %s is too long.\n", mat->map_Kd.path);
+        }
+    }
+
+    return cooked;
+}
+
+static u32 load_material(const CookedMaterial& cooked)
+{
+    render::Material new_material = cooked.material;
+
+    if (new_material.textured)
+    {
+        new_material.texture_id = render::load_texture(cooked.texture_path);
+    }
+
+    u32 index = render::materials.size;
+    render::materials.push(new_material);
+    
+    return index;
+}
+
+// Binds an array texture to the color texture unit
+static void bind_array_texture(GLuint id)
+{
+    bind_texture(1, id);
+}
+
+// Binds an array texture to the color texture unit for a storage, upload or readback call.
+// These act on the active unit's binding, so the unit is selected even if the cache says it is.
+static void bind_array_texture_for_upload(GLuint id)
+{
+    glActiveTexture(GL_TEXTURE1);
+    gl_state.active_texture = GL_TEXTURE1;
+    bind_texture(1, id);
+}
+
+// Creates an array texture with storage for layer_count layers of every mip level
+static GLuint create_array_texture(u32 width, u32 height, u32 level_count, u32 layer_count)
+{
+    GLuint id;
+    glGenTextures(1, &id);
+    bind_array_texture_for_upload(id);
+
+    // Sampling is set by the sampler objects, these are only used if none is bound
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+
+    for (u32 level = 0; level < level_count; ++level)
+    {
+        u32 level_width = width >> level ? width >> level : 1;
+        u32 level_height = height >> level ? height >> level : 1;
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, level_width, level_height, layer_count,
+                     0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    return id;
+}
+
+// Doubles the number of layers the array has storage for. The layers are copied to the
+// new texture through texture_upload_pbo, without a round trip through client memory.
+static void grow_texture_array(TextureArray* array)
+{
+    u32 capacity = array->layer_capacity * 2;
+    if (capacity > MAX_TEXTURE_ARRAY_LAYERS)
+    {
+        capacity = MAX_TEXTURE_ARRAY_LAYERS;
+    }
+
+    GLuint id = create_array_texture(array->width, array->height, array->level_count, capacity);
+
+    for (u32 level = 0; level < array->level_count; ++level)
+    {
+        u32 level_width = array->width >> level ? array->width >> level : 1;
+        u32 level_height = array->height >> level ? array->height >> level : 1;
+        u32 bytes = 4 * level_width * level_height * array->layer_capacity;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, texture_upload_pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_COPY);
+        bind_array_texture_for_upload(array->id);
+        glGetTexImage(GL_TEXTURE_2D_ARRAY, level, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture_upload_pbo);
+        bind_array_texture_for_upload(id);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, 0, level_width, level_height, array->layer_capacity,
+                        GL_RGBA, GL_UNSIGNED_BYTE, (const void*)0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    delete_texture(&array->id);
+    array->id = id;
+    array->layer_capacity = capacity;
+}
+
+// Returns a free layer for a texture of the given size, writing the index of its array.
+// With texture packing the layer is taken from an array of textures with the same size,
+// which grows when it is full. Returns INVALID_INDEX if a new array is needed but all
+// MAX_TEXTURE_ARRAYS are in use.
+static u32 allocate_texture_layer(u32 width, u32 height, u32 level_count, u32* array_index)
+{
+    TextureArray* array = nullptr;
+
+    if (render::texture_packing.enabled)
+    {
+        for (TextureArray& candidate : texture_arrays)
+        {
+            if (candidate.id && candidate.width == width && candidate.height == height
+                && candidate.level_count == level_count && candidate.layers_used < MAX_TEXTURE_ARRAY_LAYERS)
+            {
+                array = &candidate;
+                break;
+            }
+        }
+    }
+
+    if (!array)
+    {
+        // Reuse the slot of an array whose layers have all been freed
+        for (TextureArray& candidate : texture_arrays)
+        {
+            if (!candidate.id)
+            {
+                array = &candidate;
+                break;
+            }
+        }
+
+        if (!array)
+        {
+            if (texture_arrays.size == texture_arrays.max_size)
+            {
+                return INVALID_INDEX;
+            }
+            array = texture_arrays.push(TextureArray());
+        }
+
+        array->width = width;
+        array->height = height;
+        array->level_count = level_count;
+        array->layer_count = 0;
+        array->layer_capacity = 1;
+        array->layers_used = 0;
+        memset(array->layer_used, 0, sizeof(array->layer_used));
+        array->id = create_array_texture(width, height, level_count, array->layer_capacity);
+    }
+
+    u32 layer = 0;
+    while (layer < array->layer_count && array->layer_used[layer])
+    {
+        ++layer;
+    }
+
+    if (layer == array->layer_count)
+    {
+        if (array->layer_count == array->layer_capacity)
+        {
+            grow_texture_array(array);
+        }
+        ++array->layer_count;
+    }
+
+    array->layer_used[layer] = true;
+    ++array->layers_used;
+
+    *array_index = array - texture_arrays.data;
+    return layer;
+}
+
+// Frees a layer, and the array's texture once none of its layers are used
+static void free_texture_layer(u32 array_index, u32 layer)
+{
+    TextureArray* array = &texture_arrays[array_index];
+    assert(array->layer_used[layer]);
+
+    array->layer_used[layer] = false;
+    --array->layers_used;
+
+    if (!array->layers_used)
+    {
+        delete_texture(&array->id);
+    }
+}
+
+// Public API
+
+namespace render {
+
+MAKE_ARRAY(render_objects, RenderObject, MAX_RENDER_OBJECTS);
+MAKE_ARRAY(meshes, Mesh, 1024);
+MAKE_ARRAY(submeshes, SubMesh, 4096);
+MAKE_ARRAY(materials, Material, MAX_MATERIALS);
+
+// Occluders are the coarsest LOD that moves the surface by at most OCCLUDER_MAX_ERROR of the
+// object's size, so that they don't hide anything the full detail object wouldn't. Objects
+// whose occluder would have more than MAX_OCCLUDER_TRIANGLES triangles don't get one.
+#define OCCLUDER_MAX_ERROR 0.01f
+#define MAX_OCCLUDER_TRIANGLES 2048
+#define MAX_OCCLUDER_VERTICES 196608
+
+MAKE_ARRAY(occluder_vertices, Vec3, MAX_OCCLUDER_VERTICES);
+
+void Camera::set_fov(float fov)
+{
+    near_width = 2.0f * near * tanf(0.5f * fov);
+}
+
+float Camera::get_fov() const
+{
+    return 2.0f * atanf(0.5f * near_width / near);
+}
+
+Mat4 Camera::compute_matrix(float aspect_ratio) const
+{
+    Mat3 rotation;
+    orientation.inverse().to_matrix(rotation.data);
 
     Mat4 view = Mat4(rotation) * Mat4::Translate(-pos);
 
-    if (is_ortho)
+    if (is_ortho)
+    {
+        return Mat4::Orthographic(near, far, near_width, near_width / aspect_ratio) * view;
+    }
+    else
+    {
+        return Mat4::Perspective(near, far, get_fov(), aspect_ratio) * view;
+    }
+}
+
+float Camera::projected_size(float size, float distance, int image_width) const
+{
+    if (is_ortho)
+    {
+        return size * image_width / near_width;
+    }
+    else
+    {
+        return size * near * image_width / (distance * near_width);
+    }
+}
+
+void Camera::pixel_ray(int x, int y, int width, int height, Vec3* ray_pos, Vec3* ray_dir) const
+{
+    // The +0.5f shifts the coordinate to the centre of the pixel
+    Vec3 near_plane = Vec3(x, y, 0.0f) - 0.5f * Vec3(width, height, 0.0f) + Vec3(0.5f, 0.5f, 0.0f);
+
+    // Flip the y axis to point up
+    near_plane.y = -near_plane.y;
+
+    // Scale to the size of the near plane
+    near_plane *= near_width / width;
+
+    // Move the point onto the near_plane
+    near_plane.z = -near;
+
+    // Apply camera_view rotation
+    near_plane = orientation.apply_rotation(near_plane);
+
+    if (is_ortho)
+    {
+        *ray_dir = orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f));
+        *ray_pos = pos + near_plane;
+    }
+    else
+    {
+        *ray_dir = near_plane;
+        *ray_pos = pos;
+    }
+}
+
+void Camera::draw_gui()
+{
+    ImGui::InputFloat3("Position", pos.array());
+
+    ImGui::InputFloat("Near", &near);
+    ImGui::InputFloat("Far", &far);
+
+    ImGui::Checkbox("Orthographic?", &is_ortho);
+
+    if (is_ortho)
+    {
+        ImGui::InputFloat("Near plane width", &near_width);
+    }
+    else
+    {
+        float fov = get_fov();
+        ImGui::SliderFloat("FOV", &fov, 0.0f, 3.0f);
+        set_fov(fov);
+    }
+}
+
+void FrameStats::draw_gui() const
+{
+    ImGui::Text("Draw calls: %u", draw_calls);
+    if (instances_counted)
+    {
+        ImGui::Text("Instances: %u", instances);
+        ImGui::Text("Triangles: %u", triangles);
+    }
+    else
+    {
+        ImGui::Text("Instances: %u, without GPU-driven draws", instances);
+        ImGui::Text("Triangles: %u, without GPU-driven draws", triangles);
+    }
+    ImGui::Text("Static shadow redraws: %u", static_shadow_draws);
+    ImGui::Text("State changes: %u", state_changes);
+    ImGui::Text("State changes eliminated: %u", state_changes_eliminated);
+    ImGui::Text("Uniform uploads: %u", uniform_uploads);
+    ImGui::Text("Uniform uploads skipped: %u", uniform_uploads_skipped);
+    ImGui::Text("Texture binds: %u", texture_binds);
+    ImGui::Text("Texture binds skipped: %u", texture_binds_skipped);
+    ImGui::Text("Texture upload: %u KiB", texture_upload_bytes / 1024);
+    ImGui::Text("Textures loading: %u", textures_pending);
+    ImGui::Text("Streamed: %u KiB", stream_bytes / 1024);
+    ImGui::Text("Stream buffer waits: %u", stream_waits);
+    ImGui::Text("Indirect commands: %u", indirect_commands);
+    ImGui::Text("GL state calls: %u", gl_state_calls);
+    ImGui::Text("GL state calls skipped: %u", gl_state_calls_skipped);
+    ImGui::Text("Depth pre-pass draws: %u", depth_prepass_draws);
+    ImGui::Text("Overdraw: %.2f", overdraw);
+
+    for (u32 timer = 0; timer < GPU_TIMER_COUNT; ++timer)
+    {
+        ImGui::Text("%s CPU time: %.3f ms", gpu_timer_names[timer], cpu_milliseconds[timer]);
+    }
+}
+
+void GpuTimings::draw_gui() const
+{
+    float total = 0.0f;
+    for (u32 timer = 0; timer < GPU_TIMER_COUNT; ++timer)
+    {
+        char overlay[32];
+        snprintf(overlay, sizeof(overlay), "%.3f ms", smoothed[timer]);
+        ImGui::PlotLines(gpu_timer_names[timer], history[timer], GPU_TIMING_HISTORY, history_start,
+                         overlay, 0.0f, FLT_MAX, ImVec2(0.0f, 40.0f));
+        total += smoothed[timer];
+    }
+
+    ImGui::Text("Total: %.3f ms", total);
+}
+
+LightSource make_light_source(int side, u32 cascade_count)
+{
+    LightSource light;
+
+    glGenFramebuffers(1, &light.fbo);
+    glGenFramebuffers(1, &light.static_fbo);
+    light.texture = 0;
+    light.static_texture = 0;
+    light.resize(side, cascade_count);
+
+    return light;
+}
+
+// Creates a depth array texture with a layer per cascade, and attaches its first layer to fbo
+static GLuint create_shadow_texture(GLuint fbo, int side, u32 cascade_count)
+{
+    // Shadow maps are bound to unit 0, unit 1 holds the bound color texture
+    GLuint texture;
+    glGenTextures(1, &texture);
+    bind_texture(0, texture);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F, side, side, cascade_count);
+
+    bind_framebuffer(GL_FRAMEBUFFER, fbo);
+
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, 0);
+
+    // Tell OpenGL that the framebuffer does not have a color component
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    assert(GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER));
+
+    bind_framebuffer(GL_FRAMEBUFFER, screen_fbo);
+
+    return texture;
+}
+
+void LightSource::resize(int new_side, u32 new_cascade_count)
+{
+    assert(new_cascade_count >= 1 && new_cascade_count <= MAX_SHADOW_CASCADES);
+
+    side = new_side;
+    cascade_count = new_cascade_count;
+
+    delete_texture(&texture);
+    delete_texture(&static_texture);
+    texture = create_shadow_texture(fbo, side, cascade_count);
+    static_texture = create_shadow_texture(static_fbo, side, cascade_count);
+
+    invalidate_static_shadows(this);
+}
+
+void LightSource::draw_gui()
+{
+    ImGui::InputFloat("Aspect ratio", &aspect_ratio);
+    ImGui::InputFloat("Intensity", &intensity);
+    camera.draw_gui();
+
+    int new_side = side;
+    int new_cascade_count = cascade_count;
+    ImGui::InputInt("Shadow map size", &new_side, 256);
+    ImGui::SliderInt("Cascades", &new_cascade_count, 1, MAX_SHADOW_CASCADES);
+    if (new_side >= 64 && (new_side != side || (u32) new_cascade_count != cascade_count))
+    {
+        resize(new_side, new_cascade_count);
+    }
+
+    ImGui::InputFloat("Shadow distance", &shadow_cascades.max_distance);
+    ImGui::SliderFloat("Logarithmic splits", &shadow_cascades.log_weight, 0.0f, 1.0f);
+    ImGui::InputFloat("Caster distance", &shadow_cascades.caster_distance);
+    ImGui::Checkbox("Cache static shadows", &shadow_cascades.cache_static);
+    if (shadow_cascades.cache_static)
+    {
+        ImGui::SliderFloat("Cascade snapping", &shadow_cascades.snap_fraction, 0.0f, 0.5f);
+    }
+
+    for (u32 i = 0; i < active_cascades; ++i)
+    {
+        ImGui::Text("Cascade %u: to %.2f, %.2f wide", i, cascade_splits[i], cascade_cameras[i].near_width);
+    }
+}
+
+void fit_shadow_cascades(LightSource* light, const Camera& camera, float aspect_ratio)
+{
+    if (!light->camera.is_ortho)
+    {
+        light->active_cascades = 1;
+        light->cascade_cameras[0] = light->camera;
+        light->cascade_matrices[0] = light->camera.compute_matrix(light->aspect_ratio);
+        light->cascade_splits[0] = camera.far;
+        return;
+    }
+
+    float near = camera.near;
+    float far = fminf(camera.far, shadow_cascades.max_distance);
+
+    Vec3 view_dir = camera.orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f));
+    hbmath::Quaternion to_light = light->camera.orientation.inverse();
+
+    // Distance from the view axis to a corner of the view frustum, per unit of distance
+    // along the axis for perspective cameras, or constant for orthographic ones
+    float diagonal = 0.5f * camera.near_width * sqrtf(1.0f + 1.0f / (aspect_ratio * aspect_ratio));
+    if (!camera.is_ortho)
+    {
+        diagonal /= camera.near;
+    }
+
+    light->active_cascades = light->cascade_count;
+
+    float split_near = near;
+    for (u32 i = 0; i < light->cascade_count; ++i)
+    {
+        float t = float(i + 1) / light->cascade_count;
+        float split_far = shadow_cascades.log_weight * near * powf(far / near, t)
+                        + (1.0f - shadow_cascades.log_weight) * (near + (far - near) * t);
+
+        // Smallest sphere containing the slice. It only depends on the split distances, so
+        // the cascade keeps its size while the camera turns and its texels don't change size.
+        float center_distance;
+        float radius;
+        if (camera.is_ortho)
+        {
+            center_distance = 0.5f * (split_near + split_far);
+            radius = sqrtf(0.25f * (split_far - split_near) * (split_far - split_near) + diagonal * diagonal);
+        }
+        else
+        {
+            center_distance = 0.5f * (split_near + split_far) * (1.0f + diagonal * diagonal);
+            if (center_distance > split_far)
+            {
+                center_distance = split_far;
+            }
+            float far_radius = split_far * diagonal;
+            radius = sqrtf((split_far - center_distance) * (split_far - center_distance) + far_radius * far_radius);
+        }
+
+        // Round the radius up so that rounding errors can't change it from frame to frame
+        radius = ceilf(radius * 16.0f) / 16.0f;
+
+        // Snap the center to shadow map texels in light space, so that the texels stay in
+        // place as the camera moves and shadow edges don't shimmer. With static caching the
+        // center snaps to a coarser grid, and the cascade is widened by a grid cell on
+        // each side to still contain the sphere. The depth snaps to the same grid so that the
+        // matrix doesn't change at all within a cell, and the depth range grows by a cell.
+        float margin = shadow_cascades.cache_static ? shadow_cascades.snap_fraction * 2.0f * radius : 0.0f;
+        float width = 2.0f * (radius + margin);
+        float texel_size = width / light->side;
+        float snap = fmaxf(ceilf(margin / texel_size), 1.0f) * texel_size;
+
+        Vec3 center = to_light.apply_rotation(camera.pos + center_distance * view_dir);
+        center.x = floorf(center.x / snap) * snap;
+        center.y = floorf(center.y / snap) * snap;
+        center.z = floorf(center.z / snap) * snap;
+
+        Camera* cascade = &light->cascade_cameras[i];
+        cascade->is_ortho = true;
+        cascade->orientation = light->camera.orientation;
+        cascade->near_width = width;
+        cascade->near = 0.0f;
+        cascade->far = 2.0f * radius + snap + shadow_cascades.caster_distance;
+        cascade->pos = light->camera.orientation.apply_rotation(
+            center + Vec3(0.0f, 0.0f, radius + snap + shadow_cascades.caster_distance));
+
+        light->cascade_matrices[i] = cascade->compute_matrix(1.0f);
+        light->cascade_splits[i] = split_far;
+
+        split_near = split_far;
+    }
+}
+
+// Sets the shadow shaders and the view for drawing casters into a cascade
+static void prepare_shadow_pass(const LightSource& light, u32 cascade)
+{
+    const Camera& cascade_camera = light.cascade_cameras[cascade];
+    Mat4 light_matrix = light.cascade_matrices[cascade];
+
+    selected_instanced_shader = &light_map_instanced_shader;
+    use_program(selected_instanced_shader);
+    set_uniform(&selected_instanced_shader->uniforms.light, light_matrix);
+
+    selected_shader = &light_map_shader;
+    use_program(selected_shader);
+    set_uniform(&selected_shader->uniforms.light, light_matrix);
+
+    current_pass = RENDER_PASS_SHADOW;
+    view_pos = cascade_camera.pos;
+    view_dir = cascade_camera.orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f));
+    view_far = cascade_camera.far;
+
+    lod_camera = cascade_camera;
+    lod_image_width = light.side;
+    lod_max_pixel_error = lod_selection.max_pixel_error * lod_selection.shadow_bias;
+}
+
+void invalidate_static_shadows(LightSource* light)
+{
+    for (bool& valid : light->static_valid)
+    {
+        valid = false;
+    }
+}
+
+bool prepare_static_lightmap_draw(LightSource* light, u32 cascade)
+{
+    assert(cascade < light->active_cascades);
+
+    if (!shadow_cascades.cache_static)
+    {
+        return false;
+    }
+
+    // Moving the light or the cascade changes its matrix
+    const Mat4& matrix = light->cascade_matrices[cascade];
+    if (light->static_valid[cascade] && memcmp(&light->static_matrices[cascade], &matrix, sizeof(Mat4)) == 0)
+    {
+        return false;
+    }
+
+    light->static_valid[cascade] = true;
+    light->static_matrices[cascade] = matrix;
+    ++frame_stats.static_shadow_draws;
+
+    set_viewport(0, 0, light->side, light->side);
+    bind_framebuffer(GL_FRAMEBUFFER, light->static_fbo);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, light->static_texture, 0, cascade);
+
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    prepare_shadow_pass(*light, cascade);
+    return true;
+}
+
+void prepare_lightmap_draw(LightSource light, u32 cascade)
+{
+    assert(cascade < light.active_cascades);
+
+    set_viewport(0, 0, light.side, light.side);
+    bind_framebuffer(GL_FRAMEBUFFER, light.fbo);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, light.texture, 0, cascade);
+
+    if (shadow_cascades.cache_static)
+    {
+        assert(light.static_valid[cascade]);
+
+        bind_framebuffer(GL_READ_FRAMEBUFFER, light.static_fbo);
+        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, light.static_texture, 0, cascade);
+        glBlitFramebuffer(0, 0, light.side, light.side, 0, 0, light.side, light.side,
+                          GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        bind_framebuffer(GL_READ_FRAMEBUFFER, light.fbo);
+    }
+    else
+    {
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    prepare_shadow_pass(light, cascade);
+}
+
+// Points the bound vao at debug vertices starting at offset in the buffer
+static void set_debug_vertex_buffer(GLuint vbo, size_t offset)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (const void*)(offset + offsetof(DebugVertex, position)));
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (const void*)(offset + offsetof(DebugVertex, color)));
+}
+
+static GLuint create_debug_vao(GLuint vbo)
+{
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    bind_vertex_array(vao);
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    set_debug_vertex_buffer(vbo, 0);
+
+    return vao;
+}
+
+static void init_renderer();
+
+void init_rendering(SDL_Window* window)
+{
+    sample_screen_size(window);
+    init_renderer();
+}
+
+void init_offscreen_rendering(int width, int height)
+{
+    screen_width = width;
+    screen_height = height;
+
+    glGenRenderbuffers(1, &screen_color_rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, screen_color_rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &screen_depth_rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, screen_depth_rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &screen_fbo);
+    bind_framebuffer(GL_FRAMEBUFFER, screen_fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, screen_color_rbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, screen_depth_rbo);
+
+    assert(GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_FRAMEBUFFER));
+
+    init_renderer();
+}
+
+void read_screen_pixels(u8* pixels)
+{
+    bind_framebuffer(GL_READ_FRAMEBUFFER, screen_fbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, screen_width, screen_height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
+
+// Setup shared by windowed and offscreen rendering, once the screen size is known
+static void init_renderer()
+{
+    glEnable(GL_MULTISAMPLE);
+    set_depth_test(true);
+
+    if (GLEW_EXT_texture_filter_anisotropic || GLEW_ARB_texture_filter_anisotropic)
+    {
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_supported_anisotropy);
+    }
+
+    // Texture streaming
+    {
+        glGenBuffers(1, &texture_upload_pbo);
+
+        const u8 grey[4] = {128, 128, 128, 255};
+        u32 placeholder_array;
+        u32 placeholder_layer = allocate_texture_layer(1, 1, 1, &placeholder_array);
+        assert(placeholder_array == PLACEHOLDER_TEXTURE_ARRAY && placeholder_layer == 0);
+
+        bind_array_texture_for_upload(texture_arrays[PLACEHOLDER_TEXTURE_ARRAY].id);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+
+        // Leave a core for the main thread
+        u32 thread_count = std::thread::hardware_concurrency();
+        start_texture_loader(thread_count > 2 ? thread_count - 1 : 1);
+    }
+
+    for (GpuTimerFrame& frame : gpu_timer_frames)
+    {
+        glGenQueries(MAX_GPU_TIMER_QUERIES, frame.queries);
+    }
+
+    glGenQueries(OVERDRAW_QUERY_FRAMES, overdraw_queries);
+    glGetIntegerv(GL_SAMPLES, &screen_samples);
+    if (screen_samples < 1)
+    {
+        screen_samples = 1;
+    }
+
+    // Instances and debug lines are drawn from the stream buffer, which always has storage
+    // so that the instance attributes of every vao point at something valid
+    init_stream_buffer();
+    debug_vao = create_debug_vao(stream_buffer);
+
+    // Load default meshes, materials and objects
+    {
+        Array<Vertex> cube_vertices = generate_cube_mesh();
+
+        static u32 cube_index_data[36];
+        Array<u32> cube_indices(&cube_index_data);
+        for (u32 i = 0; i < cube_indices.size; ++i)
+        {
+            cube_indices[i] = i;
+        }
+
+        cube_mesh = create_mesh(cube_vertices, cube_indices);
+        default_material = materials.size;
+        materials.push(Material());
+
+        SubMesh cube_submesh;
+        cube_submesh.first_index = 0;
+        cube_submesh.index_count = cube_indices.size;
+        cube_submesh.base_vertex = 0;
+        cube_submesh.material_id = default_material;
+
+        RenderObject cube_object;
+        cube_object.mesh_id = cube_mesh;
+        cube_object.first_submesh = submeshes.size;
+        cube_object.submesh_count = 1;
+        cube_object.bounds = compute_bounds(cube_vertices);
+
+        // The cube's vertices are already triangles, and it is its own occluder
+        cube_object.first_occluder_vertex = occluder_vertices.size;
+        cube_object.occluder_vertex_count = cube_vertices.size;
+        for (const Vertex& vertex : cube_vertices)
+        {
+            occluder_vertices.push(vertex.position);
+        }
+
+        submeshes.push(cube_submesh);
+
+        cube = render_objects.size;
+        render_objects.push(cube_object);
+    }
+
+    // Multi-draw indirect commands also offset the instance attributes by their base_instance since 4.2
+    gpu_driven_supported = GLEW_VERSION_4_3;
+    if (gpu_driven_supported)
+    {
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_buffer_alignment);
+        glGenBuffers(1, &cull_object_buffer);
+        glGenBuffers(1, &cull_render_object_buffer);
+        glGenBuffers(1, &cull_instance_buffer);
+    }
+
+    GLint binary_formats = 0;
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+    {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binary_formats);
+    }
+    program_binaries_supported = binary_formats > 0;
+
+    const char* driver_strings[] = {
+        (const char*) glGetString(GL_VENDOR),
+        (const char*) glGetString(GL_RENDERER),
+        (const char*) glGetString(GL_VERSION),
+    };
+    u32 cache_version = PROGRAM_CACHE_VERSION;
+    driver_hash = hash_data(&cache_version, sizeof(cache_version));
+    for (const char* driver_string : driver_strings)
+    {
+        driver_hash = hash_data(driver_string, strlen(driver_string) + 1, driver_hash);
+    }
+
+    // Let the driver use as many compiler threads as it likes
+    if (GLEW_KHR_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    }
+    else if (GLEW_ARB_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    }
+
+    ProgramSource program_sources[] = {
+        graphics_program(&debug_shader, "shaders/debug_vs.glsl", "shaders/debug_fs.glsl"),
+        graphics_program(&simple_shader, "shaders/simple_vs.glsl", "shaders/simple_fs.glsl"),
+        graphics_program(&simple_instanced_shader, "shaders/simple_instanced_vs.glsl", "shaders/simple_fs.glsl"),
+        graphics_program(&light_map_shader, "shaders/shadow_vs.glsl", "shaders/shadow_fs.glsl"),
+        graphics_program(&light_map_instanced_shader, "shaders/shadow_instanced_vs.glsl", "shaders/shadow_fs.glsl"),
+        compute_program(&cull_shader, "shaders/cull_cs.glsl"),
+    };
+
+    // The compute program is last, and only built if it can be used
+    u32 program_count = ARRAY_LENGTH(program_sources) - (gpu_driven_supported ? 0 : 1);
+    load_programs(program_sources, program_count);
+}
+
+void prepare_final_draw(Camera camera, LightSource light)
+{
+    set_viewport(0, 0, screen_width, screen_height);
+    bind_framebuffer(GL_FRAMEBUFFER, screen_fbo);
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    Mat4 camera_matrix = camera.compute_matrix(get_aspect_ratio());
+    main_camera_matrix = camera_matrix;
+    Vec3 camera_dir = camera.orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f));
+    Vec3 light_direction = light.camera.orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f));
+
+    selected_instanced_shader = &simple_instanced_shader;
+    selected_shader = &simple_shader;
+
+    ShaderProgram* programs[] = {selected_instanced_shader, selected_shader};
+    for (ShaderProgram* program : programs)
+    {
+        use_program(program);
+
+        ShaderUniforms* uniforms = &program->uniforms;
+        set_uniform(&uniforms->camera, camera_matrix);
+        set_uniform(&uniforms->camera_pos, camera.pos);
+        set_uniform(&uniforms->light_pos, light.camera.pos);
+        set_uniform(&uniforms->camera_dir, camera_dir);
+        set_uniform(&uniforms->light_cascades, light.cascade_matrices, light.active_cascades);
+        set_uniform(&uniforms->cascade_splits, light.cascade_splits, light.active_cascades);
+        set_uniform(&uniforms->cascade_count, (int) light.active_cascades);
+        set_uniform(&uniforms->light_direction, light_direction);
+        set_uniform(&uniforms->intensity, light.intensity);
+        set_uniform(&uniforms->is_directional, light.camera.is_ortho);
+    }
+
+    current_pass = RENDER_PASS_MAIN;
+    view_pos = camera.pos;
+    view_dir = camera_dir;
+    view_far = camera.far;
+
+    lod_camera = camera;
+    lod_image_width = screen_width;
+    lod_max_pixel_error = lod_selection.max_pixel_error;
+
+    bind_texture(0, light.texture);
+}
+
+// Draws a submesh of mesh, whose vao must be bound. Instance attributes must already
+// point at the first instance.
+static void draw_submesh(const Mesh& mesh, SubMesh submesh, u32 instance_count)
+{
+    size_t index_size = mesh.index_type == GL_UNSIGNED_SHORT ? sizeof(u16) : sizeof(u32);
+    const void* first_index = (const void*)(submesh.first_index * index_size);
+
+    if (instance_count == 1)
+    {
+        glDrawElementsBaseVertex(GL_TRIANGLES, submesh.index_count, mesh.index_type,
+                                 first_index, submesh.base_vertex);
+    }
+    else
+    {
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, submesh.index_count, mesh.index_type,
+                                          first_index, instance_count, submesh.base_vertex);
+    }
+    frame_stats.triangles += submesh.index_count / 3 * instance_count;
+    ++frame_stats.draw_calls;
+}
+
+static GLuint get_sampler(bool mipmapped, float max_anisotropy)
+{
+    max_anisotropy = fminf(fmaxf(max_anisotropy, 1.0f), max_supported_anisotropy);
+
+    for (const Sampler& sampler : samplers)
+    {
+        if (sampler.mipmapped == mipmapped && sampler.max_anisotropy == max_anisotropy)
+        {
+            return sampler.id;
+        }
+    }
+
+    Sampler sampler;
+    sampler.mipmapped = mipmapped;
+    sampler.max_anisotropy = max_anisotropy;
+
+    glGenSamplers(1, &sampler.id);
+    glSamplerParameteri(sampler.id, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glSamplerParameteri(sampler.id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glSamplerParameteri(sampler.id, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glSamplerParameteri(sampler.id, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    if (max_supported_anisotropy > 1.0f)
+    {
+        glSamplerParameterf(sampler.id, GL_TEXTURE_MAX_ANISOTROPY_EXT, max_anisotropy);
+    }
+
+    samplers.push(sampler);
+    return sampler.id;
+}
+
+// Binds the array holding texture for drawing, counting the binds that weren't skipped
+static void bind_color_texture(const Texture& texture, GLuint sampler)
+{
+    GLuint id = texture_arrays[texture.array].id;
+    if (id != gl_state.textures[1])
+    {
+        ++frame_stats.texture_binds;
+    }
+    else
+    {
+        ++frame_stats.texture_binds_skipped;
+    }
+
+    bind_array_texture(id);
+    bind_sampler(1, sampler);
+}
+
+// Binds the mesh's vao and sets the uniforms that decode its vertex format
+static void bind_mesh(ShaderProgram* program, const Mesh& mesh)
+{
+    bind_vertex_array(mesh.vao);
+
+    ShaderUniforms* uniforms = &program->uniforms;
+    set_uniform(&uniforms->position_offset, mesh.position_offset);
+    set_uniform(&uniforms->position_scale, mesh.position_scale);
+    set_uniform(&uniforms->uv_offset, mesh.uv_offset);
+    set_uniform(&uniforms->uv_scale, mesh.uv_scale);
+    set_uniform(&uniforms->oct_normals, mesh.packed);
+}
+
+// Sets the material uniforms of the program in use and binds the material's texture
+static void set_material(ShaderProgram* program, const Material& mat)
+{
+    ShaderUniforms* uniforms = &program->uniforms;
+    set_uniform(&uniforms->diffuse_color, mat.diffuse_color);
+    set_uniform(&uniforms->specular_color, mat.specular_color);
+    set_uniform(&uniforms->shininess, mat.shininess);
+    set_uniform(&uniforms->lit, mat.lit);
+    set_uniform(&uniforms->textured, mat.textured);
+
+    // TODO: This has to be changed to allow multiple (shadowed) light sources
+    set_uniform(&uniforms->light_depth, 0);
+    set_uniform(&uniforms->color_texture, 1);
+
+    if (mat.textured)
+    {
+        bind_color_texture(textures[mat.texture_id], get_sampler(mat.mipmapped, mat.max_anisotropy));
+        set_uniform(&uniforms->texture_layer, (int) textures[mat.texture_id].layer);
+    }
+}
+
+void draw_box(Transform3d box)
+{
+    draw_object(box, cube);
+}
+
+void draw_skybox(u32 texture_id, Vec3 camera_pos)
+{
+    RenderObject obj = render_objects[cube];
+    SubMesh submesh = submeshes[obj.first_submesh];
+
+    bind_mesh(selected_shader, meshes[obj.mesh_id]);
+
+    Mat3 rotation;
+    Vec3 scale(1.0f, 1.0f, 1.0f);
+
+    ShaderUniforms* uniforms = &selected_shader->uniforms;
+    set_uniform(&uniforms->rotation, rotation);
+    set_uniform(&uniforms->scale, scale);
+    set_uniform(&uniforms->position, camera_pos);
+    set_uniform(&uniforms->lit, false);
+    set_uniform(&uniforms->textured, true);
+    set_uniform(&uniforms->color_texture, 1);
+
+    bind_color_texture(textures[texture_id], get_sampler(true, 1.0f));
+    set_uniform(&uniforms->texture_layer, (int) textures[texture_id].layer);
+
+    set_depth_mask(false);
+    set_front_face(GL_CW);
+    draw_submesh(meshes[obj.mesh_id], submesh, 1);
+    set_front_face(GL_CCW);
+    set_depth_mask(true);
+}
+
+// Returns the coarsest LOD of the object whose error is small enough on screen
+static u32 select_lod(const RenderObject& obj, Transform3d transform)
+{
+    if (!lod_selection.enabled)
+    {
+        return 0;
+    }
+
+    float scale = fmaxf(fabsf(transform.scale.x), fmaxf(fabsf(transform.scale.y), fabsf(transform.scale.z)));
+
+    // Measure to the nearest point of a sphere around the object's origin that contains
+    // the object, so that the error is never underestimated
+    Vec3 extent(fmaxf(fabsf(obj.bounds.min.x), fabsf(obj.bounds.max.x)),
+                fmaxf(fabsf(obj.bounds.min.y), fabsf(obj.bounds.max.y)),
+                fmaxf(fabsf(obj.bounds.min.z), fabsf(obj.bounds.max.z)));
+    float distance = (transform.pos - view_pos).magnitude() - scale * extent.magnitude();
+    distance = fmaxf(distance, lod_camera.near);
+
+    for (u32 lod = obj.lod_count - 1; lod > 0; --lod)
+    {
+        if (lod_camera.projected_size(scale * obj.lod_error[lod], distance, lod_image_width) <= lod_max_pixel_error)
+        {
+            return lod;
+        }
+    }
+    return 0;
+}
+
+void draw_object(Transform3d transform, RenderObjectIndex obj_index)
+{
+    RenderObject obj = render_objects[obj_index];
+    u32 first_submesh = obj.first_submesh + select_lod(obj, transform) * obj.submesh_count;
+
+    Mat3 rotation = Mat3::RotateZ(transform.rotation);
+
+    bind_mesh(selected_shader, meshes[obj.mesh_id]);
+
+    ShaderUniforms* uniforms = &selected_shader->uniforms;
+    set_uniform(&uniforms->rotation, rotation);
+    set_uniform(&uniforms->scale, transform.scale);
+    set_uniform(&uniforms->position, transform.pos);
+
+    for (u32 i = first_submesh; i < first_submesh + obj.submesh_count; ++i)
+    {
+        set_material(selected_shader, materials[submeshes[i].material_id]);
+        draw_submesh(meshes[obj.mesh_id], submeshes[i], 1);
+    }
+}
+
+void draw_object_instanced(Transform3d transform, RenderObjectIndex obj_index)
+{
+    InstanceSubmission submission;
+    submission.obj_index = obj_index;
+    submission.lod = select_lod(render_objects[obj_index], transform);
+    submission.data.position = transform.pos;
+    submission.data.scale = transform.scale;
+    submission.data.rotation = transform.rotation;
+
+    submitted_instances.push(submission);
+}
+
+static bool depth_prepass_active()
+{
+    return current_pass == RENDER_PASS_MAIN &&
+           (depth_prepass.enabled || (depth_prepass.automatic && depth_prepass_auto_enabled));
+}
+
+// Counts the samples drawn by the first draws of the main pass in a frame that write depth
+static void begin_overdraw_query()
+{
+    if (current_pass != RENDER_PASS_MAIN || overdraw_measured_this_frame)
+    {
+        return;
+    }
+
+    glBeginQuery(GL_SAMPLES_PASSED, overdraw_queries[overdraw_query_frame]);
+    overdraw_query_running = true;
+    overdraw_measured_this_frame = true;
+}
+
+static void end_overdraw_query()
+{
+    if (overdraw_query_running)
+    {
+        glEndQuery(GL_SAMPLES_PASSED);
+        overdraw_query_running = false;
+        overdraw_query_pending[overdraw_query_frame] = true;
+    }
+}
+
+// The pre-pass is drawn with the position only shadow shader from the main camera. Both
+// instanced vertex shaders compute gl_Position the same way and declare it invariant, so
+// the main pass hits the same depths exactly.
+static void begin_depth_prepass()
+{
+    use_program(&light_map_instanced_shader);
+    set_uniform(&light_map_instanced_shader.uniforms.light, main_camera_matrix);
+    set_color_mask(false);
+    begin_overdraw_query();
+}
+
+// The main pass only shades the fragments whose depth the pre-pass left in the depth buffer
+static void end_depth_prepass()
+{
+    end_overdraw_query();
+    set_color_mask(true);
+    set_depth_func(GL_EQUAL);
+    set_depth_mask(false);
+}
+
+static void restore_depth_after_prepass()
+{
+    set_depth_func(GL_LESS);
+    set_depth_mask(true);
+}
+
+// Draws the sorted draw queue with program, only changing the mesh and material when they
+// differ from the previous draw. Depth only draws don't set materials.
+static void draw_queue_packets(ShaderProgram* program, bool depth_only)
+{
+    use_program(program);
+
+    u32 bound_mesh = INVALID_INDEX;
+    u32 bound_material = INVALID_INDEX;
+
+    for (const DrawPacket& packet : draw_queue)
     {
-        return Mat4::Orthographic(near, far, near_width, near_width / aspect_ratio) * view;
+        SubMesh submesh = submeshes[packet.submesh_id];
+
+        if (packet.mesh_id != bound_mesh)
+        {
+            bind_mesh(program, meshes[packet.mesh_id]);
+            bound_mesh = packet.mesh_id;
+            ++frame_stats.state_changes;
+        }
+        else
+        {
+            ++frame_stats.state_changes_eliminated;
+        }
+
+        if (depth_only)
+        {
+            ++frame_stats.depth_prepass_draws;
+        }
+        else if (submesh.material_id != bound_material)
+        {
+            set_material(program, materials[submesh.material_id]);
+            bound_material = submesh.material_id;
+            ++frame_stats.state_changes;
+        }
+        else
+        {
+            ++frame_stats.state_changes_eliminated;
+        }
+
+        set_instance_offset(packet.first_instance);
+        draw_submesh(meshes[packet.mesh_id], submesh, packet.instance_count);
+    }
+}
+
+// Sorts the queued draws and submits them, after a depth pre-pass if it is active
+static void submit_draw_queue()
+{
+    qsort(draw_queue.data, draw_queue.size, sizeof(DrawPacket), compare_draw_packets);
+
+    bool prepass = depth_prepass_active();
+    if (prepass)
+    {
+        begin_depth_prepass();
+        draw_queue_packets(&light_map_instanced_shader, true);
+        end_depth_prepass();
     }
     else
     {
-        return Mat4::Perspective(near, far, get_fov(), aspect_ratio) * view;
+        begin_overdraw_query();
+    }
+
+    draw_queue_packets(selected_instanced_shader, false);
+    end_overdraw_query();
+
+    if (prepass)
+    {
+        restore_depth_after_prepass();
     }
+
+    draw_queue.clear();
 }
 
-void Camera::pixel_ray(int x, int y, int width, int height, Vec3* ray_pos, Vec3* ray_dir) const
+void flush_instanced_draws()
 {
-    // The +0.5f shifts the coordinate to the centre of the pixel
-    Vec3 near_plane = Vec3(x, y, 0.0f) - 0.5f * Vec3(width, height, 0.0f) + Vec3(0.5f, 0.5f, 0.0f);
+    PROFILE_FUNCTION();
+    if (!submitted_instances.size)
+    {
+        return;
+    }
 
-    // Flip the y axis to point up
-    near_plane.y = -near_plane.y;
+    // Counting sort the instances by render object and LOD, so that the instances
+    // drawn with each LOD of an object are contiguous in the instance buffer.
+    static u32 first_instance[MAX_RENDER_OBJECTS * MAX_LODS];
+    static u32 instance_count[MAX_RENDER_OBJECTS * MAX_LODS];
+    static float nearest_depth[MAX_RENDER_OBJECTS * MAX_LODS];
+    u32 bucket_count = render_objects.size * MAX_LODS;
+    memset(instance_count, 0, bucket_count * sizeof(u32));
 
-    // Scale to the size of the near plane
-    near_plane *= near_width / width;
+    for (const InstanceSubmission& submission : submitted_instances)
+    {
+        ++instance_count[submission.obj_index * MAX_LODS + submission.lod];
+    }
 
-    // Move the point onto the near_plane
-    near_plane.z = -near;
+    u32 total = 0;
+    for (uint i = 0; i < bucket_count; ++i)
+    {
+        first_instance[i] = total;
+        total += instance_count[i];
+        instance_count[i] = 0;
+        nearest_depth[i] = view_far;
+    }
 
-    // Apply camera_view rotation
-    near_plane = orientation.apply_rotation(near_plane);
+    // The instances are sorted straight into the stream buffer
+    StreamAllocation allocation = allocate_stream(total * sizeof(InstanceData), sizeof(float));
+    InstanceData* sorted_instances = (InstanceData*) allocation.data;
+    instance_data_offset = allocation.offset;
 
-    if (is_ortho)
+    for (const InstanceSubmission& submission : submitted_instances)
     {
-        *ray_dir = orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f));
-        *ray_pos = pos + near_plane;
+        u32 bucket = submission.obj_index * MAX_LODS + submission.lod;
+        sorted_instances[first_instance[bucket] + instance_count[bucket]] = submission.data;
+        ++instance_count[bucket];
+
+        float depth = dot(submission.data.position - view_pos, view_dir);
+        if (depth < nearest_depth[bucket])
+        {
+            nearest_depth[bucket] = depth;
+        }
     }
-    else
+
+    commit_stream(allocation);
+
+    for (u32 bucket = 0; bucket < bucket_count; ++bucket)
     {
-        *ray_dir = near_plane;
-        *ray_pos = pos;
+        if (!instance_count[bucket])
+        {
+            continue;
+        }
+
+        // Every submesh of the LOD is drawn with the same instances
+        RenderObject obj = render_objects[bucket / MAX_LODS];
+        u32 first_submesh = obj.first_submesh + (bucket % MAX_LODS) * obj.submesh_count;
+        for (u32 submesh_id = first_submesh; submesh_id < first_submesh + obj.submesh_count; ++submesh_id)
+        {
+            u32 material_id = submeshes[submesh_id].material_id;
+            const Material& material = materials[material_id];
+            u32 texture_array = material.textured ? textures[material.texture_id].array : PLACEHOLDER_TEXTURE_ARRAY;
+
+            DrawPacket packet;
+            packet.sort_key = make_sort_key(current_pass, selected_instanced_shader->id, texture_array,
+                                            material_id, obj.mesh_id, nearest_depth[bucket]);
+            packet.mesh_id = obj.mesh_id;
+            packet.submesh_id = submesh_id;
+            packet.first_instance = first_instance[bucket];
+            packet.instance_count = instance_count[bucket];
+
+            draw_queue.push(packet);
+        }
     }
+
+    frame_stats.instances += submitted_instances.size;
+    submitted_instances.clear();
+
+    submit_draw_queue();
+
+    // Restore the non-instanced shader for the draw_* functions
+    use_program(selected_shader);
 }
 
-void Camera::draw_gui()
+bool gpu_driven_rendering_active()
 {
-    ImGui::InputFloat3("Position", pos.array());
+    return gpu_driven_rendering.enabled && gpu_driven_supported;
+}
 
-    ImGui::InputFloat("Near", &near);
-    ImGui::InputFloat("Far", &far);
+void update_gpu_scene(const GpuSceneObject* objects, u32 count)
+{
+    assert(count <= MAX_GPU_SCENE_OBJECTS);
 
-    ImGui::Checkbox("Orthographic?", &is_ortho);
+    // Adding, removing or changing the render object or mask of an object changes the layout
+    // of the commands and instances
+    if (count != cull_objects.size)
+    {
+        gpu_scene_layout_dirty = true;
+    }
 
-    if (is_ortho)
+    u32 first_changed = count;
+    u32 last_changed = 0;
+    for (u32 i = 0; i < count; ++i)
     {
-        ImGui::InputFloat("Near plane width", &near_width);
+        CullObject object = {};
+        object.position = objects[i].transform.pos;
+        object.rotation = objects[i].transform.rotation;
+        object.scale = objects[i].transform.scale;
+        object.obj_index = objects[i].obj_index;
+        object.mask = objects[i].mask;
+
+        if (i < cull_objects.size && memcmp(&cull_objects[i], &object, sizeof(object)) == 0)
+        {
+            continue;
+        }
+
+        if (i >= cull_objects.size || cull_objects[i].obj_index != object.obj_index || cull_objects[i].mask != object.mask)
+        {
+            gpu_scene_layout_dirty = true;
+        }
+
+        cull_objects.data[i] = object;
+        if (i < first_changed) first_changed = i;
+        last_changed = i;
+    }
+    cull_objects.size = count;
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, cull_object_buffer);
+    if (count > cull_object_capacity)
+    {
+        cull_object_capacity = count + count / 2;
+        glBufferData(GL_COPY_WRITE_BUFFER, cull_object_capacity * sizeof(CullObject), nullptr, GL_DYNAMIC_DRAW);
+        first_changed = 0;
+        last_changed = count - 1;
+    }
+
+    if (first_changed < count)
+    {
+        glBufferSubData(GL_COPY_WRITE_BUFFER, first_changed * sizeof(CullObject),
+                        (last_changed - first_changed + 1) * sizeof(CullObject), &cull_objects[first_changed]);
+    }
+}
+
+static int compare_indirect_groups(const void* lhs, const void* rhs)
+{
+    u64 lhs_key = ((const IndirectGroup*)lhs)->sort_key;
+    u64 rhs_key = ((const IndirectGroup*)rhs)->sort_key;
+    return (lhs_key > rhs_key) - (lhs_key < rhs_key);
+}
+
+// Lays out the commands and instances of the render objects used by the scene
+static void build_gpu_scene_layout()
+{
+    static u32 object_counts[MAX_RENDER_OBJECTS];
+    static u32 object_masks[MAX_RENDER_OBJECTS];
+    memset(object_counts, 0, render_objects.size * sizeof(u32));
+    memset(object_masks, 0, render_objects.size * sizeof(u32));
+    for (const CullObject& object : cull_objects)
+    {
+        ++object_counts[object.obj_index];
+        object_masks[object.obj_index] |= object.mask;
+    }
+
+    gpu_scene_commands.clear();
+    gpu_scene_groups.clear();
+    u32 instance_count = 0;
+
+    for (u32 obj_index = 0; obj_index < render_objects.size; ++obj_index)
+    {
+        const RenderObject& obj = render_objects[obj_index];
+
+        CullRenderObject* cull = &cull_render_objects[obj_index];
+        *cull = {};
+        cull->center = 0.5f * (obj.bounds.min + obj.bounds.max);
+        cull->extent = 0.5f * (obj.bounds.max - obj.bounds.min);
+        cull->lod_count = obj.lod_count;
+        memcpy(cull->lod_error, obj.lod_error, sizeof(cull->lod_error));
+
+        Vec3 extent(fmaxf(fabsf(obj.bounds.min.x), fabsf(obj.bounds.max.x)),
+                    fmaxf(fabsf(obj.bounds.min.y), fabsf(obj.bounds.max.y)),
+                    fmaxf(fabsf(obj.bounds.min.z), fabsf(obj.bounds.max.z)));
+        cull->radius = extent.magnitude();
+
+        // Objects of render objects that aren't drawn are skipped by the shader
+        if (!object_counts[obj_index] || !obj.submesh_count)
+        {
+            continue;
+        }
+
+        cull->submesh_count = obj.submesh_count;
+        cull->first_command = gpu_scene_commands.size;
+
+        // Any number of the objects can use each LOD
+        for (u32 i = 0; i < obj.submesh_count; ++i)
+        {
+            u32 material_id = submeshes[obj.first_submesh + i].material_id;
+            const Material& material = materials[material_id];
+            u32 texture_array = material.textured ? textures[material.texture_id].array : PLACEHOLDER_TEXTURE_ARRAY;
+
+            IndirectGroup group;
+            group.sort_key = make_sort_key(RENDER_PASS_MAIN, 0, texture_array, material_id, obj.mesh_id, 0.0f);
+            group.mesh_id = obj.mesh_id;
+            group.material_id = material_id;
+            group.mask = object_masks[obj_index];
+            group.first_command = gpu_scene_commands.size;
+            group.command_count = obj.lod_count;
+            gpu_scene_groups.push(group);
+
+            for (u32 lod = 0; lod < obj.lod_count; ++lod)
+            {
+                const SubMesh& submesh = submeshes[obj.first_submesh + lod * obj.submesh_count + i];
+
+                DrawElementsIndirectCommand command;
+                command.count = submesh.index_count;
+                command.instance_count = 0;
+                command.first_index = submesh.first_index;
+                command.base_vertex = submesh.base_vertex;
+                command.base_instance = instance_count + lod * object_counts[obj_index];
+                gpu_scene_commands.push(command);
+            }
+        }
+
+        instance_count += obj.lod_count * object_counts[obj_index];
+    }
+
+    // The groups share the program, so they are sorted by texture array, material and mesh
+    qsort(gpu_scene_groups.data, gpu_scene_groups.size, sizeof(IndirectGroup), compare_indirect_groups);
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, cull_render_object_buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, render_objects.size * sizeof(CullRenderObject), cull_render_objects, GL_STATIC_DRAW);
+
+    if (instance_count > cull_instance_capacity)
+    {
+        cull_instance_capacity = instance_count + instance_count / 2;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, cull_instance_buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, cull_instance_capacity * sizeof(InstanceData), nullptr, GL_DYNAMIC_COPY);
+    }
+
+    gpu_scene_layout_dirty = false;
+}
+
+// Draws the groups of the GPU scene that mask shares a bit with, from the commands written
+// by the culling shader at commands_offset in the stream buffer
+static void draw_gpu_scene_groups(ShaderProgram* program, bool depth_only, size_t commands_offset, u32 mask)
+{
+    use_program(program);
+
+    u32 bound_mesh = INVALID_INDEX;
+    u32 bound_material = INVALID_INDEX;
+
+    for (const IndirectGroup& group : gpu_scene_groups)
+    {
+        if (!(group.mask & mask))
+        {
+            continue;
+        }
+
+        const Mesh& mesh = meshes[group.mesh_id];
+
+        if (group.mesh_id != bound_mesh)
+        {
+            bind_mesh(program, mesh);
+            set_instance_buffer(cull_instance_buffer, 0);
+            bound_mesh = group.mesh_id;
+            ++frame_stats.state_changes;
+        }
+        else
+        {
+            ++frame_stats.state_changes_eliminated;
+        }
+
+        if (depth_only)
+        {
+            ++frame_stats.depth_prepass_draws;
+        }
+        else if (group.material_id != bound_material)
+        {
+            set_material(program, materials[group.material_id]);
+            bound_material = group.material_id;
+            ++frame_stats.state_changes;
+        }
+        else
+        {
+            ++frame_stats.state_changes_eliminated;
+        }
+
+        size_t first_command = commands_offset + group.first_command * sizeof(DrawElementsIndirectCommand);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, mesh.index_type, (const void*) first_command,
+                                    group.command_count, sizeof(DrawElementsIndirectCommand));
+
+        ++frame_stats.draw_calls;
+        frame_stats.indirect_commands += group.command_count;
+    }
+}
+
+// Counts the instances the culling shader wrote to the commands at commands_offset in the
+// stream buffer, and their triangles for each of pass_count passes drawing them
+static void read_back_gpu_scene_stats(size_t commands_offset, u32 pass_count)
+{
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    gpu_scene_readback.size = gpu_scene_commands.size;
+    glBindBuffer(GL_COPY_READ_BUFFER, stream_buffer);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, commands_offset,
+                       gpu_scene_readback.size * sizeof(DrawElementsIndirectCommand), gpu_scene_readback.data);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    for (const DrawElementsIndirectCommand& command : gpu_scene_readback)
+    {
+        frame_stats.triangles += command.count / 3 * command.instance_count * pass_count;
+    }
+
+    // Every visible object is drawn by one LOD of each submesh, so the objects are counted
+    // from the commands of their first submesh
+    for (u32 obj_index = 0; obj_index < render_objects.size; ++obj_index)
+    {
+        const CullRenderObject& cull = cull_render_objects[obj_index];
+        for (u32 lod = 0; cull.submesh_count && lod < cull.lod_count; ++lod)
+        {
+            frame_stats.instances += gpu_scene_readback[cull.first_command + lod].instance_count;
+        }
+    }
+}
+
+void draw_gpu_scene(const Frustum* frustum, u32 mask)
+{
+    PROFILE_FUNCTION();
+    assert(gpu_driven_supported);
+
+    if (gpu_scene_layout_dirty)
+    {
+        build_gpu_scene_layout();
+    }
+
+    if (!gpu_scene_commands.size)
+    {
+        return;
+    }
+
+    // Every pass starts from commands without instances, which the shader adds the visible
+    // objects to. They are written to the stream buffer so that passes don't share them.
+    u32 commands_size = gpu_scene_commands.size * sizeof(DrawElementsIndirectCommand);
+    StreamAllocation allocation = allocate_stream(commands_size, storage_buffer_alignment);
+    memcpy(allocation.data, gpu_scene_commands.data, commands_size);
+    commit_stream(allocation);
+
+    // Planes that every point is inside of disable culling
+    Frustum everything;
+    for (hbmath::Vec4& plane : everything.planes)
+    {
+        plane = hbmath::Vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+
+    use_program(&cull_shader);
+    ShaderUniforms* uniforms = &cull_shader.uniforms;
+    set_uniform(&uniforms->object_count, (int) cull_objects.size);
+    set_uniform(&uniforms->scene_mask, (int) mask);
+    set_uniform(&uniforms->frustum_planes, frustum ? frustum->planes : everything.planes, 6);
+    set_uniform(&uniforms->camera_pos, view_pos);
+    set_uniform(&uniforms->lod_enabled, lod_selection.enabled);
+    set_uniform(&uniforms->lod_orthographic, lod_camera.is_ortho);
+    set_uniform(&uniforms->lod_scale, lod_camera.projected_size(1.0f, 1.0f, lod_image_width));
+    set_uniform(&uniforms->lod_near, lod_camera.near);
+    set_uniform(&uniforms->max_pixel_error, lod_max_pixel_error);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, cull_object_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, cull_render_object_buffer);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, stream_buffer, allocation.offset, commands_size);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, cull_instance_buffer);
+    glDispatchCompute((cull_objects.size + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // The commands and instances written by the shader are read by the draws
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, stream_buffer);
+
+    bool prepass = depth_prepass_active();
+    if (gpu_driven_rendering.read_back_stats)
+    {
+        read_back_gpu_scene_stats(allocation.offset, prepass ? 2 : 1);
     }
     else
     {
-        float fov = get_fov();
-        ImGui::SliderFloat("FOV", &fov, 0.0f, 3.0f);
-        set_fov(fov);
+        frame_stats.instances_counted = false;
+    }
+    if (prepass)
+    {
+        begin_depth_prepass();
+        draw_gpu_scene_groups(&light_map_instanced_shader, true, allocation.offset, mask);
+        end_depth_prepass();
+    }
+    else
+    {
+        begin_overdraw_query();
+    }
+
+    draw_gpu_scene_groups(selected_instanced_shader, false, allocation.offset, mask);
+    end_overdraw_query();
+
+    if (prepass)
+    {
+        restore_depth_after_prepass();
+    }
+
+    // Restore the non-instanced shader for the draw_* functions
+    use_program(selected_shader);
+}
+
+// Appends simplified copies of the object's submeshes to submeshes and indices. Each LOD
+// aims for half the triangles of the previous one. The chain stops early when an LOD
+// doesn't remove enough triangles to be worth drawing, when the error gets too large, or
+// when the LOD doesn't fit in indices.
+static void generate_lods(RenderObject* obj, Array<Vertex> vertices, Array<u32>* indices, Array<SubMesh>* submeshes)
+{
+    const float max_relative_error = 0.05f;
+    const float min_reduction = 0.15f;
+
+    float max_error = max_relative_error * (obj->bounds.max - obj->bounds.min).magnitude();
+
+    u32* simplified = (u32*) malloc(indices->size * sizeof(u32));
+
+    for (u32 lod = 1; lod < MAX_LODS; ++lod)
+    {
+        u32 lod_first_submesh = submeshes->size;
+        u32 lod_first_index = indices->size;
+        u32 previous_first_submesh = obj->first_submesh + (lod - 1) * obj->submesh_count;
+
+        u32 lod_indices = 0;
+        u32 previous_indices = 0;
+        float lod_error = 0.0f;
+        bool out_of_space = false;
+
+        for (u32 i = 0; i < obj->submesh_count; ++i)
+        {
+            // Always simplify the full detail submesh, so that errors don't accumulate
+            SubMesh full = (*submeshes)[obj->first_submesh + i];
+            SubMesh previous = (*submeshes)[previous_first_submesh + i];
+
+            u32 vertex_end = i + 1 < obj->submesh_count ? (*submeshes)[obj->first_submesh + i + 1].base_vertex : vertices.size;
+            u32 vertex_count = vertex_end - full.base_vertex;
+
+            float error;
+            u32 index_count = simplify_mesh(vertices[full.base_vertex].position.array(), sizeof(Vertex), vertex_count,
+                                            indices->data + full.first_index, full.index_count,
+                                            previous.index_count / 6 * 3, max_error, simplified, &error);
+
+            if (indices->size + index_count > indices->max_size)
+            {
+                out_of_space = true;
+                break;
+            }
+
+            SubMesh submesh = previous;
+            if (index_count < previous.index_count)
+            {
+                optimize_vertex_cache(simplified, index_count, vertex_count);
+
+                submesh.first_index = indices->size;
+                submesh.index_count = index_count;
+                memcpy(indices->data + indices->size, simplified, index_count * sizeof(u32));
+                indices->size += index_count;
+            }
+            submeshes->push(submesh);
+
+            lod_indices += submesh.index_count;
+            previous_indices += previous.index_count;
+            if (error > lod_error) lod_error = error;
+        }
+
+        if (out_of_space || lod_indices > (1.0f - min_reduction) * previous_indices)
+        {
+            submeshes->size = lod_first_submesh;
+            indices->size = lod_first_index;
+            break;
+        }
+
+        obj->lod_error[lod] = lod_error;
+        ++obj->lod_count;
+
+        printf("    LOD %u: %u triangles, error %g\n", lod, lod_indices / 3, lod_error);
     }
+
+    free(simplified);
 }
 
-LightSource make_light_source(int side)
-{
-    LightSource light;
+// Loads an OBJ file and converts it to the format it is uploaded in. The cooked mesh's
+// buffers must be free'd with free_cooked_mesh.
+static void cook_obj(const char* filename, CookedMesh* cooked)
+{
+    fastObjMesh* mesh = fast_obj_read(filename);
+
+    const uint face_vertices = 3;
+
+    // All groups are packed into one vertex and index buffer, so the whole object
+    // is drawn with one vao
+    uint total_vertices = mesh->face_count * face_vertices;
+
+    // LODs aim for half the indices of the previous one, so the whole chain usually fits in
+    // twice the full detail index count. generate_lods stops at the LOD that doesn't fit.
+    Vertex* vertex_data = (Vertex*) malloc(total_vertices * sizeof(Vertex));
+    u32* index_data = (u32*) malloc(2 * total_vertices * sizeof(u32));
+    Array<Vertex> vertices(vertex_data, 0, total_vertices);
+    Array<u32> indices(index_data, 0, 2 * total_vertices);
+
+    // Every group gets a material, and every LOD has a submesh per group
+    CookedMaterial* material_data = (CookedMaterial*) malloc(mesh->group_count * sizeof(CookedMaterial));
+    SubMesh* submesh_data = (SubMesh*) malloc(mesh->group_count * MAX_LODS * sizeof(SubMesh));
+    Array<CookedMaterial> cooked_materials(material_data, 0, mesh->group_count);
+    Array<SubMesh> cooked_submeshes(submesh_data, 0, mesh->group_count * MAX_LODS);
+
+    RenderObject render_object;
+    render_object.first_submesh = 0;
+    render_object.submesh_count = 0;
+
+    // Vertex cache misses before and after reordering, summed over all groups
+    float misses_before = 0.0f;
+    float misses_after = 0.0f;
+
+    for (uint g = 0; g < mesh->group_count; ++g)
+    {
+        uint group_vertices = mesh->groups[g].face_count * face_vertices;
+
+        if (!group_vertices) continue;
+
+        uint group_material = mesh->face_materials[mesh->groups[g].face_offset];
+
+        SubMesh submesh;
+        submesh.first_index = indices.size;
+        submesh.index_count = group_vertices;
+        submesh.base_vertex = vertices.size;
+        submesh.material_id = cooked_materials.size;
+        cooked_materials.push(cook_material(&mesh->materials[group_material]));
+
+        for (uint f = mesh->groups[g].face_offset; f < mesh->groups[g].face_offset + mesh->groups[g].face_count; ++f)
+        {
+            if (mesh->face_vertices[f] != face_vertices)
+            {
+                fprintf(stderr, "Error loading mesh. Face has %u vertices, "
+                        "but only faces with %u vertices are supported.\n",
+                        mesh->face_vertices[f], face_vertices);
+                assert(false);
+            }
+
+            if (mesh->face_materials[f] != group_material)
+            {
+                fprintf(stderr, "Error loading mesh. A group must only have a single material, "
+                        "but this group has more than one material.");
+                assert(false);
+            }
+
+            for (uint v = 0; v < face_vertices; ++v)
+            {
+                uint pos_index =  mesh->indices[face_vertices * f + v].p;
+                uint normal_idx = mesh->indices[face_vertices * f + v].n;
+                uint uv_idx =     mesh->indices[face_vertices * f + v].t;
+
+                vertices.push(Vertex(Vec3(mesh->positions + 3 * pos_index),
+                                     Vec3(mesh->normals   + 3 * normal_idx),
+                                     Vec2(mesh->texcoords + 2 * uv_idx)));
+            }
+        }
 
-    light.side = side;
+        // The group's vertices were appended unindexed. Welding moves the unique ones
+        // to the start of the group, and the duplicates are dropped from the array.
+        // Indices are relative to the submesh's base vertex.
+        Vertex* submesh_vertices = vertex_data + submesh.base_vertex;
+        u32* submesh_indices = index_data + submesh.first_index;
 
-    glGenTextures(1, &light.texture);
-    glBindTexture(GL_TEXTURE_2D, light.texture);
+        u32 unique_vertices = weld_vertices(submesh_vertices, group_vertices, sizeof(Vertex), submesh_indices);
+        vertices.size = submesh.base_vertex + unique_vertices;
+        indices.size += group_vertices;
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+        u32 triangles = group_vertices / face_vertices;
+        misses_before += triangles * compute_acmr(submesh_indices, group_vertices, unique_vertices);
 
-    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, side, side);
+        optimize_vertex_cache(submesh_indices, group_vertices, unique_vertices);
+        optimize_vertex_fetch(submesh_vertices, unique_vertices, sizeof(Vertex), submesh_indices, group_vertices);
 
-    glGenFramebuffers(1, &light.fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, light.fbo);
+        misses_after += triangles * compute_acmr(submesh_indices, group_vertices, unique_vertices);
 
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, light.texture, 0);
+        cooked_submeshes.push(submesh);
+        ++render_object.submesh_count;
+    }
 
-    // Tell OpenGL that the framebuffer does not have a color component
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
+    render_object.bounds = compute_bounds(vertices);
 
-    assert(GL_FRAMEBUFFER_COMPLETE == glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER));
+    uint triangles = total_vertices / face_vertices;
+    printf("%s: %u vertices welded to %zu, ACMR %.3f -> %.3f\n", filename, total_vertices, vertices.size,
+           triangles ? misses_before / triangles : 0.0f, triangles ? misses_after / triangles : 0.0f);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    generate_lods(&render_object, vertices, &indices, &cooked_submeshes);
 
-    return light;
-}
+    void* mesh_vertices;
+    void* mesh_indices;
+    build_mesh_data(vertices, indices, &cooked->mesh, &mesh_vertices, &cooked->vertex_bytes,
+                    &mesh_indices, &cooked->index_bytes);
 
-void LightSource::draw_gui()
-{
-    ImGui::InputFloat("Aspect ratio", &aspect_ratio);
-    ImGui::InputFloat("Intensity", &intensity);
-    camera.draw_gui();
+    cooked->object = render_object;
+    cooked->submeshes = submesh_data;
+    cooked->materials = material_data;
+    cooked->material_count = cooked_materials.size;
+    cooked->vertices = mesh_vertices;
+    cooked->indices = mesh_indices;
 
-    ImGui::Image((void*)(intptr_t)texture, ImVec2(200.0f, 200.0f));
+    free(vertex_data);
+    free(index_data);
+    fast_obj_destroy(mesh);
 }
 
-void prepare_lightmap_draw(LightSource light)
+static void free_cooked_mesh(CookedMesh* cooked)
 {
-    glViewport(0, 0, light.side, light.side);
-    glBindFramebuffer(GL_FRAMEBUFFER, light.fbo);
-
-    glClear(GL_DEPTH_BUFFER_BIT);
-
-    glUseProgram(light_map_shader);
-    selected_shader = light_map_shader;
+    free((void*) cooked->submeshes);
+    free((void*) cooked->materials);
+    free((void*) cooked->vertices);
+    free((void*) cooked->indices);
+}
 
-    GLint loc = glGetUniformLocation(selected_shader, "light");
-    glUniformMatrix4fv(loc, 1, GL_TRUE, light.camera.compute_matrix(light.aspect_ratio).data);
+// Hashes every setting that changes how OBJ files are cooked, so that caches cooked
+// with different settings are not used
+static u64 cook_settings_hash()
+{
+    u32 max_lods = MAX_LODS;
+    u64 hash = hash_data(&max_lods, sizeof(max_lods));
+    hash = hash_data(&vertex_packing.enabled, sizeof(vertex_packing.enabled), hash);
+    hash = hash_data(&vertex_packing.position_tolerance, sizeof(float), hash);
+    hash = hash_data(&vertex_packing.normal_tolerance, sizeof(float), hash);
+    hash = hash_data(&vertex_packing.uv_tolerance, sizeof(float), hash);
+    return hash;
 }
 
-void init_rendering(SDL_Window* window)
+// Decodes the triangles of the object's occluder from mesh data laid out by build_mesh_data
+static void build_occluder(RenderObject* obj, const Mesh& mesh, const SubMesh* object_submeshes,
+                           const void* vertices, const void* indices)
 {
-    sample_screen_size(window);
+    float max_error = OCCLUDER_MAX_ERROR * (obj->bounds.max - obj->bounds.min).magnitude();
 
-    glEnable(GL_MULTISAMPLE);
-    glEnable(GL_DEPTH_TEST);
+    u32 lod = 0;
+    for (u32 l = obj->lod_count - 1; l > 0; --l)
+    {
+        if (obj->lod_error[l] <= max_error)
+        {
+            lod = l;
+            break;
+        }
+    }
+
+    const SubMesh* lod_submeshes = object_submeshes + lod * obj->submesh_count;
+    u32 vertex_count = 0;
+    for (u32 i = 0; i < obj->submesh_count; ++i)
+    {
+        vertex_count += lod_submeshes[i].index_count;
+    }
 
-    // Generate (2d) square vao
+    if (vertex_count / 3 > MAX_OCCLUDER_TRIANGLES || occluder_vertices.size + vertex_count > occluder_vertices.max_size)
     {
-        glGenBuffers(1, &rect_vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, rect_vbo);
+        return;
+    }
 
-        Vec2 rect_vertices[4] = {
-            { 0.5f,  0.5f},
-            {-0.5f,  0.5f},
-            {-0.5f, -0.5f},
-            { 0.5f, -0.5f},
-        };
+    obj->first_occluder_vertex = occluder_vertices.size;
+    obj->occluder_vertex_count = vertex_count;
 
-        glBufferData(GL_ARRAY_BUFFER, sizeof(rect_vertices), rect_vertices, GL_STATIC_DRAW);
+    for (u32 i = 0; i < obj->submesh_count; ++i)
+    {
+        const SubMesh& submesh = lod_submeshes[i];
+        for (u32 j = submesh.first_index; j < submesh.first_index + submesh.index_count; ++j)
+        {
+            u32 index = submesh.base_vertex;
+            index += mesh.index_type == GL_UNSIGNED_SHORT ? ((const u16*) indices)[j] : ((const u32*) indices)[j];
 
-        glGenVertexArrays(1, &rect_vao);
-        glBindVertexArray(rect_vao);
+            Vec3 position;
+            if (mesh.packed)
+            {
+                const PackedVertex& vertex = ((const PackedVertex*) vertices)[index];
+                for (uint k = 0; k < 3; ++k)
+                {
+                    position.array()[k] = mesh.position_offset.array()[k]
+                                        + mesh.position_scale.array()[k] * (vertex.position[k] / 65535.0f);
+                }
+            }
+            else
+            {
+                position = ((const Vertex*) vertices)[index].position;
+            }
 
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (const void*)0);
+            occluder_vertices.push(position);
+        }
     }
+}
 
-    // Generate (2d) line vao
+RenderObjectIndex load_obj(const char* filename)
+{
+    PROFILE_FUNCTION();
+    RenderObjectIndex index;
+    if (acquire_asset(ASSET_RENDER_OBJECT, filename, &index))
     {
-        glGenBuffers(1, &line_vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, line_vbo);
+        return index;
+    }
 
-        Vec2 line_vertices[2] = {Vec2(0.0f, 0.0f), Vec2(1.0f, 0.0f)};
+    auto start_time = std::chrono::steady_clock::now();
 
-        glBufferData(GL_ARRAY_BUFFER, sizeof(line_vertices), line_vertices, GL_STATIC_DRAW);
+    // The cache is mapped and its vertex and index data uploaded straight from the mapping
+    CookedMesh cooked;
+    u64 settings_hash = cook_settings_hash();
+    bool from_cache = open_mesh_cache(filename, settings_hash, &cooked);
 
-        glGenVertexArrays(1, &line_vao);
-        glBindVertexArray(line_vao);
+    if (!from_cache)
+    {
+        cook_obj(filename, &cooked);
+        write_mesh_cache(filename, settings_hash, cooked);
+    }
 
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (const void*)0);
+    u32 first_material = materials.size;
+    for (u32 i = 0; i < cooked.material_count; ++i)
+    {
+        load_material(cooked.materials[i]);
     }
 
-    // Load default meshes, materials and objects
+    RenderObject render_object = cooked.object;
+    render_object.filename = register_asset(ASSET_RENDER_OBJECT, filename, render_objects.size);
+    render_object.first_material = first_material;
+    render_object.material_count = cooked.material_count;
+    render_object.first_submesh = submeshes.size;
+    render_object.mesh_id = upload_mesh(cooked.mesh, cooked.vertices, cooked.vertex_bytes,
+                                        cooked.indices, cooked.index_bytes);
+
+    for (u32 i = 0; i < render_object.submesh_count * render_object.lod_count; ++i)
     {
-        cube_mesh = create_mesh(generate_cube_mesh());
-        default_material = materials.size;
-        materials.push(Material());
+        SubMesh submesh = cooked.submeshes[i];
+        submesh.material_id += first_material;
+        submeshes.push(submesh);
+    }
 
-        RenderObject cube_object;
-        cube_object.mesh_id = cube_mesh;
-        cube_object.material_id = default_material;
+    build_occluder(&render_object, cooked.mesh, cooked.submeshes, cooked.vertices, cooked.indices);
 
-        cube = render_objects.size;
-        render_objects.push(cube_object);
+    index = render_objects.size;
+    render_objects.push(render_object);
+
+    if (from_cache)
+    {
+        close_mesh_cache(&cooked);
+    }
+    else
+    {
+        free_cooked_mesh(&cooked);
     }
 
-    debug_shader = load_shader("shaders/debug_vs.glsl", "shaders/debug_fs.glsl");
-    simple_shader = load_shader("shaders/simple_vs.glsl", "shaders/simple_fs.glsl");
-    light_map_shader = load_shader("shaders/shadow_vs.glsl", "shaders/shadow_fs.glsl");
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+    printf("Loaded %s from %s in %.2f ms\n", filename, from_cache ? "cache" : "OBJ", elapsed.count());
+
+    return index;
 }
 
-void prepare_final_draw(Camera camera, LightSource light)
+void release_obj(RenderObjectIndex obj_index)
 {
-    glViewport(0, 0, screen_width, screen_height);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    RenderObject* obj = &render_objects[obj_index];
+    if (!release_asset(ASSET_RENDER_OBJECT, obj->filename))
+    {
+        return;
+    }
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    for (u32 i = 0; i < obj->material_count; ++i)
+    {
+        const Material& material = materials[obj->first_material + i];
+        if (material.textured)
+        {
+            release_texture(material.texture_id);
+        }
+    }
+
+    Mesh* mesh = &meshes[obj->mesh_id];
+    delete_vertex_array(&mesh->vao);
+    glDeleteBuffers(1, &mesh->vbo);
+    glDeleteBuffers(1, &mesh->ibo);
+    mesh->vbo = mesh->ibo = 0;
+
+    // The index stays allocated so that other indices remain valid, but nothing is drawn
+    obj->submesh_count = 0;
+    obj->occluder_vertex_count = 0;
+    gpu_scene_layout_dirty = true;
+}
 
-    glUseProgram(simple_shader);
-    selected_shader = simple_shader;
+void prepare_debug_draw(Camera camera)
+{
+    set_viewport(0, 0, screen_width, screen_height);
+    bind_framebuffer(GL_FRAMEBUFFER, screen_fbo);
 
-    GLint loc = glGetUniformLocation(selected_shader, "camera");
-    glUniformMatrix4fv(loc, 1, GL_TRUE, camera.compute_matrix(get_aspect_ratio()).data);
+    use_program(&debug_shader);
 
-    loc = glGetUniformLocation(selected_shader, "camera_pos");
-    glUniform3fv(loc, 1, camera.pos.array());
+    set_uniform(&debug_shader.uniforms.camera, camera.compute_matrix(get_aspect_ratio()));
+}
 
-    loc = glGetUniformLocation(selected_shader, "light_pos");
-    glUniform3fv(loc, 1, light.camera.pos.array());
+static void push_debug_line(Vec2 a, Vec2 b, Vec3 color, bool depth_test)
+{
+    debug_vertices[depth_test].push({a, color});
+    debug_vertices[depth_test].push({b, color});
+}
 
-    loc = glGetUniformLocation(selected_shader, "light");
-    glUniformMatrix4fv(loc, 1, GL_TRUE, light.camera.compute_matrix(light.aspect_ratio).data);
+void debug_draw_line(Vec2 from, Vec2 to, float r, float g, float b, bool depth_test)
+{
+    push_debug_line(from, to, Vec3(r, g, b), depth_test);
+}
 
-    loc = glGetUniformLocation(selected_shader, "light_direction");
-    glUniform3fv(loc, 1, light.camera.orientation.apply_rotation(Vec3(0.0f, 0.0f, -1.0f)).array());
+void debug_draw_rectangle(Transform2d rect, float r, float g, float b, bool depth_test)
+{
+    Mat2 rotation = Mat2::Rotation(rect.rotation);
 
-    loc = glGetUniformLocation(selected_shader, "intensity");
-    glUniform1f(loc, light.intensity);
+    Vec2 corners[4] = {
+        { 0.5f,  0.5f},
+        {-0.5f,  0.5f},
+        {-0.5f, -0.5f},
+        { 0.5f, -0.5f},
+    };
 
-    loc = glGetUniformLocation(selected_shader, "is_directional");
-    glUniform1i(loc, light.camera.is_ortho);
+    for (Vec2& corner : corners)
+    {
+        corner = rect.pos + rotation * Vec2(corner.x * rect.scale.x, corner.y * rect.scale.y);
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, light.texture);
+    debug_draw_poly(corners, 4, r, g, b, depth_test);
 }
 
-void draw_box(Transform3d box)
+void debug_draw_poly(const Vec2* points, u32 count, float r, float g, float b, bool depth_test)
 {
-    draw_object(box, cube);
+    for (uint i = 0; i < count; ++i)
+    {
+        push_debug_line(points[i], points[(i + 1) % count], Vec3(r, g, b), depth_test);
+    }
 }
 
-void draw_skybox(u32 texture_id, Vec3 camera_pos)
+u32 create_debug_line_set()
 {
-    Mesh mesh = meshes[cube];
+    DebugLineSet set = {};
+    glGenBuffers(1, &set.vbo);
+    set.vao = create_debug_vao(set.vbo);
 
-    glBindVertexArray(mesh.vao);
-
-    Mat3 rotation;
-    Vec3 scale(1.0f, 1.0f, 1.0f);
+    debug_line_sets.push(set);
+    return debug_line_sets.size - 1;
+}
 
-    GLint loc = glGetUniformLocation(selected_shader, "rotation");
-    glUniformMatrix3fv(loc, 1, GL_TRUE, rotation.data);
+void begin_debug_line_set(u32 set_index)
+{
+    assert(recording_debug_line_set == INVALID_INDEX);
+    recording_debug_line_set = set_index;
 
-    loc = glGetUniformLocation(selected_shader, "scale");
-    glUniform3fv(loc, 1, scale.array());
+    debug_line_set_start[0] = debug_vertices[0].size;
+    debug_line_set_start[1] = debug_vertices[1].size;
+}
 
-    loc = glGetUniformLocation(selected_shader, "position");
-    glUniform3fv(loc, 1, camera_pos.array());
+void end_debug_line_set()
+{
+    assert(recording_debug_line_set != INVALID_INDEX);
+    DebugLineSet* set = &debug_line_sets[recording_debug_line_set];
+    recording_debug_line_set = INVALID_INDEX;
 
-    loc = glGetUniformLocation(selected_shader, "lit");
-    glUniform1i(loc, false);
+    u32 total_count = 0;
+    for (u32 depth_test = 0; depth_test < 2; ++depth_test)
+    {
+        set->vertex_count[depth_test] = debug_vertices[depth_test].size - debug_line_set_start[depth_test];
+        total_count += set->vertex_count[depth_test];
+    }
 
-    loc = glGetUniformLocation(selected_shader, "textured");
-    glUniform1i(loc, true);
+    glBindBuffer(GL_ARRAY_BUFFER, set->vbo);
+    glBufferData(GL_ARRAY_BUFFER, total_count * sizeof(DebugVertex), nullptr, GL_STATIC_DRAW);
 
-    loc = glGetUniformLocation(selected_shader, "color_texture");
-    glUniform1i(loc, 1);
+    // The recorded lines are moved out of the per-frame lines
+    size_t offset = 0;
+    for (u32 depth_test = 0; depth_test < 2; ++depth_test)
+    {
+        size_t bytes = set->vertex_count[depth_test] * sizeof(DebugVertex);
+        glBufferSubData(GL_ARRAY_BUFFER, offset, bytes, debug_vertices[depth_test].data + debug_line_set_start[depth_test]);
+        offset += bytes;
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, textures[texture_id].id);
+        debug_vertices[depth_test].size = debug_line_set_start[depth_test];
+    }
+}
 
-    glDepthMask(GL_FALSE);
-    glFrontFace(GL_CW);
-    glDrawArrays(GL_TRIANGLES, 0, mesh.num_vertices);
-    glFrontFace(GL_CCW);
-    glDepthMask(GL_TRUE);
+void draw_debug_line_set(u32 set_index)
+{
+    queued_debug_line_sets.push(set_index);
 }
 
-void draw_object(Transform3d transform, RenderObjectIndex obj_index)
+void flush_debug_draws()
 {
-    while (obj_index != INVALID_INDEX)
+    assert(recording_debug_line_set == INVALID_INDEX);
+    use_program(&debug_shader);
+
+    size_t vertex_count = debug_vertices[0].size + debug_vertices[1].size;
+    if (vertex_count)
     {
-        RenderObject obj = render_objects[obj_index];
+        StreamAllocation allocation = allocate_stream(vertex_count * sizeof(DebugVertex), sizeof(float));
+        memcpy(allocation.data, debug_vertices[0].data, debug_vertices[0].size * sizeof(DebugVertex));
+        memcpy((DebugVertex*) allocation.data + debug_vertices[0].size, debug_vertices[1].data,
+               debug_vertices[1].size * sizeof(DebugVertex));
+        commit_stream(allocation);
+
+        bind_vertex_array(debug_vao);
+        set_debug_vertex_buffer(stream_buffer, allocation.offset);
+    }
 
-        Mesh mesh = meshes[obj.mesh_id];
-        Material mat = materials[obj.material_id];
+    for (u32 depth_test = 0; depth_test < 2; ++depth_test)
+    {
+        set_depth_test(depth_test);
 
-        Mat3 rotation = Mat3::RotateZ(transform.rotation);
+        if (debug_vertices[depth_test].size)
+        {
+            bind_vertex_array(debug_vao);
+            glDrawArrays(GL_LINES, depth_test ? debug_vertices[0].size : 0, debug_vertices[depth_test].size);
+            ++frame_stats.draw_calls;
+        }
 
-        glBindVertexArray(mesh.vao);
+        for (u32 set_index : queued_debug_line_sets)
+        {
+            const DebugLineSet& set = debug_line_sets[set_index];
+            if (set.vertex_count[depth_test])
+            {
+                bind_vertex_array(set.vao);
+                glDrawArrays(GL_LINES, depth_test ? set.vertex_count[0] : 0, set.vertex_count[depth_test]);
+                ++frame_stats.draw_calls;
+            }
+        }
+    }
 
-        GLint loc = glGetUniformLocation(selected_shader, "rotation");
-        glUniformMatrix3fv(loc, 1, GL_TRUE, rotation.data);
+    debug_vertices[0].clear();
+    debug_vertices[1].clear();
+    queued_debug_line_sets.clear();
+}
 
-        loc = glGetUniformLocation(selected_shader, "scale");
-        glUniform3fv(loc, 1, transform.scale.array());
+static void start_texture_upload(const TextureLoad& load)
+{
+    if (!load.loaded)
+    {
+        // The placeholder stays in place of textures that fail to load
+        fprintf(stderr, "Error loading texture %s: %s\n", load.path, load.error);
+        return;
+    }
 
-        loc = glGetUniformLocation(selected_shader, "position");
-        glUniform3fv(loc, 1, transform.pos.array());
+    if (textures[load.texture_id].released)
+    {
+        CookedTexture cooked = load.cooked;
+        free_cooked_texture(&cooked);
+        return;
+    }
 
-        loc = glGetUniformLocation(selected_shader, "diffuse_color");
-        glUniform3fv(loc, 1, mat.diffuse_color.array());
+    TextureUpload upload;
+    upload.texture_id = load.texture_id;
+    upload.cooked = load.cooked;
+    upload.next_level = 0;
+    upload.layer = allocate_texture_layer(upload.cooked.width, upload.cooked.height,
+                                          upload.cooked.level_count, &upload.array);
+    if (upload.layer == INVALID_INDEX)
+    {
+        fprintf(stderr, "Error loading texture %s: all %u texture arrays are in use\n", load.path, MAX_TEXTURE_ARRAYS);
+        CookedTexture cooked = load.cooked;
+        free_cooked_texture(&cooked);
+        return;
+    }
 
-        loc = glGetUniformLocation(selected_shader, "specular_color");
-        glUniform3fv(loc, 1, mat.specular_color.array());
+    texture_uploads.push(upload);
+}
 
-        loc = glGetUniformLocation(selected_shader, "shininess");
-        glUniform1f(loc, mat.shininess);
+// Uploads the next mip level of the oldest upload. Returns the number of bytes uploaded.
+static u32 upload_next_texture_level()
+{
+    TextureUpload* upload = &texture_uploads[first_texture_upload];
+    u32 level = upload->next_level;
+    u32 width = mip_level_width(upload->cooked, level);
+    u32 height = mip_level_height(upload->cooked, level);
+    u32 bytes = 4 * width * height;
+
+    // Levels that would take up a large part of the stream buffer go through their own
+    // buffer instead, so that they don't make the ring wait for the GPU
+    size_t pixel_offset = 0;
+    if (bytes <= STREAM_BUFFER_SIZE / 4)
+    {
+        StreamAllocation allocation = allocate_stream(bytes, 4);
+        memcpy(allocation.data, upload->cooked.levels[level], bytes);
+        commit_stream(allocation);
 
-        loc = glGetUniformLocation(selected_shader, "lit");
-        glUniform1i(loc, mat.lit);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream_buffer);
+        pixel_offset = allocation.offset;
+    }
+    else
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texture_upload_pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        memcpy(mapped, upload->cooked.levels[level], bytes);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
 
-        loc = glGetUniformLocation(selected_shader, "textured");
-        glUniform1i(loc, mat.textured);
+    bind_array_texture_for_upload(texture_arrays[upload->array].id);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, upload->layer, width, height, 1,
+                    GL_RGBA, GL_UNSIGNED_BYTE, (const void*)pixel_offset);
 
-        // TODO: This has to be changed to allow multiple (shadowed) light sources
-        // Also this only really has to be done once per shader
-        loc = glGetUniformLocation(selected_shader, "light_depth");
-        glUniform1i(loc, 0);
-        loc = glGetUniformLocation(selected_shader, "color_texture");
-        glUniform1i(loc, 1);
+    // Other texture uploads, e.g. imgui's, read from client memory
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-        if (mat.textured)
+    ++upload->next_level;
+    if (upload->next_level == upload->cooked.level_count)
+    {
+        Texture* texture = &textures[upload->texture_id];
+        if (texture->released)
         {
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, textures[mat.texture_id].id);
+            free_texture_layer(upload->array, upload->layer);
         }
+        else
+        {
+            texture->array = upload->array;
+            texture->layer = upload->layer;
+        }
+        free_cooked_texture(&upload->cooked);
 
-        glDrawArrays(GL_TRIANGLES, 0, mesh.num_vertices);
-
-        obj_index = obj.next_group;
+        ++first_texture_upload;
+        if (first_texture_upload == texture_uploads.size)
+        {
+            first_texture_upload = 0;
+            texture_uploads.clear();
+        }
     }
+
+    return bytes;
 }
 
-RenderObjectIndex load_obj(const char* filename)
+// Starts uploading textures that finished loading, and uploads levels up to budget bytes
+static void stream_textures(u32 budget)
 {
-    RenderObjectIndex last_render_object = INVALID_INDEX;
-
-    fastObjMesh* mesh = fast_obj_read(filename);
-
-    const uint face_vertices = 3;
+    PROFILE_FUNCTION();
+    TextureLoad load;
+    while (poll_texture_load(&load, false))
+    {
+        start_texture_upload(load);
+    }
 
-    // TODO: I think all submeshes can be loaded into the same vbo/vao, and rendered
-    // separately with different starting indices and counts. Maybe this will be more
-    // efficient than using separate VBOs for each, but I'm not sure.
-    for (uint g = 0; g < mesh->group_count; ++g)
+    u32 uploaded = 0;
+    while (first_texture_upload < texture_uploads.size)
     {
-        uint group_vertices = mesh->groups[g].face_count * face_vertices;
+        TextureUpload* upload = &texture_uploads[first_texture_upload];
+        u32 next_bytes = 4 * mip_level_width(upload->cooked, upload->next_level)
+                         * mip_level_height(upload->cooked, upload->next_level);
 
-        if (!group_vertices) continue;
+        if (uploaded && uploaded + next_bytes > budget)
+        {
+            break;
+        }
 
-        // TODO: I'd rather not do an allocation for each iteration
-        Vertex* vertex_data = new Vertex[group_vertices];
-        Array<Vertex> vertices(vertex_data, 0, group_vertices);
+        uploaded += upload_next_texture_level();
+    }
 
-        uint group_material = mesh->face_materials[mesh->groups[g].face_offset];
+    frame_stats.texture_upload_bytes += uploaded;
+}
 
-        for (uint f = mesh->groups[g].face_offset; f < mesh->groups[g].face_offset + mesh->groups[g].face_count; ++f)
+void finish_texture_loads()
+{
+    for (;;)
+    {
+        stream_textures(UINT32_MAX);
+
+        if (!texture_loads_in_flight())
         {
-            if (mesh->face_vertices[f] != face_vertices)
-            {
-                fprintf(stderr, "Error loading mesh. Face has %u vertices, "
-                        "but only faces with %u vertices are supported.\n",
-                        mesh->face_vertices[f], face_vertices);
-                assert(false);
-            }
+            break;
+        }
 
-            if (mesh->face_materials[f] != group_material)
-            {
-                fprintf(stderr, "Error loading mesh. A group must only have a single material, "
-                        "but this group has more than one material.");
-                assert(false);
-            }
+        TextureLoad load;
+        if (poll_texture_load(&load, true))
+        {
+            start_texture_upload(load);
+        }
+    }
 
-            for (uint v = 0; v < face_vertices; ++v)
-            {
-                uint pos_index =  mesh->indices[face_vertices * f + v].p;
-                uint normal_idx = mesh->indices[face_vertices * f + v].n;
-                uint uv_idx =     mesh->indices[face_vertices * f + v].t;
+    stream_textures(UINT32_MAX);
+}
 
-                vertices.push(Vertex(Vec3(mesh->positions + 3 * pos_index),
-                                     Vec3(mesh->normals   + 3 * normal_idx),
-                                     Vec2(mesh->texcoords + 2 * uv_idx)));
-            }
-        }
+void shutdown_rendering()
+{
+    stop_texture_loader();
+}
 
-        RenderObject render_object;
-        render_object.next_group = last_render_object;
-        render_object.mesh_id = create_mesh(vertices);
-        render_object.material_id = load_material(&mesh->materials[group_material]);
+GpuTimer start_gpu_timer(GpuTimer timer)
+{
+    auto now = std::chrono::steady_clock::now();
 
-        last_render_object = render_objects.size;
-        render_objects.push(render_object);
+    GpuTimer previous = running_gpu_timer;
+    if (previous != GPU_TIMER_COUNT)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
 
-        delete[] vertex_data;
+        std::chrono::duration<float, std::milli> elapsed = now - running_gpu_timer_start;
+        frame_stats.cpu_milliseconds[previous] += elapsed.count();
     }
 
-    render_objects[last_render_object].filename = filename;
+    running_gpu_timer = timer;
+    running_gpu_timer_start = now;
+    if (timer != GPU_TIMER_COUNT)
+    {
+        GpuTimerFrame* frame = &gpu_timer_frames[gpu_timer_frame];
+        assert(frame->query_count < MAX_GPU_TIMER_QUERIES);
 
-    fast_obj_destroy(mesh);
+        glBeginQuery(GL_TIME_ELAPSED, frame->queries[frame->query_count]);
+        frame->timers[frame->query_count] = timer;
+        ++frame->query_count;
+    }
 
-    return last_render_object;
+    return previous;
 }
 
-void prepare_debug_draw(Camera camera)
+void stop_gpu_timer()
 {
-    glViewport(0, 0, screen_width, screen_height);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-    glUseProgram(debug_shader);
-
-    GLint loc = glGetUniformLocation(debug_shader, "camera");
-    glUniformMatrix4fv(loc, 1, GL_TRUE, camera.compute_matrix(get_aspect_ratio()).data);
+    start_gpu_timer(GPU_TIMER_COUNT);
 }
 
-void debug_draw_rectangle(Transform2d rect, float r, float g, float b)
+// Adds the measurements of a frame to the timings if all of its queries have finished
+static bool read_gpu_timers(GpuTimerFrame* frame)
 {
-    Mat2 rotation = Mat2::Rotation(rect.rotation);
+    GLuint available = GL_FALSE;
+    if (frame->query_count)
+    {
+        // Queries finish in order, so the last one is the last to become available
+        glGetQueryObjectuiv(frame->queries[frame->query_count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            return false;
+        }
+    }
+
+    float milliseconds[GPU_TIMER_COUNT] = {};
+    for (u32 i = 0; i < frame->query_count; ++i)
+    {
+        GLuint64 nanoseconds;
+        glGetQueryObjectui64v(frame->queries[i], GL_QUERY_RESULT, &nanoseconds);
+        milliseconds[frame->timers[i]] += nanoseconds * 1e-6f;
+    }
 
-    glBindVertexArray(rect_vao);
-    glUseProgram(debug_shader);
+    for (u32 timer = 0; timer < GPU_TIMER_COUNT; ++timer)
+    {
+        float* smoothed = &gpu_timings.smoothed[timer];
+        *smoothed += gpu_timing_smoothing * (milliseconds[timer] - *smoothed);
+        gpu_timings.history[timer][gpu_timings.history_start] = milliseconds[timer];
+        gpu_timings.total[timer] += milliseconds[timer];
+    }
+    gpu_timings.history_start = (gpu_timings.history_start + 1) % GPU_TIMING_HISTORY;
+    ++gpu_timings.frames_measured;
 
-    GLint loc = glGetUniformLocation(debug_shader, "color");
-    glUniform3f(loc, r, g, b);
+    return true;
+}
 
-    loc = glGetUniformLocation(debug_shader, "position");
-    glUniform2fv(loc, 1, rect.pos.array());
+// Ends the frame's timer queries and reads the results of earlier frames that are ready
+static void advance_gpu_timers()
+{
+    stop_gpu_timer();
 
-    loc = glGetUniformLocation(debug_shader, "rotation");
-    glUniformMatrix2fv(loc, 1, GL_TRUE, rotation.data);
+    gpu_timer_frames[gpu_timer_frame].pending = true;
+    gpu_timer_frame = (gpu_timer_frame + 1) % GPU_TIMER_FRAMES;
 
-    loc = glGetUniformLocation(debug_shader, "scale");
-    glUniform2fv(loc, 1, rect.scale.array());
+    // Oldest first, which is the frame that is about to be reused
+    for (u32 i = 0; i < GPU_TIMER_FRAMES; ++i)
+    {
+        GpuTimerFrame* frame = &gpu_timer_frames[(gpu_timer_frame + i) % GPU_TIMER_FRAMES];
+        if (frame->pending && read_gpu_timers(frame))
+        {
+            frame->pending = false;
+        }
+    }
 
-    glDisable(GL_DEPTH_TEST);
+    GpuTimerFrame* next_frame = &gpu_timer_frames[gpu_timer_frame];
+    next_frame->pending = false;
+    next_frame->query_count = 0;
+}
 
-    glDrawArrays(GL_LINE_LOOP, 0, 4);
+const GpuTimings& get_gpu_timings()
+{
+    return gpu_timings;
+}
 
-    glEnable(GL_DEPTH_TEST);
+const char* get_gpu_timer_name(GpuTimer timer)
+{
+    return gpu_timer_names[timer];
 }
 
-void debug_draw_poly(const Vec2* points, u32 count, float r, float g, float b)
+// Reads the overdraw measurements that have finished, and picks whether the pre-pass is
+// used when it is automatic
+static void advance_overdraw_queries()
 {
-    for (uint i = 0; i < count; ++i)
+    overdraw_query_frame = (overdraw_query_frame + 1) % OVERDRAW_QUERY_FRAMES;
+    overdraw_measured_this_frame = false;
+
+    // Oldest first, which is the frame that is about to be reused
+    for (u32 i = 0; i < OVERDRAW_QUERY_FRAMES; ++i)
     {
-        Vec2 edge = points[(i + 1) % count] - points[i];
+        u32 frame = (overdraw_query_frame + i) % OVERDRAW_QUERY_FRAMES;
+        if (!overdraw_query_pending[frame])
+        {
+            continue;
+        }
 
-        // The rotation matrix transforms [1 0] into [edge.x, edge.y].
-        // Technically the rotaiton matrix is acting as rotation and scale.
-        Mat2 rotation(edge.x, 0.0f,
-                      edge.y, 0.0f);
+        // Queries finish in order
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(overdraw_queries[frame], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            break;
+        }
 
-        Vec2 scale(1.0f, 1.0f);
+        GLuint samples;
+        glGetQueryObjectuiv(overdraw_queries[frame], GL_QUERY_RESULT, &samples);
+        measured_overdraw = samples / float(screen_width * screen_height * screen_samples);
+        overdraw_query_pending[frame] = false;
+    }
 
-        glBindVertexArray(line_vao);
-        glUseProgram(debug_shader);
+    overdraw_query_pending[overdraw_query_frame] = false;
 
-        GLint loc = glGetUniformLocation(debug_shader, "color");
-        glUniform3f(loc, r, g, b);
+    if (measured_overdraw > depth_prepass.auto_threshold)
+    {
+        depth_prepass_auto_enabled = true;
+    }
+    else if (measured_overdraw < depth_prepass.auto_threshold * depth_prepass.auto_hysteresis)
+    {
+        depth_prepass_auto_enabled = false;
+    }
 
-        loc = glGetUniformLocation(debug_shader, "position");
-        glUniform2fv(loc, 1, points[i].array());
+    frame_stats.overdraw = measured_overdraw;
+}
 
-        loc = glGetUniformLocation(debug_shader, "rotation");
-        glUniformMatrix2fv(loc, 1, GL_TRUE, rotation.data);
+void present_screen(SDL_Window* window)
+{
+    PROFILE_FUNCTION();
+    advance_gpu_timers();
+    advance_overdraw_queries();
+    end_stream_frame();
 
-        loc = glGetUniformLocation(debug_shader, "scale");
-        glUniform2fv(loc, 1, scale.array());
+    // Offscreen frames are only read back on request
+    if (window)
+    {
+        SDL_GL_SwapWindow(window);
+        sample_screen_size(window);
+    }
 
-        glDisable(GL_DEPTH_TEST);
+    // The window system or GUI may have changed state behind the cache's back
+    reset_gl_state();
 
-        glDrawArrays(GL_LINES, 0, 2);
+    stream_textures(texture_streaming.upload_budget);
+    frame_stats.textures_pending = texture_loads_in_flight() + texture_uploads.size - first_texture_upload;
 
-        glEnable(GL_DEPTH_TEST);
-    }
+    last_frame_stats = frame_stats;
+    frame_stats = FrameStats();
 }
 
-void present_screen(SDL_Window* window)
+const FrameStats& get_frame_stats()
 {
-    SDL_GL_SwapWindow(window);
-    sample_screen_size(window);
+    return last_frame_stats;
 }
 
 int get_screen_width()
@@ -737,44 +4056,42 @@ float get_aspect_ratio()
 
 // This won't load a texture if it has already been loaded.
 // Returns the index of the texture in textures
-uint load_texture(const char* path)
+uint load_texture(const char* path, bool srgb)
 {
-    for (uint i = 0; i < textures.size; ++i)
+    uint texture_id;
+    if (acquire_asset(ASSET_TEXTURE, path, &texture_id))
     {
-        if (strcmp(path, textures[i].path) == 0)
-        {
-            return i;
-        }
+        return texture_id;
     }
 
-    size_t path_len = strlen(path) + 1;
-
-    char* new_path = (char*) malloc(path_len);
-    memcpy(new_path, path, path_len);
-
     Texture new_texture;
-    new_texture.path = new_path;
-
-    // Generate the texture and load the image into it
-    int w, h, n;
-    u8* image = stbi_load(path, &w, &h, &n, 3);
+    new_texture.path = register_asset(ASSET_TEXTURE, path, textures.size);
+    new_texture.array = PLACEHOLDER_TEXTURE_ARRAY;
+    new_texture.layer = 0;
 
-    glGenTextures(1, &new_texture.id);
-    glBindTexture(GL_TEXTURE_2D, new_texture.id);
+    request_texture_load(textures.size, new_texture.path, srgb);
 
-    // TODO: can these be read from mtl?
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    texture_id = textures.size;
+    textures.push(new_texture);
+    return texture_id;
+}
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+void release_texture(uint texture_id)
+{
+    Texture* texture = &textures[texture_id];
+    if (!release_asset(ASSET_TEXTURE, texture->path))
+    {
+        return;
+    }
 
-    stbi_image_free(image);
+    if (texture->array != PLACEHOLDER_TEXTURE_ARRAY || texture->layer != 0)
+    {
+        free_texture_layer(texture->array, texture->layer);
+        texture->array = PLACEHOLDER_TEXTURE_ARRAY;
+        texture->layer = 0;
+    }
 
-    uint texture_id = textures.size;
-    textures.push(new_texture);
-    return texture_id;
+    texture->released = true;
 }
 
 }
@@ -3,12 +3,19 @@
 #include "hbmath.h"
 
 #include "shapes.h"
+#include "culling.h"
 #include "util.h"
 
 #include "GL/glew.h"
 
 struct SDL_Window;
 
+// Most levels of detail a render object can have, including the full detail mesh
+#define MAX_LODS 4
+
+// Most shadow map cascades a light can have. The simple fragment shader declares arrays of this size.
+#define MAX_SHADOW_CASCADES 4
+
 namespace render {
 
 struct Camera
@@ -31,27 +38,118 @@ struct Camera
     // Returns camera_matrix * view_matrix
     hbmath::Mat4 compute_matrix(float aspect_ratio) const;
 
+    // Returns how many pixels wide something of the given size appears at a distance from
+    // the camera, in an image image_width pixels wide
+    float projected_size(float size, float distance, int image_width) const;
+
     void draw_gui();
 };
 
+// Directional (orthographic) lights use cascaded shadow maps: the camera's view frustum is
+// split into cascade_count slices along its depth, and each slice gets a side by side shadow
+// map fit around it. Only the orientation of the light's camera is used.
+// Other lights have one shadow map drawn from their camera.
 struct LightSource
 {
     GLuint fbo;
+
+    // Depth array texture with a layer per cascade
     GLuint texture;
     int side;
+    u32 cascade_count;
+
+    // Depth of only the static casters, which is copied into texture before the dynamic
+    // casters are drawn. A layer is redrawn when it isn't valid or its cascade has moved.
+    GLuint static_fbo;
+    GLuint static_texture;
+    bool static_valid[MAX_SHADOW_CASCADES] = {};
+    hbmath::Mat4 static_matrices[MAX_SHADOW_CASCADES];
+
     float aspect_ratio = 1.0f;
     float intensity = 1.0f;
 
     Camera camera;
 
+    // Set by fit_shadow_cascades. Cascade i is used for points up to cascade_splits[i]
+    // from the camera along its view direction.
+    u32 active_cascades = 0;
+    Camera cascade_cameras[MAX_SHADOW_CASCADES];
+    hbmath::Mat4 cascade_matrices[MAX_SHADOW_CASCADES];
+    float cascade_splits[MAX_SHADOW_CASCADES];
+
+    // Reallocates the shadow maps
+    void resize(int new_side, u32 new_cascade_count);
+
     void draw_gui();
 };
 
+// Controls how the view frustum is split into shadow cascades
+struct ShadowCascades
+{
+    // Shadows are only drawn up to this distance from the camera
+    float max_distance = 50.0f;
+
+    // Blends between uniform splits (0) and logarithmic splits (1), which give every
+    // cascade the same ratio of far to near distance
+    float log_weight = 0.75f;
+
+    // How far towards the light from a cascade's slice objects can still cast shadows into it
+    float caster_distance = 50.0f;
+
+    // Keep a shadow map of the static casters, which is only redrawn when they change or
+    // the cascade moves. To move less often cascades are snapped to a grid of snap_fraction
+    // of their width, and widened to still cover their slice.
+    bool cache_static = true;
+    float snap_fraction = 0.125f;
+};
+
 struct Mesh
 {
     GLuint vbo;
+    GLuint ibo;
     GLuint vao;
     GLuint num_vertices;
+    GLuint num_indices;
+
+    // GL_UNSIGNED_SHORT when every index fits in 16 bits, otherwise GL_UNSIGNED_INT
+    GLenum index_type;
+
+    // Packed meshes store positions and uvs as 16 bit fractions of these ranges, and
+    // octahedral encoded normals. Float meshes use an offset of 0 and a scale of 1.
+    bool packed;
+    hbmath::Vec3 position_offset;
+    hbmath::Vec3 position_scale;
+    hbmath::Vec2 uv_offset;
+    hbmath::Vec2 uv_scale;
+};
+
+// Controls whether meshes are stored in the 16 byte packed vertex format instead of
+// 32 bytes of floats. A mesh is only packed if the error introduced by packing stays
+// below the tolerances.
+struct VertexPacking
+{
+    bool enabled = true;
+
+    // Object space distance
+    float position_tolerance = 0.001f;
+
+    // Distance between the unit normals
+    float normal_tolerance = 0.001f;
+
+    // Texture coordinate units
+    float uv_tolerance = 1.0f / 8192.0f;
+};
+
+// A range of a mesh's index buffer that is drawn with a single material
+struct SubMesh
+{
+    u32 first_index;
+    u32 index_count;
+
+    // Added to every index of the range
+    u32 base_vertex;
+
+    u32 material_id;
 };
 
 struct Material
@@ -64,6 +162,118 @@ struct Material
     bool textured = false;
 
     uint texture_id;
+
+    // Texture sampling. Mipmapped textures are filtered trilinearly, and anisotropic
+    // filtering is used up to max_anisotropy where it is supported (1 disables it).
+    bool mipmapped = true;
+    float max_anisotropy = 8.0f;
+};
+
+// Controls which level of detail is drawn. The coarsest LOD whose simplification error
+// projects to at most max_pixel_error pixels is used.
+struct LodSelection
+{
+    bool enabled = true;
+    float max_pixel_error = 1.0f;
+
+    // The shadow pass allows this many times more error, since shadow edges are soft
+    // and the shadow map is lower resolution than the screen
+    float shadow_bias = 4.0f;
+};
+
+// Parts of the frame that are timed on the CPU and GPU
+enum GpuTimer
+{
+    GPU_TIMER_SHADOWS,
+    GPU_TIMER_MAIN,
+    GPU_TIMER_SKYBOX,
+    GPU_TIMER_DEBUG,
+    GPU_TIMER_GUI,
+    GPU_TIMER_COUNT
+};
+
+// Counters for the work done by the renderer in one frame
+struct FrameStats
+{
+    u32 draw_calls = 0;
+
+    // Objects drawn through draw_object_instanced, and through draw_gpu_scene if
+    // gpu_driven_rendering.read_back_stats is set
+    u32 instances = 0;
+
+    // False if draw_gpu_scene drew objects that instances and triangles leave out
+    bool instances_counted = true;
+
+    // Mesh and material changes made by the render queue, and the ones it avoided
+    // by drawing packets that share state one after another
+    u32 state_changes = 0;
+    u32 state_changes_eliminated = 0;
+
+    u32 triangles = 0;
+
+    // Shadow cascades whose cached static casters were redrawn
+    u32 static_shadow_draws = 0;
+
+    u32 uniform_uploads = 0;
+
+    // Uploads that were dropped because the uniform already had the same value
+    u32 uniform_uploads_skipped = 0;
+
+    // Texture binds made for drawing, and the ones skipped because the texture array was
+    // already bound
+    u32 texture_binds = 0;
+    u32 texture_binds_skipped = 0;
+
+    // Texture data uploaded by the streaming loader, and the textures still loading
+    u32 texture_upload_bytes = 0;
+    u32 textures_pending = 0;
+
+    // Per-frame data written to the stream buffer, and the times writing had to wait for the
+    // GPU to finish reading earlier data
+    u32 stream_bytes = 0;
+    u32 stream_waits = 0;
+
+    // Indirect draw commands submitted by draw_gpu_scene. Their instance counts are only
+    // known to the GPU.
+    u32 indirect_commands = 0;
+
+    // Program, vao, texture, sampler, framebuffer, viewport, depth and front face changes
+    // made through the renderer's state cache, and the ones it dropped because the state
+    // was already set
+    u32 gl_state_calls = 0;
+    u32 gl_state_calls_skipped = 0;
+
+    // Draws made by the depth pre-pass, which are also counted in draw_calls
+    u32 depth_prepass_draws = 0;
+
+    // Samples per pixel that passed the depth test while the main pass was first drawn, which
+    // is how many fragments it shades without a pre-pass. Measured a few frames earlier.
+    float overdraw = 0.0f;
+
+    // CPU time spent while each GPU timer was running
+    float cpu_milliseconds[GPU_TIMER_COUNT] = {};
+
+    void draw_gui() const;
+};
+
+#define GPU_TIMING_HISTORY 128
+
+// GPU time of each timer in milliseconds, measured with timer queries. Results are read a
+// few frames after they were measured, so that the CPU never waits for them.
+struct GpuTimings
+{
+    // Exponential moving average of the measurements
+    float smoothed[GPU_TIMER_COUNT] = {};
+
+    // The last GPU_TIMING_HISTORY measurements, oldest first starting at history_start
+    float history[GPU_TIMER_COUNT][GPU_TIMING_HISTORY] = {};
+    u32 history_start = 0;
+
+    // Sums of all measurements, for averaging over a run
+    double total[GPU_TIMER_COUNT] = {};
+    u32 frames_measured = 0;
+
+    void draw_gui() const;
 };
 
 typedef u32 RenderObjectIndex;
@@ -71,40 +281,190 @@ typedef u32 RenderObjectIndex;
 struct RenderObject
 {
     u32 mesh_id;
-    u32 material_id;
 
+    // The object is drawn as submeshes[first_submesh] to submeshes[first_submesh + submesh_count - 1]
+    u32 first_submesh;
+    u32 submesh_count;
+
+    // Simplified versions of the object follow the full detail submeshes, so LOD l is
+    // drawn with the submesh_count submeshes starting at first_submesh + l * submesh_count
+    u32 lod_count = 1;
+
+    // Largest object space distance that each LOD moves the surface
+    float lod_error[MAX_LODS] = {};
+
+    // Interned by the asset registry
     const char* filename = "";
 
-    RenderObjectIndex next_group = INVALID_INDEX;
+    // The object's materials are materials[first_material] to materials[first_material + material_count - 1]
+    u32 first_material = 0;
+    u32 material_count = 0;
+
+    // Object space bounds of all submeshes
+    Aabb bounds;
+
+    // Low detail triangles that the object is drawn with into the software occlusion buffer,
+    // as three object space positions each, starting at occluder_vertices[first_occluder_vertex].
+    // Objects without an occluder have no occluder vertices.
+    u32 first_occluder_vertex = 0;
+    u32 occluder_vertex_count = 0;
 };
 
 extern Array<RenderObject> render_objects;
+extern Array<hbmath::Vec3> occluder_vertices;
 extern Array<Mesh> meshes;
+extern Array<SubMesh> submeshes;
 extern Array<Material> materials;
 
+// Textures are decoded on worker threads and uploaded at the end of each frame, a mip
+// level at a time. Uploads stop for the frame once upload_budget bytes have been uploaded,
+// but at least one level is always uploaded so that loading makes progress.
+struct TextureStreaming
+{
+    u32 upload_budget = 4 * 1024 * 1024;
+};
+
+// Textures are stored as layers of array textures. With packing, textures of the same size
+// are layers of one array, so materials using them are drawn without binding textures in
+// between. Otherwise every texture gets its own array. Only affects textures loaded later.
+struct TexturePacking
+{
+    bool enabled = true;
+};
+
+// Draws the scene set by update_gpu_scene without walking its objects on the CPU. The objects
+// are kept in GPU buffers, culled and assigned LODs by a compute shader, and drawn with
+// multi-draw indirect. Needs OpenGL 4.3, otherwise the scene has to be drawn with
+// draw_object_instanced.
+struct GpuDrivenRendering
+{
+    bool enabled = false;
+
+    // Reads back the commands after culling, so that the frame stats count the instances and
+    // triangles drawn. This waits for the GPU to finish culling each pass.
+    bool read_back_stats = false;
+};
+
+// Draws the main pass's instanced objects to the depth buffer only before shading them, so
+// that simple_fs.glsl only runs for the visible fragment of each pixel. The second geometry
+// pass pays off when the scene has a lot of overdraw.
+struct DepthPrepass
+{
+    bool enabled = false;
+
+    // Turns the pre-pass on while the measured overdraw is above auto_threshold, and off
+    // again once it drops below auto_threshold * auto_hysteresis
+    bool automatic = false;
+    float auto_threshold = 2.0f;
+    float auto_hysteresis = 0.8f;
+};
+
+extern VertexPacking vertex_packing;
+extern TextureStreaming texture_streaming;
+extern TexturePacking texture_packing;
+extern LodSelection lod_selection;
+extern ShadowCascades shadow_cascades;
+extern GpuDrivenRendering gpu_driven_rendering;
+extern DepthPrepass depth_prepass;
+
 extern RenderObjectIndex cube;
 extern u32 default_material;
 extern u32 cube_mesh;
 
 void init_rendering(SDL_Window* window);
 
-LightSource make_light_source(int side);
+// Renders into an offscreen framebuffer instead of a window, for running without a display.
+// present_screen is then called without a window.
+void init_offscreen_rendering(int width, int height);
+
+// Reads the screen as rows of RGBA8 pixels, bottom row first
+void read_screen_pixels(u8* pixels);
+void shutdown_rendering();
+
+LightSource make_light_source(int side, u32 cascade_count = MAX_SHADOW_CASCADES);
+
+// Fits the light's shadow cascades to the part of the camera's view that is shadowed
+void fit_shadow_cascades(LightSource* light, const Camera& camera, float aspect_ratio);
 
 void prepare_final_draw(Camera camera, LightSource light);
-void prepare_lightmap_draw(LightSource light);
+
+// Marks the cached static shadow maps as out of date, e.g. when a static caster has moved
+void invalidate_static_shadows(LightSource* light);
+
+// Returns true if the static casters of a cascade need to be drawn to its cached shadow map,
+// in which case drawing is set up for them. Always false if static shadows aren't cached.
+bool prepare_static_lightmap_draw(LightSource* light, u32 cascade);
+
+// Draws to one of the shadow map cascades set by fit_shadow_cascades. If static shadows
+// are cached, they are copied into the cascade and only dynamic casters need to be drawn.
+void prepare_lightmap_draw(LightSource light, u32 cascade);
 void prepare_debug_draw(Camera camera);
 
 void draw_box(Transform3d box);
 void draw_object(Transform3d transform, RenderObjectIndex obj_index);
+
+// Queues an object to be drawn by flush_instanced_draws. All queued objects that share
+// a RenderObjectIndex are drawn with a single instanced draw call.
+void draw_object_instanced(Transform3d transform, RenderObjectIndex obj_index);
+void flush_instanced_draws();
+
+struct GpuSceneObject
+{
+    Transform3d transform;
+    RenderObjectIndex obj_index;
+
+    // draw_gpu_scene only draws objects whose mask shares a bit with the pass's mask
+    u32 mask;
+};
+
+// True if gpu_driven_rendering is enabled and the context supports it
+bool gpu_driven_rendering_active();
+
+// Replaces the objects drawn by draw_gpu_scene. Only the objects that changed since the last
+// update are uploaded.
+void update_gpu_scene(const GpuSceneObject* objects, u32 count);
+
+// Draws the objects of the GPU scene that intersect frustum and share a bit with mask in the
+// current pass. All objects are drawn if frustum is null.
+void draw_gpu_scene(const Frustum* frustum, u32 mask);
 void draw_skybox(u32 texture_index, hbmath::Vec3 camera_pos);
-void debug_draw_rectangle(Transform2d rect, float r, float g, float b);
-void debug_draw_poly(const hbmath::Vec2* points, u32 count, float r, float g, float b);
 
-// Returns index of render object
+// Debug lines are drawn on the z = 0 plane by flush_debug_draws, on top of everything unless
+// depth_test is set
+void debug_draw_line(hbmath::Vec2 from, hbmath::Vec2 to, float r, float g, float b, bool depth_test = false);
+void debug_draw_rectangle(Transform2d rect, float r, float g, float b, bool depth_test = false);
+void debug_draw_poly(const hbmath::Vec2* points, u32 count, float r, float g, float b, bool depth_test = false);
+
+// Returns a debug line set, which keeps lines that rarely change on the GPU so that they
+// can be drawn every frame without being sent again
+u32 create_debug_line_set();
+
+// Lines drawn between begin and end replace the lines of the set, instead of being drawn this frame
+void begin_debug_line_set(u32 set_index);
+void end_debug_line_set();
+void draw_debug_line_set(u32 set_index);
+
+// Draws the debug lines of this frame with the camera given to prepare_debug_draw
+void flush_debug_draws();
+
+// Returns index of render object. Loading an object that is already loaded returns the same
+// index and adds a reference to it.
 RenderObjectIndex load_obj(const char* filename);
 
-// Returns texture id
-uint load_texture(const char* path);
+// Removes a reference to the object. When the last one is removed its mesh and textures are
+// freed and it is no longer drawn, but its index isn't reused.
+void release_obj(RenderObjectIndex obj_index);
+
+// Returns texture id. Color textures are sRGB encoded, which is taken into account when
+// their mips are built.
+// The texture is loaded in the background, and a placeholder texel is drawn until it is ready.
+uint load_texture(const char* path, bool srgb = true);
+
+// Removes a reference to the texture, freeing it when the last one is removed
+void release_texture(uint texture_id);
+
+// Blocks until every requested texture is loaded and uploaded
+void finish_texture_loads();
 
 int get_screen_width();
 int get_screen_height();
@@ -114,4 +474,16 @@ float get_aspect_ratio();
 
 void present_screen(SDL_Window* window);
 
+// Returns the stats for the last presented frame
+const FrameStats& get_frame_stats();
+
+// Starts measuring GPU time for a timer, stopping the timer that was running. Returns the
+// timer that was running, or GPU_TIMER_COUNT if there was none, which stops timing when started.
+// Timing stops at the end of the frame.
+GpuTimer start_gpu_timer(GpuTimer timer);
+void stop_gpu_timer();
+
+const GpuTimings& get_gpu_timings();
+const char* get_gpu_timer_name(GpuTimer timer);
+
 }
@@ -8,6 +8,9 @@
 #include <cstring>
 #include <cstdlib>
 
+// Increment when the layout of the save file changes
+#define SAVE_VERSION 2
+
 struct SaveHeader
 {
     // Save file is ordered:
@@ -15,9 +18,10 @@ struct SaveHeader
     // - game state
     // - entity records
     // - entities
-    // - RenderObject filename count
-    // - RenderObject filenames
+    // - RenderObject count
+    // - RenderObject filenames, in RenderObject index order
 
+    u32 version;
     u32 num_entities;
 };
 
@@ -26,6 +30,7 @@ void save_scene(const char* filename)
     FILE* save_file = fopen(filename, "w");
     
     SaveHeader header;
+    header.version = SAVE_VERSION;
     header.num_entities = entities.size;
 
     fwrite(&header, sizeof(SaveHeader), 1, save_file);
@@ -33,14 +38,16 @@ void save_scene(const char* filename)
     fwrite(EntityRecord::records, sizeof(EntityRecord), ARRAY_LENGTH(EntityRecord::records), save_file);
     fwrite(entities.data, sizeof(Entity), entities.size, save_file);
 
+    // Entities refer to RenderObjects by index, so every object is written (with an empty
+    // filename for the built in ones) to be able to map the indices when loading.
+    u32 num_render_objects = render::render_objects.size;
+    fwrite(&num_render_objects, sizeof(u32), 1, save_file);
+
     for (uint i = 0; i < render::render_objects.size; ++i)
     {
         u32 filename_length = strlen(render::render_objects[i].filename);
-        if (filename_length)
-        {
-            fwrite(&filename_length, sizeof(u32), 1, save_file);
-            fwrite(render::render_objects[i].filename, 1, filename_length, save_file);
-        }
+        fwrite(&filename_length, sizeof(u32), 1, save_file);
+        fwrite(render::render_objects[i].filename, 1, filename_length, save_file);
     }
 
     fclose(save_file);
@@ -56,22 +63,52 @@ bool load_scene(const char* filename)
 
     SaveHeader header;
     fread(&header, sizeof(SaveHeader), 1, save_file);
+    if (header.version != SAVE_VERSION)
+    {
+        fprintf(stderr, "Save file %s has version %u, but only version %u can be loaded.\n",
+                filename, header.version, SAVE_VERSION);
+        fclose(save_file);
+        return false;
+    }
+
     fread(&game_state, sizeof(GameState), 1, save_file);
     fread(EntityRecord::records, sizeof(EntityRecord), ARRAY_LENGTH(EntityRecord::records), save_file);
     fread(entities.data, sizeof(Entity), header.num_entities, save_file);
     
-    u32 filename_length;
-    while (fread(&filename_length, sizeof(u32), 1, save_file))
+    // Maps the RenderObject indices in the save file to the indices they are loaded at
+    u32 num_render_objects = 0;
+    fread(&num_render_objects, sizeof(u32), 1, save_file);
+    render::RenderObjectIndex* loaded_index = (render::RenderObjectIndex*) malloc(num_render_objects * sizeof(render::RenderObjectIndex));
+
+    for (u32 i = 0; i < num_render_objects; ++i)
     {
-        // TODO: memory leak (not freeing because the loaded RenderObject will point to filename ...
-        // not sure what to do here).
-        char* filename = (char*) malloc(filename_length + 1);
-        fread(filename, 1, filename_length, save_file);
-        filename[filename_length] = 0;
-        render::load_obj(filename);
+        u32 filename_length = 0;
+        fread(&filename_length, sizeof(u32), 1, save_file);
+
+        if (!filename_length)
+        {
+            // Built in objects are created in the same order by init_rendering
+            loaded_index[i] = i;
+            continue;
+        }
+
+        // The loaded RenderObject keeps an interned copy of the filename
+        char* object_filename = (char*) malloc(filename_length + 1);
+        fread(object_filename, 1, filename_length, save_file);
+        object_filename[filename_length] = 0;
+        loaded_index[i] = render::load_obj(object_filename);
+        free(object_filename);
     }
 
     entities.size = header.num_entities;
+
+    for (auto& entity : entities)
+    {
+        assert(entity.render_object < num_render_objects);
+        entity.render_object = loaded_index[entity.render_object];
+    }
+
+    free(loaded_index);
     
     fclose(save_file);
     return true;
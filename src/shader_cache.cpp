@@ -0,0 +1,91 @@
+#include "shader_cache.h"
+
+#include <cstdio>
+#include <cstring>
+
+#define PROGRAM_CACHE_MAGIC 0x474F5250 // "PROG"
+
+struct ProgramCacheHeader
+{
+    // The binary follows the header
+
+    u32 magic;
+    u32 version;
+    u64 key;
+
+    GLenum format;
+    u32 size;
+};
+
+static void get_cache_path(const char* const* source_paths, u32 source_count, char* cache_path, size_t size)
+{
+    u64 paths_hash = hash_data(nullptr, 0);
+    for (u32 i = 0; i < source_count; ++i)
+    {
+        paths_hash = hash_data(source_paths[i], strlen(source_paths[i]) + 1, paths_hash);
+    }
+
+    snprintf(cache_path, size, "%s.%08x.programcache", source_paths[0], (u32) paths_hash);
+}
+
+bool open_program_cache(const char* const* source_paths, u32 source_count, u64 key, ProgramBinary* binary)
+{
+    char cache_path[PROGRAM_CACHE_MAX_PATH + 32];
+    get_cache_path(source_paths, source_count, cache_path, sizeof(cache_path));
+
+    MappedFile mapping;
+    if (!map_file(cache_path, &mapping))
+    {
+        return false;
+    }
+
+    const ProgramCacheHeader* header = (const ProgramCacheHeader*) mapping.data;
+
+    bool valid = mapping.size >= sizeof(ProgramCacheHeader)
+                 && header->magic == PROGRAM_CACHE_MAGIC
+                 && header->version == PROGRAM_CACHE_VERSION
+                 && header->key == key
+                 && mapping.size == sizeof(ProgramCacheHeader) + header->size;
+
+    if (!valid)
+    {
+        unmap_file(&mapping);
+        return false;
+    }
+
+    binary->format = header->format;
+    binary->data = mapping.data + sizeof(ProgramCacheHeader);
+    binary->size = header->size;
+    binary->mapping = mapping;
+
+    return true;
+}
+
+void close_program_cache(ProgramBinary* binary)
+{
+    unmap_file(&binary->mapping);
+}
+
+void write_program_cache(const char* const* source_paths, u32 source_count, u64 key, const ProgramBinary& binary)
+{
+    ProgramCacheHeader header;
+    header.magic = PROGRAM_CACHE_MAGIC;
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.format = binary.format;
+    header.size = binary.size;
+
+    char cache_path[PROGRAM_CACHE_MAX_PATH + 32];
+    get_cache_path(source_paths, source_count, cache_path, sizeof(cache_path));
+
+    FILE* cache_file = begin_cache_write(cache_path);
+    if (!cache_file)
+    {
+        return;
+    }
+
+    fwrite(&header, sizeof(ProgramCacheHeader), 1, cache_file);
+    fwrite(binary.data, 1, binary.size, cache_file);
+
+    end_cache_write(cache_file, cache_path);
+}
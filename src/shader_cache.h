@@ -0,0 +1,31 @@
+#pragma once
+
+#include "asset_cache.h"
+#include "util.h"
+
+#include "GL/glew.h"
+
+// Linked programs are stored next to their first shader source, as
+// <source>.<hash of all the source paths>.programcache
+#define PROGRAM_CACHE_VERSION 1
+
+#define PROGRAM_CACHE_MAX_PATH 256
+
+// A linked program in the driver's own format, as returned by glGetProgramBinary
+struct ProgramBinary
+{
+    GLenum format;
+    const void* data;
+    u32 size;
+
+    // The file mapping data points into, if the binary was read from a cache
+    MappedFile mapping;
+};
+
+// Maps the cache of the program built from source_paths if it was made with the same key,
+// which identifies the sources' contents and the driver. binary->data points into the
+// mapping until close_program_cache.
+bool open_program_cache(const char* const* source_paths, u32 source_count, u64 key, ProgramBinary* binary);
+void close_program_cache(ProgramBinary* binary);
+
+void write_program_cache(const char* const* source_paths, u32 source_count, u64 key, const ProgramBinary& binary);
@@ -12,6 +12,16 @@ Transform3d::Transform3d(Vec3 pos_, Vec3 scale_, float rotation_)
     : pos(pos_), scale(scale_), rotation(rotation_)
 {}
 
+Aabb::Aabb(Vec3 min_, Vec3 max_)
+    : min(min_), max(max_)
+{}
+
+Aabb Aabb::merge(Aabb other) const
+{
+    return Aabb(Vec3(fminf(min.x, other.min.x), fminf(min.y, other.min.y), fminf(min.z, other.min.z)),
+                Vec3(fmaxf(max.x, other.max.x), fmaxf(max.y, other.max.y), fmaxf(max.z, other.max.z)));
+}
+
 Vec2 generic_support(Array<Vec2> points, Vec2 d)
 {
     float max_proj = -INFINITY;
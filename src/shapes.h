@@ -23,6 +23,19 @@ struct Transform3d
     Transform3d(hbmath::Vec3 pos_, hbmath::Vec3 scale_, float rotation_);
 };
 
+// Axis aligned bounding box
+struct Aabb
+{
+    hbmath::Vec3 min;
+    hbmath::Vec3 max;
+
+    Aabb() = default;
+    Aabb(hbmath::Vec3 min_, hbmath::Vec3 max_);
+
+    // Returns the smallest box containing both boxes
+    Aabb merge(Aabb other) const;
+};
+
 hbmath::Vec2 generic_support(Array<hbmath::Vec2> points, hbmath::Vec2 d);
 
 bool rectangle_contains_point(Transform2d rect, hbmath::Vec2 point);
@@ -0,0 +1,329 @@
+#include "texture_cache.h"
+
+#include "stb_image.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#define TEXTURE_CACHE_MAGIC 0x43584554 // "TEXC"
+
+struct TextureCacheHeader
+{
+    // The cache file is the header followed by every mip level, largest first
+
+    u32 magic;
+    u32 version;
+    u32 srgb;
+
+    SourceStamp source;
+
+    u32 width;
+    u32 height;
+    u32 level_count;
+};
+
+// Radius of the downsampling filter in destination pixels, and the Kaiser window's shape
+static const float filter_radius = 1.5f;
+static const float kaiser_alpha = 4.0f;
+
+u32 mip_level_width(const CookedTexture& texture, u32 level)
+{
+    u32 width = texture.width >> level;
+    return width ? width : 1;
+}
+
+u32 mip_level_height(const CookedTexture& texture, u32 level)
+{
+    u32 height = texture.height >> level;
+    return height ? height : 1;
+}
+
+static u32 level_bytes(const CookedTexture& texture, u32 level)
+{
+    return 4 * mip_level_width(texture, level) * mip_level_height(texture, level);
+}
+
+// Modified Bessel function of the first kind, order 0
+static float bessel_i0(float x)
+{
+    float sum = 1.0f;
+    float term = 1.0f;
+    for (u32 k = 1; k < 20; ++k)
+    {
+        float factor = x / (2.0f * k);
+        term *= factor * factor;
+        sum += term;
+    }
+    return sum;
+}
+
+// x is the distance from the filter's centre, in destination pixels
+static float kaiser_filter(float x)
+{
+    if (fabsf(x) >= filter_radius)
+    {
+        return 0.0f;
+    }
+
+    float t = x / filter_radius;
+    float window = bessel_i0(kaiser_alpha * sqrtf(1.0f - t * t)) / bessel_i0(kaiser_alpha);
+
+    float sinc = 1.0f;
+    if (x != 0.0f)
+    {
+        float pi_x = 3.14159265f * x;
+        sinc = sinf(pi_x) / pi_x;
+    }
+
+    return sinc * window;
+}
+
+// Resamples lines of RGBA pixels from src_count to dst_count pixels. Steps are in floats.
+// Textures repeat, so the filter wraps around the edges.
+static void resample(const float* src, u32 src_count, size_t src_step, size_t src_line_step,
+                     float* dst, u32 dst_count, size_t dst_step, size_t dst_line_step, u32 line_count)
+{
+    float ratio = (float) src_count / dst_count;
+    s32 max_taps = 2 * (s32) ceilf(filter_radius * ratio) + 2;
+
+    float* weights = (float*) malloc(max_taps * sizeof(float));
+
+    for (u32 i = 0; i < dst_count; ++i)
+    {
+        // Centre of the destination pixel in source pixels
+        float center = (i + 0.5f) * ratio;
+        s32 first = (s32) floorf(center - filter_radius * ratio);
+        s32 tap_count = (s32) ceilf(center + filter_radius * ratio) - first;
+        assert(tap_count <= max_taps);
+
+        float total_weight = 0.0f;
+        for (s32 tap = 0; tap < tap_count; ++tap)
+        {
+            weights[tap] = kaiser_filter((first + tap + 0.5f - center) / ratio);
+            total_weight += weights[tap];
+        }
+        for (s32 tap = 0; tap < tap_count; ++tap)
+        {
+            weights[tap] /= total_weight;
+        }
+
+        for (u32 line = 0; line < line_count; ++line)
+        {
+            float sum[4] = {};
+            for (s32 tap = 0; tap < tap_count; ++tap)
+            {
+                s32 wrapped = ((first + tap) % (s32) src_count + (s32) src_count) % (s32) src_count;
+                const float* pixel = src + line * src_line_step + wrapped * src_step;
+                for (u32 c = 0; c < 4; ++c)
+                {
+                    sum[c] += weights[tap] * pixel[c];
+                }
+            }
+
+            float* out = dst + line * dst_line_step + i * dst_step;
+            for (u32 c = 0; c < 4; ++c)
+            {
+                out[c] = sum[c];
+            }
+        }
+    }
+
+    free(weights);
+}
+
+static float srgb_to_linear(float value)
+{
+    return value <= 0.04045f ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linear_to_srgb(float value)
+{
+    return value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+bool cook_texture(const char* path, bool srgb, CookedTexture* cooked)
+{
+    int w, h, n;
+    u8* image = stbi_load(path, &w, &h, &n, 4);
+    if (!image)
+    {
+        return false;
+    }
+
+    cooked->width = w;
+    cooked->height = h;
+    cooked->srgb = srgb;
+    cooked->mapping = MappedFile();
+
+    u32 largest_side = w > h ? w : h;
+    cooked->level_count = 1;
+    while (largest_side >> cooked->level_count && cooked->level_count < MAX_MIP_LEVELS)
+    {
+        ++cooked->level_count;
+    }
+
+    size_t total_bytes = 0;
+    for (u32 level = 0; level < cooked->level_count; ++level)
+    {
+        total_bytes += level_bytes(*cooked, level);
+    }
+
+    u8* level_data = (u8*) malloc(total_bytes);
+    for (u32 level = 0; level < cooked->level_count; ++level)
+    {
+        cooked->levels[level] = level_data;
+        level_data += level_bytes(*cooked, level);
+    }
+
+    memcpy((u8*) cooked->levels[0], image, level_bytes(*cooked, 0));
+    stbi_image_free(image);
+
+    // Filtering is done on linear values, and each level is filtered from the one above it
+    float to_linear[256];
+    for (u32 i = 0; i < 256; ++i)
+    {
+        to_linear[i] = srgb ? srgb_to_linear(i / 255.0f) : i / 255.0f;
+    }
+
+    float* source = (float*) malloc(4 * w * h * sizeof(float));
+    float* horizontal = (float*) malloc(4 * w * h * sizeof(float));
+    float* filtered = (float*) malloc(4 * w * h * sizeof(float));
+
+    for (u32 i = 0; i < 4 * (u32) (w * h); ++i)
+    {
+        // Alpha is never sRGB encoded
+        u8 value = cooked->levels[0][i];
+        source[i] = i % 4 == 3 ? value / 255.0f : to_linear[value];
+    }
+
+    for (u32 level = 1; level < cooked->level_count; ++level)
+    {
+        u32 src_width = mip_level_width(*cooked, level - 1);
+        u32 src_height = mip_level_height(*cooked, level - 1);
+        u32 dst_width = mip_level_width(*cooked, level);
+        u32 dst_height = mip_level_height(*cooked, level);
+
+        resample(source, src_width, 4, 4 * src_width, horizontal, dst_width, 4, 4 * dst_width, src_height);
+        resample(horizontal, src_height, 4 * dst_width, 4, filtered, dst_height, 4 * dst_width, 4, dst_width);
+
+        u8* out = (u8*) cooked->levels[level];
+        for (u32 i = 0; i < 4 * dst_width * dst_height; ++i)
+        {
+            // The filter has negative lobes, so values can overshoot
+            float value = fminf(fmaxf(filtered[i], 0.0f), 1.0f);
+            if (srgb && i % 4 != 3)
+            {
+                value = linear_to_srgb(value);
+            }
+            out[i] = (u8) (value * 255.0f + 0.5f);
+        }
+
+        float* swap = source;
+        source = filtered;
+        filtered = swap;
+    }
+
+    free(source);
+    free(horizontal);
+    free(filtered);
+
+    return true;
+}
+
+static void get_cache_path(const char* source_path, char* cache_path, size_t size)
+{
+    snprintf(cache_path, size, "%s.texcache", source_path);
+}
+
+bool open_texture_cache(const char* source_path, bool srgb, CookedTexture* cooked)
+{
+    char cache_path[512];
+    get_cache_path(source_path, cache_path, sizeof(cache_path));
+
+    MappedFile mapping;
+    if (!map_file(cache_path, &mapping))
+    {
+        return false;
+    }
+
+    const TextureCacheHeader* header = (const TextureCacheHeader*) mapping.data;
+
+    bool valid = mapping.size >= sizeof(TextureCacheHeader)
+                 && header->magic == TEXTURE_CACHE_MAGIC
+                 && header->version == TEXTURE_CACHE_VERSION
+                 && header->srgb == (u32) srgb
+                 && header->level_count > 0
+                 && header->level_count <= MAX_MIP_LEVELS;
+
+    if (valid)
+    {
+        cooked->width = header->width;
+        cooked->height = header->height;
+        cooked->level_count = header->level_count;
+        cooked->srgb = srgb;
+
+        size_t expected_size = sizeof(TextureCacheHeader);
+        for (u32 level = 0; level < cooked->level_count; ++level)
+        {
+            cooked->levels[level] = mapping.data + expected_size;
+            expected_size += level_bytes(*cooked, level);
+        }
+
+        valid = expected_size == mapping.size && source_unchanged(source_path, header->source);
+    }
+
+    if (!valid)
+    {
+        unmap_file(&mapping);
+        return false;
+    }
+
+    cooked->mapping = mapping;
+    return true;
+}
+
+void write_texture_cache(const char* source_path, const CookedTexture& cooked)
+{
+    TextureCacheHeader header;
+    header.magic = TEXTURE_CACHE_MAGIC;
+    header.version = TEXTURE_CACHE_VERSION;
+    header.srgb = cooked.srgb;
+    header.width = cooked.width;
+    header.height = cooked.height;
+    header.level_count = cooked.level_count;
+
+    if (!stamp_source(source_path, &header.source))
+    {
+        return;
+    }
+
+    char cache_path[512];
+    get_cache_path(source_path, cache_path, sizeof(cache_path));
+
+    FILE* cache_file = begin_cache_write(cache_path);
+    if (!cache_file)
+    {
+        return;
+    }
+
+    fwrite(&header, sizeof(TextureCacheHeader), 1, cache_file);
+    for (u32 level = 0; level < cooked.level_count; ++level)
+    {
+        fwrite(cooked.levels[level], 1, level_bytes(cooked, level), cache_file);
+    }
+
+    end_cache_write(cache_file, cache_path);
+}
+
+void free_cooked_texture(CookedTexture* cooked)
+{
+    if (cooked->mapping.data)
+    {
+        unmap_file(&cooked->mapping);
+    }
+    else
+    {
+        free((void*) cooked->levels[0]);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "asset_cache.h"
+#include "util.h"
+
+// Cooked textures are stored next to their source file, as <source>.texcache
+#define TEXTURE_CACHE_VERSION 1
+
+#define MAX_MIP_LEVELS 16
+
+// An RGBA8 image with a full mip chain, in the form it is uploaded in
+struct CookedTexture
+{
+    u32 width;
+    u32 height;
+    u32 level_count;
+
+    // Whether the image holds sRGB encoded colors, in which case mips are filtered in linear light
+    bool srgb;
+
+    // Level i is max(width >> i, 1) by max(height >> i, 1) pixels
+    const u8* levels[MAX_MIP_LEVELS];
+
+    // The file mapping the levels point into, if the texture was read from a cache.
+    // Otherwise all levels are one allocation starting at levels[0].
+    MappedFile mapping;
+};
+
+u32 mip_level_width(const CookedTexture& texture, u32 level);
+u32 mip_level_height(const CookedTexture& texture, u32 level);
+
+// Decodes an image and builds its mip chain with a Kaiser windowed sinc filter.
+// Returns false if the image can't be loaded.
+bool cook_texture(const char* path, bool srgb, CookedTexture* cooked);
+
+// Maps the cache of source_path if it was cooked from the current source file with the same settings
+bool open_texture_cache(const char* source_path, bool srgb, CookedTexture* cooked);
+
+void write_texture_cache(const char* source_path, const CookedTexture& cooked);
+
+// Frees a cooked texture, whether it was cooked or read from a cache
+void free_cooked_texture(CookedTexture* cooked);
@@ -0,0 +1,171 @@
+#include "texture_loader.h"
+#include "profiler.h"
+
+#include "stb_image.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define MAX_TEXTURE_LOADS 1024
+#define MAX_LOADER_THREADS 8
+
+// Fixed size FIFO of loads
+struct LoadQueue
+{
+    TextureLoad loads[MAX_TEXTURE_LOADS];
+    u32 first = 0;
+    u32 count = 0;
+
+    void push(const TextureLoad& load)
+    {
+        assert(count < MAX_TEXTURE_LOADS);
+        loads[(first + count) % MAX_TEXTURE_LOADS] = load;
+        ++count;
+    }
+
+    TextureLoad pop()
+    {
+        assert(count);
+        TextureLoad load = loads[first];
+        first = (first + 1) % MAX_TEXTURE_LOADS;
+        --count;
+        return load;
+    }
+};
+
+// Everything below is protected by loader_mutex
+static std::mutex loader_mutex;
+static std::condition_variable request_ready;
+static std::condition_variable load_finished;
+
+static LoadQueue requested;
+static LoadQueue finished;
+static u32 in_flight = 0;
+static bool stopping = false;
+
+static std::thread threads[MAX_LOADER_THREADS];
+static u32 thread_count = 0;
+
+static void load_texture_worker()
+{
+    PROFILE_THREAD("Texture loader");
+
+    for (;;)
+    {
+        TextureLoad load;
+        {
+            std::unique_lock<std::mutex> lock(loader_mutex);
+            request_ready.wait(lock, [] { return stopping || requested.count; });
+            if (stopping)
+            {
+                return;
+            }
+            load = requested.pop();
+        }
+
+        PROFILE_SCOPE("Load texture");
+        load.error = nullptr;
+        load.loaded = open_texture_cache(load.path, load.srgb, &load.cooked);
+        if (!load.loaded)
+        {
+            load.loaded = cook_texture(load.path, load.srgb, &load.cooked);
+            if (load.loaded)
+            {
+                write_texture_cache(load.path, load.cooked);
+            }
+            else
+            {
+                // The failure reason is thread local, so it has to be read here
+                load.error = stbi_failure_reason();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(loader_mutex);
+            finished.push(load);
+        }
+        load_finished.notify_one();
+    }
+}
+
+void start_texture_loader(u32 count)
+{
+    assert(!thread_count);
+
+    if (count < 1) count = 1;
+    if (count > MAX_LOADER_THREADS) count = MAX_LOADER_THREADS;
+
+    stopping = false;
+    for (thread_count = 0; thread_count < count; ++thread_count)
+    {
+        threads[thread_count] = std::thread(load_texture_worker);
+    }
+}
+
+void stop_texture_loader()
+{
+    {
+        std::lock_guard<std::mutex> lock(loader_mutex);
+        stopping = true;
+    }
+    request_ready.notify_all();
+
+    for (u32 i = 0; i < thread_count; ++i)
+    {
+        threads[i].join();
+    }
+    thread_count = 0;
+
+    // Loads that were never polled still own their images
+    while (finished.count)
+    {
+        TextureLoad load = finished.pop();
+        if (load.loaded)
+        {
+            free_cooked_texture(&load.cooked);
+        }
+    }
+    requested.count = 0;
+    in_flight = 0;
+}
+
+void request_texture_load(u32 texture_id, const char* path, bool srgb)
+{
+    TextureLoad load;
+    load.texture_id = texture_id;
+    load.path = path;
+    load.srgb = srgb;
+
+    {
+        std::lock_guard<std::mutex> lock(loader_mutex);
+        requested.push(load);
+        ++in_flight;
+    }
+    request_ready.notify_one();
+}
+
+bool poll_texture_load(TextureLoad* load, bool wait)
+{
+    std::unique_lock<std::mutex> lock(loader_mutex);
+
+    if (wait)
+    {
+        load_finished.wait(lock, [] { return finished.count || !in_flight; });
+    }
+
+    if (!finished.count)
+    {
+        return false;
+    }
+
+    *load = finished.pop();
+    --in_flight;
+    return true;
+}
+
+u32 texture_loads_in_flight()
+{
+    std::lock_guard<std::mutex> lock(loader_mutex);
+    return in_flight;
+}
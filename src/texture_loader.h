@@ -0,0 +1,32 @@
+#pragma once
+
+#include "texture_cache.h"
+#include "util.h"
+
+// Loads textures on worker threads, from the texture cache or by cooking the source image
+
+struct TextureLoad
+{
+    u32 texture_id;
+
+    // Must stay valid until the load is polled
+    const char* path;
+    bool srgb;
+
+    // Set by the worker. If loaded is false, error describes why.
+    bool loaded;
+    const char* error;
+    CookedTexture cooked;
+};
+
+void start_texture_loader(u32 thread_count);
+void stop_texture_loader();
+
+void request_texture_load(u32 texture_id, const char* path, bool srgb);
+
+// Takes a finished load. If wait is set, blocks until a load finishes unless no loads are
+// in flight. Returns false if no load was taken.
+bool poll_texture_load(TextureLoad* load, bool wait);
+
+// Loads that have been requested but not polled yet
+u32 texture_loads_in_flight();
@@ -0,0 +1,66 @@
+#include "culling.h"
+
+#include <cstdio>
+
+using hbmath::Mat4;
+using hbmath::Vec3;
+
+static OcclusionBuffer occlusion_buffer;
+static CullBoxes boxes;
+static u8 visible[MAX_CULL_BOXES];
+
+static int failures = 0;
+
+static void expect_visible(const char* name, bool expected)
+{
+    u32 index = boxes.count - 1;
+    if (bool(visible[index]) != expected)
+    {
+        fprintf(stderr, "FAIL: %s is %s\n", name, visible[index] ? "visible" : "occluded");
+        ++failures;
+    }
+}
+
+// Culls the box with the given bounds alone against the occlusion buffer
+static void cull_box(Vec3 min, Vec3 max)
+{
+    boxes.clear();
+    boxes.push(Aabb(min, max), Transform3d());
+    visible[0] = 1;
+    cull_occluded_boxes(occlusion_buffer, boxes, visible, nullptr);
+}
+
+int main()
+{
+    // An orthographic view one unit per occlusion pixel, looking down -z, so that world x and
+    // y are the occlusion buffer's pixel coordinates offset to the centre of the buffer
+    Mat4 matrix = Mat4::Orthographic(0.1f, 100.0f, float(OCCLUSION_WIDTH), float(OCCLUSION_HEIGHT));
+    clear_occlusion_buffer(&occlusion_buffer, matrix);
+
+    // A wall whose right edge is at x = 131.7 in the buffer, past the centre of pixel 131.
+    // That is the last of a group of four, which box tests load together.
+    const float right = 3.7f;
+    const Vec3 wall[6] = {
+        Vec3(-28.0f, -20.0f, -10.0f), Vec3(right, -20.0f, -10.0f), Vec3(right, 20.0f, -10.0f),
+        Vec3(-28.0f, -20.0f, -10.0f), Vec3(right, 20.0f, -10.0f), Vec3(-28.0f, 20.0f, -10.0f),
+    };
+    rasterize_occluder(&occlusion_buffer, wall, 6, Transform3d(), nullptr);
+
+    cull_box(Vec3(-6.0f, -1.0f, -31.0f), Vec3(-4.0f, 1.0f, -29.0f));
+    expect_visible("box behind the wall", false);
+
+    cull_box(Vec3(-6.0f, -1.0f, -9.0f), Vec3(-4.0f, 1.0f, -8.0f));
+    expect_visible("box in front of the wall", true);
+
+    // Inside pixel 131, but to the right of the wall's edge
+    cull_box(Vec3(right + 0.1f, -1.0f, -31.0f), Vec3(right + 0.25f, 1.0f, -29.0f));
+    expect_visible("box just outside the wall's edge", true);
+
+    if (failures)
+    {
+        return 1;
+    }
+
+    printf("culling_test passed\n");
+    return 0;
+}